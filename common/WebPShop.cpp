@@ -104,20 +104,37 @@ DLLExport MACPASCAL void PluginMain(const int16 selector,
         WebPInitDecoderConfig(&data->read_config);
         data->write_config.quality = 75;
         data->write_config.compression = Compression::DEFAULT;
+        data->write_config.profile = EncoderProfile::STANDARD;
         data->write_config.keep_exif = false;
         data->write_config.keep_xmp = false;
         data->write_config.keep_color_profile = false;
         data->write_config.loop_forever = true;
         data->write_config.animation = false;
         data->write_config.display_proxy = false;
+        data->write_config.parallel_animation = false;
+        data->write_config.target_size = 0;
+        data->write_config.target_metric = DistortionMetric::NO_METRIC;
+        data->write_config.target_distortion = 0.0;
+        data->write_config.race_lossless = false;
+        data->write_config.time_budget_ms = 0;
+        data->write_config.encode_cache_size_mb = 0;
+        data->write_config.num_downscaled_copies = 0;
+        data->write_config.thumbnail_size = 0;
+        data->write_config.num_quality_rungs = 0;
+        data->write_config.layers_to_files = false;
+        data->write_config.auto_preset = false;
         data->file_size = 0;
         data->file_data = nullptr;
+        data->file_data_is_mapped = false;
+        data->decoded_image = ImageMemoryDesc();
         data->metadata[Metadata::kEXIF].four_cc = "EXIF";
         data->metadata[Metadata::kXMP].four_cc = "XMP ";
         data->metadata[Metadata::kICCP].four_cc = "ICCP";
         for (Metadata& metadata : data->metadata) WebPDataInit(&metadata.chunk);
         WebPDataInit(&data->encoded_data);
         data->anim_decoder = nullptr;
+        data->anim_info = WebPAnimInfo();
+        data->frame_lookahead = nullptr;
         data->last_frame_timestamp = 0;
         data->sPSChannelPortsSuite = nullptr;
 
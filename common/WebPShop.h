@@ -28,8 +28,12 @@
 #ifndef __WebPShop_H__
 #define __WebPShop_H__
 
+#include <atomic>
+#include <chrono>
 #include <fstream>
+#include <functional>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "PIFormat.h"
@@ -51,6 +55,9 @@
 
 #define MAX_NUM_BROWSED_CHANNELS 16
 #define MAX_NUM_BROWSED_LAYERS 4096
+#define MAX_NUM_WORKER_THREADS 64
+#define MAX_NUM_DOWNSCALED_COPIES 8
+#define MAX_NUM_QUALITY_RUNGS 16
 
 //------------------------------------------------------------------------------
 // Macros
@@ -87,17 +94,39 @@
 // Data
 
 enum Compression { FASTEST = 0, DEFAULT = 1, SLOWEST = 2 };
+enum DistortionMetric { NO_METRIC = 0, PSNR = 1, SSIM = 2 };
+// Advanced libwebp settings, orthogonal to the compression effort.
+enum EncoderProfile {
+  STANDARD = 0,       // libwebp defaults.
+  MULTITHREADED = 1,  // thread_level: same output, faster on several cores.
+  LOW_MEMORY = 2,     // low_memory and canvas streamed by bands, slower.
+  SMALL_ALPHA = 3     // Best alpha_filtering: smaller alpha, slower.
+};
 
 // Encoding parameters, closely tied to the UI.
 struct WriteConfig {
   int quality;  // [0..100]
   Compression compression;
+  EncoderProfile profile;
   bool keep_exif;
   bool keep_xmp;
   bool keep_color_profile;
   bool loop_forever;
   bool animation;
   bool display_proxy;
+  bool parallel_animation;  // Encode animation segments concurrently.
+  int32 target_size;        // In bytes. Overrides quality if not 0.
+  DistortionMetric target_metric;  // Overrides quality if not NO_METRIC.
+  double target_distortion;        // PSNR in dB or SSIM in [0:1].
+  bool race_lossless;  // Also encode losslessly and keep the smaller one.
+  int32 time_budget_ms;  // Overrides compression effort if not 0.
+  int32 encode_cache_size_mb;  // Reuses identical encodings if not 0.
+  int32 num_downscaled_copies;  // Halved images saved next to the file.
+  int32 thumbnail_size;  // Max width and height of another saved image.
+  int32 quality_ladder[MAX_NUM_QUALITY_RUNGS];  // Other saved qualities.
+  int32 num_quality_rungs;
+  bool layers_to_files;  // Also saves each layer next to the file.
+  bool auto_preset;  // Overrides quality and compression for still images.
 };
 
 struct Metadata {
@@ -106,6 +135,17 @@ struct Metadata {
   WebPData chunk;
 };
 
+// Stores an image.
+struct ImageMemoryDesc {
+  PixelMemoryDesc pixels = {nullptr, 0, 0, 0, 0};
+  int32 width = 0;
+  int32 height = 0;
+  int num_channels = 0;
+  int32 mode = 0;
+};
+
+struct FrameLookahead;  // See WebPShopSelectorReadLayer.cpp
+
 // An instance of Data will be allocated on the first time the plugin is
 // solicited and it will be freed by Photoshop. Everything that must stay
 // between plugin calls should go into it (to avoid globals).
@@ -113,37 +153,50 @@ struct Data {
   WebPDecoderConfig read_config;
   WriteConfig write_config;
   size_t file_size;
-  void* file_data;
+  void* file_data;  // See MapFileData() and ReadFileData().
+  bool file_data_is_mapped;
+  ImageMemoryDesc decoded_image;  // Still image decoded by ReadFileData().
   Metadata metadata[Metadata::kNum];
   WebPData encoded_data;
   WebPAnimDecoder* anim_decoder;
+  WebPAnimInfo anim_info;  // Copied before frame_lookahead uses anim_decoder.
+  FrameLookahead* frame_lookahead;  // Decodes anim_decoder frames ahead.
   int last_frame_timestamp;
   uint16 layer_name_buffer[256];
   PSChannelPortsSuite1* sPSChannelPortsSuite;
 };
 
-// Stores an image.
-struct ImageMemoryDesc {
-  PixelMemoryDesc pixels = {nullptr, 0, 0, 0, 0};
-  int32 width = 0;
-  int32 height = 0;
-  int num_channels = 0;
-  int32 mode = 0;
-};
-
 // Stores a frame (image with a duration).
 struct FrameMemoryDesc {
   ImageMemoryDesc image;
   int duration_ms = 0;
 };
 
+// Progress of a long task, possibly split across worker threads. The host is
+// only called from the thread that initialized it, to report the progress and
+// to check whether the user cancelled the task.
+struct Progress {
+  FormatRecordPtr format_record = nullptr;  // No host calls if null.
+  std::thread::id host_thread;
+  std::atomic<uint64_t> num_done_units{0};
+  std::atomic<uint64_t> num_units{0};
+  std::atomic<bool> canceled{false};
+  std::chrono::steady_clock::time_point last_poll;  // Host thread only.
+};
+
 //------------------------------------------------------------------------------
 // User interface
 
-// Displays a window with writing (encoding) options.
+// Fills the original frames given to DoUI(). Returns false on failure.
+typedef std::function<bool(std::vector<FrameMemoryDesc>* const frames)>
+    FramesLoader;
+
+// Displays a window with writing (encoding) options. If original_frames is
+// empty, it is filled with load_original_frames() when first needed.
 bool DoUI(WriteConfig* const write_config,
           const Metadata metadata[Metadata::kNum], SPPluginRef plugin_ref,
-          const std::vector<FrameMemoryDesc>& original_frames,
+          std::vector<FrameMemoryDesc>* const original_frames,
+          const FramesLoader& load_original_frames,
           bool original_frames_were_converted_to_8b,
           WebPData* const encoded_data, DisplayPixelsProc display_pixels_proc);
 void DoAboutBox(SPPluginRef plugin_ref);
@@ -183,6 +236,13 @@ void AllocateAndRead(size_t count, void** const buffer,
                      FormatRecordPtr format_record, int16* const result);
 void Deallocate(void** const buffer);
 
+// With POSIX I/O, sets data->file_data to the first data->file_size bytes of
+// the file opened by host, mapped in memory. Returns false if it is not
+// possible, in which case the file must be read with ReadFileData().
+bool MapFileData(FormatRecordPtr format_record, Data* const data);
+// Unmaps or deallocates data->file_data.
+void ReleaseFileData(Data* const data);
+
 //------------------------------------------------------------------------------
 // Image utils
 
@@ -197,6 +257,10 @@ void ClearFrameVector(std::vector<FrameMemoryDesc>* const frames);
 
 bool Scale(const ImageMemoryDesc& src, ImageMemoryDesc* const dst,
            size_t dst_width, size_t dst_height);
+// Averages the area covered by each destination pixel, weighted by alpha.
+// Only 8-bit sources and smaller or equal destinations are supported.
+bool ScaleDown(const ImageMemoryDesc& src, ImageMemoryDesc* const dst,
+               size_t dst_width, size_t dst_height);
 bool Crop(const ImageMemoryDesc& src, ImageMemoryDesc* const dst,
           size_t crop_width, size_t crop_height, size_t crop_left,
           size_t crop_top);
@@ -221,45 +285,320 @@ VRect ScaleRectFromAreaToArea(const VRect& src, int32 src_area_width,
 
 // Requests data for whole canvas from host, stores it in format_record->data.
 void RequestWholeCanvas(FormatRecordPtr format_record, int16* const result);
-// Copies merged canvas from host into destination.
+// Copies merged canvas from host into destination, as 8-bit BGRA. If
+// keep_rgb, opaque canvases (including ones with an unused transparency
+// channel) are copied as 8-bit BGR instead.
 void CopyWholeCanvas(FormatRecordPtr format_record, Data* const data,
-                     int16* const result, ImageMemoryDesc* const destination);
-// Copies each layer (without effects) from host into destination.
+                     bool keep_rgb, int16* const result,
+                     ImageMemoryDesc* const destination);
+// Copies merged canvas from host into destination, by bands of rows converted
+// to 8 bits then to ARGB if use_argb, or to YUVA otherwise. The whole canvas
+// is never held at its original depth nor as BGRA besides the ARGB samples.
+// Sets *result to userCanceledErr if cancelled.
+void StreamWholeCanvas(FormatRecordPtr format_record, Data* const data,
+                       bool use_argb, Progress* const progress,
+                       int16* const result, WebPPicture* const destination);
+// Lists the layers of the document opened by host, in order.
+bool GetLayers(FormatRecordPtr format_record, int16* const result,
+               std::vector<const ReadLayerDesc*>* const layers);
+// Copies one layer (without effects) from host into destination, as above.
+void CopyLayer(FormatRecordPtr format_record, Data* const data,
+               const ReadLayerDesc& layer, bool keep_rgb, int16* const result,
+               ImageMemoryDesc* const destination);
+// Same as CopyLayer() with BGRA but the pixels keep the bit depth of the
+// document. A 16 or 32-bit destination may have no alpha channel and must be
+// converted with To8bit() before encoding.
+void CopyLayerAtSourceDepth(FormatRecordPtr format_record, Data* const data,
+                            const ReadLayerDesc& layer, int16* const result,
+                            ImageMemoryDesc* const destination);
+// Copies each layer (without effects) from host into destination. The
+// duration of each frame is extracted from the layer name.
+// Sets *result to userCanceledErr if cancelled.
 void CopyAllLayers(FormatRecordPtr format_record, Data* const data,
-                   int16* const result,
+                   Progress* const progress, int16* const result,
                    std::vector<FrameMemoryDesc>* const destination);
 
+//------------------------------------------------------------------------------
+// Analysis utils
+
+// Statistics of an image, to choose the encoding settings.
+struct ImageStats {
+  int num_colors = 0;        // Capped at 257.
+  double edge_density = 0;   // Ratio of visible pixels with sharp neighbors,
+  double smoothness = 0;     // with soft gradients,
+  double flatness = 0;       // or with identical neighbors.
+  double transparency = 0;   // Ratio of fully transparent pixels.
+  double translucency = 0;   // Ratio of partially transparent pixels.
+};
+
+// Computes the statistics of an 8-bit BGRA image in a single pass, except for
+// gradients and alpha which are measured on a subset of the rows.
+// Uses SSE2 or NEON if available.
+bool AnalyzeImage(const ImageMemoryDesc& image, ImageStats* const stats);
+
+// Replaces write_config->quality (lossless, near-lossless or lossy) and
+// compression by the ones expected to suit the image best.
+void ApplyAutoPreset(const ImageMemoryDesc& image,
+                     WriteConfig* const write_config);
+
 //------------------------------------------------------------------------------
 // Encode utils
 
 // Fills config parameters with settings in write_config.
 void SetWebPConfig(WebPConfig* const config, const WriteConfig& write_config);
 
-// Wraps an ImageMemoryDesc into a WebPPicture.
+// Sets config->method and use_sharp_yuv to the slowest combination expected
+// to encode num_pixels within time_budget_ms, according to the speed of each
+// one measured on a crop of sample_image.
+bool SetWebPConfigForTimeBudget(const ImageMemoryDesc& sample_image,
+                                double num_pixels, int32 time_budget_ms,
+                                WebPConfig* const config);
+
+// Wraps an ImageMemoryDesc into a WebPPicture. BGR images are imported
+// instead, straight to YUV if 'config' allows it.
 // WebPPictureInit() must be called on 'dst' prior to calling this and
 // WebPPictureFree() must be called afterwards.
 bool CastToWebPPicture(const WebPConfig& config, const ImageMemoryDesc& src,
                        WebPPicture* const dst);
+// Converts the 8-bit BGR(A) 'rows' into the YUV(A) samples of 'dst' starting
+// at the even row 'top', exactly as libwebp would for the whole picture.
+// 'dst' must be allocated with WEBP_YUV420A if any row may have alpha.
+bool ImportYUVARows(const ImageMemoryDesc& rows, int32 top,
+                    WebPPicture* const dst);
 
 // Encodes original_image into encoded_data.
+// If write_config.parallel_animation is set, EncodeAllFrames() splits the
+// frames at fully opaque ones and encodes the segments concurrently.
+// If write_config.target_size or target_metric is set, the quality is
+// searched instead (the size has priority).
+// If write_config.race_lossless is set, EncodeOneImage() also encodes
+// losslessly at the same time and keeps the smaller output.
+// If write_config.time_budget_ms is set, the effort is chosen accordingly and
+// lowered during the encoding if it takes longer than expected.
+// If write_config.auto_preset is set and there is no target, EncodeOneImage()
+// chooses the quality and compression with ApplyAutoPreset().
+// The progress is reported to 'progress' if not null. Returns false if
+// cancelled.
 bool EncodeOneImage(const ImageMemoryDesc& original_image,
-                    const WriteConfig& write_config,
+                    const WriteConfig& write_config, Progress* const progress,
                     WebPData* const encoded_data);
 bool EncodeAllFrames(const std::vector<FrameMemoryDesc>& original_frames,
-                     const WriteConfig& write_config,
+                     const WriteConfig& write_config, Progress* const progress,
                      WebPData* const encoded_data);
 
+// Returns true if write_config allows EncodeAllLayers(), that is a single
+// pass over the frames in order.
+bool CanStreamAllLayers(const WriteConfig& write_config);
+// Reads each layer from host and gives it to the animation encoder, so that
+// the memory does not depend on the number of frames. With several cores, the
+// layers are read, converted to 8 bits and encoded concurrently, and frames
+// identical to the previous one are not given to the encoder (same output).
+// The busy time of each stage is logged. Sets *result to userCanceledErr if
+// cancelled.
+void EncodeAllLayers(FormatRecordPtr format_record, Data* const data,
+                     Progress* const progress, int16* const result,
+                     WebPData* const encoded_data);
+
+// Encodes original_image with each of the given qualities concurrently, the
+// other settings being the same except for those encoding several times
+// (target size or distortion, lossless race, time budget) which are ignored.
+// The RGBA to YUVA conversion is shared by all lossy qualities.
+bool EncodeQualityLadder(const ImageMemoryDesc& original_image,
+                         const WriteConfig& write_config,
+                         const std::vector<int>& qualities,
+                         Progress* const progress,
+                         std::vector<WebPData>* const encoded_data);
+
+//------------------------------------------------------------------------------
+// Encode target utils
+
+// Encodes an image or animation with the given settings into encoded_data.
+typedef std::function<bool(const WriteConfig& write_config,
+                           WebPData* const encoded_data)>
+    EncodeFunction;
+
+// Calls encode() with several lossy qualities concurrently, narrowing down to
+// the highest one whose output fits in write_config.target_size bytes. Keeps
+// the smallest output if none fits. See FitTargetSizeToFile() for metadata.
+bool EncodeToTargetSize(const WriteConfig& write_config,
+                        const EncodeFunction& encode, Progress* const progress,
+                        WebPData* const encoded_data);
+
+// Decodes encoded_data and returns the distortion compared to the original.
+typedef std::function<bool(const WebPData& encoded_data,
+                           DistortionMetric metric, double* const distortion)>
+    MeasureFunction;
+
+// Same as above but keeps the lowest lossy quality whose distortion reaches
+// write_config.target_distortion. Falls back to lossless if none does.
+bool EncodeToTargetDistortion(const WriteConfig& write_config,
+                              const EncodeFunction& encode,
+                              const MeasureFunction& measure,
+                              Progress* const progress,
+                              WebPData* const encoded_data);
+
+//------------------------------------------------------------------------------
+// Encode cache utils
+
+// Returns a key identifying the bitstream obtained by encoding the pixels
+// with the settings affecting it and the current version of libwebp.
+std::string GetEncodeCacheKey(const ImageMemoryDesc& original_image,
+                              const WriteConfig& write_config);
+std::string GetEncodeCacheKey(
+    const std::vector<FrameMemoryDesc>& original_frames,
+    const WriteConfig& write_config);
+// Returns a key identifying the pixels only, such as to find identical frames.
+std::string GetImageKey(const ImageMemoryDesc& image);
+
+// Retrieves a bitstream previously stored on disk with the same key, without
+// metadata. Returns false if there is none or if it is corrupted.
+bool LoadFromEncodeCache(const std::string& key, WebPData* const encoded_data);
+// Stores encoded_data on disk for later exports, then evicts the least
+// recently used entries beyond write_config.encode_cache_size_mb.
+void StoreInEncodeCache(const std::string& key, const WebPData& encoded_data,
+                        const WriteConfig& write_config);
+
+//------------------------------------------------------------------------------
+// Export utils
+
+// Retrieves the UTF-8 path of the file opened by host without its extension.
+// Returns false if unknown.
+bool GetHostFileBasePath(FormatRecordPtr format_record,
+                         std::string* const base_path);
+// Writes encoded_data and kept metadata to base_path + suffix + ".webp".
+// Can be called from any thread.
+bool WriteToSiblingFile(const std::string& base_path, const std::string& suffix,
+                        const WebPData& encoded_data,
+                        const WriteConfig& write_config,
+                        const Metadata metadata[Metadata::kNum]);
+
+// Resamples original_image to the sizes set by write_config.thumbnail_size
+// and num_downscaled_copies, encodes them concurrently and writes them next to
+// the file opened by host. Sets *result to userCanceledErr if cancelled.
+void ExportDownscaledCopies(const ImageMemoryDesc& original_image,
+                            const WriteConfig& write_config,
+                            const Metadata metadata[Metadata::kNum],
+                            FormatRecordPtr format_record,
+                            Progress* const progress, int16* const result);
+// Encodes original_image with each quality of write_config.quality_ladder and
+// writes them next to the file opened by host.
+void ExportQualityLadder(const ImageMemoryDesc& original_image,
+                         const WriteConfig& write_config,
+                         const Metadata metadata[Metadata::kNum],
+                         FormatRecordPtr format_record,
+                         Progress* const progress, int16* const result);
+
+// Encodes each layer of the document (without effects) to its own file, named
+// after the layer and written next to the file opened by host. The layers are
+// copied from host one at a time and encoded concurrently.
+// Sets *result to userCanceledErr if cancelled.
+void ExportLayersToFiles(FormatRecordPtr format_record, Data* const data,
+                         Progress* const progress, int16* const result);
+
+//------------------------------------------------------------------------------
+// Metrics utils
+
+// Compares an original BGRA image with its decoded RGBA counterpart, color
+// being premultiplied by alpha. Returns a PSNR in dB (capped at 99) or a SSIM
+// in [0:1] (1 is identical). Uses SSE2 or NEON if available.
+bool ComputeDistortion(const ImageMemoryDesc& original,
+                       const ImageMemoryDesc& compressed,
+                       DistortionMetric metric, double* const distortion);
+const char* GetDistortionMetricName(DistortionMetric metric);
+
+// Decodes encoded_data and compares it with the original. For animations,
+// the distortion of each frame is logged and the worst one is returned.
+bool MeasureOneImage(const ImageMemoryDesc& original_image,
+                     const WebPData& encoded_data, DistortionMetric metric,
+                     double* const distortion);
+bool MeasureAllFrames(const std::vector<FrameMemoryDesc>& original_frames,
+                      const WebPData& encoded_data, DistortionMetric metric,
+                      double* const distortion);
+
+//------------------------------------------------------------------------------
+// Metadata utils
+
 // Retrieves metadata from host (current Photoshop document).
 OSErr GetHostMetadata(FormatRecordPtr format_record,
                       Metadata metadata[Metadata::kNum]);
-// Adds kept available metadata (EXIF, XMP, ICC) to encoded_data.
-bool EncodeMetadata(const WriteConfig& write_config,
-                    const Metadata metadata[Metadata::kNum],
-                    WebPData* const encoded_data);
 
-// Writes encoded_data to file opened by host.
-void WriteToFile(const WebPData& encoded_data, FormatRecordPtr format_record,
-                 int16* const result);
+//------------------------------------------------------------------------------
+// RIFF utils
+
+// Points metadata[].chunk to the last EXIF, XMP and ICCP chunks of
+// encoded_data, without any copy. These views must not be deallocated.
+bool FindMetadataChunks(const WebPData& encoded_data,
+                        Metadata metadata[Metadata::kNum]);
+
+// Receives the output of a RIFFWriter. Returns false on failure.
+typedef std::function<bool(const uint8_t* data, size_t data_size)> RIFFSink;
+
+// Outputs a WebP bitstream to 'sink' as it comes. If there is kept metadata
+// (EXIF, XMP, ICC), the encoder's RIFF header is replaced by a VP8X one and
+// the chunks are inserted around the image data in a single pass, without any
+// copy of the bitstream.
+struct RIFFWriter {
+  // Enough for the RIFF header and a VP8X chunk or a VP8/VP8L header.
+  static const size_t kPrefixSize = 30;
+
+  RIFFSink sink;
+  const Metadata* metadata;
+  bool keep[Metadata::kNum];
+  uint8_t prefix[kPrefixSize];  // Buffered until the header can be written.
+  size_t prefix_size;
+  bool prefix_parsed;
+  bool failed;
+  size_t num_written_bytes;
+};
+
+void RIFFWriterInit(const WriteConfig& write_config,
+                    const Metadata metadata[Metadata::kNum],
+                    const RIFFSink& sink, RIFFWriter* const writer);
+// Same with the file opened by host as sink. Must be used from the host thread.
+void RIFFWriterInitForHostFile(const WriteConfig& write_config,
+                               const Metadata metadata[Metadata::kNum],
+                               FormatRecordPtr format_record,
+                               int16* const result, RIFFWriter* const writer);
+bool RIFFWriterAppend(RIFFWriter* const writer, const uint8_t* data,
+                      size_t data_size);
+bool RIFFWriterFinish(RIFFWriter* const writer);
+// WebPWriterFunction expecting a RIFFWriter as WebPPicture::custom_ptr.
+int RIFFWriterWrite(const uint8_t* data, size_t data_size,
+                    const WebPPicture* picture);
+
+// Returns the size of the output of a RIFFWriter for encoded_data.
+size_t GetFileSize(const WebPData& encoded_data,
+                   const WriteConfig& write_config,
+                   const Metadata metadata[Metadata::kNum]);
+
+// Returns write_config with target_size lowered by the size of the metadata
+// chunks (and VP8X chunk) that a RIFFWriter adds to the bitstream, so that the
+// whole file fits in write_config.target_size bytes.
+WriteConfig FitTargetSizeToFile(const WriteConfig& write_config,
+                                const Metadata metadata[Metadata::kNum]);
+
+// Writes encoded_data and kept metadata to file opened by host.
+void WriteToFile(const WebPData& encoded_data, const WriteConfig& write_config,
+                 const Metadata metadata[Metadata::kNum],
+                 FormatRecordPtr format_record, int16* const result);
+
+// Returns true if write_config allows EncodeWholeCanvasToFile(), that is
+// only one encoding of the canvas and nothing else needing its pixels.
+bool CanStreamWholeCanvas(const WriteConfig& write_config);
+// Encodes the merged canvas, streamed from host with StreamWholeCanvas(),
+// straight into the file opened by host, with kept metadata.
+// Sets *result to userCanceledErr if cancelled.
+void EncodeWholeCanvasToFile(FormatRecordPtr format_record, Data* const data,
+                             Progress* const progress, int16* const result);
+
+// Encodes original_image straight into the file opened by host, with kept
+// metadata. Goes through memory for settings needing several encodings.
+// Sets *result to userCanceledErr if cancelled.
+void EncodeOneImageToFile(const ImageMemoryDesc& original_image,
+                          const WriteConfig& write_config,
+                          const Metadata metadata[Metadata::kNum],
+                          FormatRecordPtr format_record,
+                          Progress* const progress, int16* const result);
 
 //------------------------------------------------------------------------------
 // Decode utils
@@ -267,12 +606,22 @@ void WriteToFile(const WebPData& encoded_data, FormatRecordPtr format_record,
 // Decodes encoded_data into compressed_image.
 bool DecodeOneImage(const WebPData& encoded_data,
                     ImageMemoryDesc* const compressed_image);
-bool DecodeAllFrames(const WebPData& encoded_data,
+bool DecodeAllFrames(const WebPData& encoded_data, Progress* const progress,
                      std::vector<FrameMemoryDesc>* const compressed_frames);
 
-// Gets available metadata from encoded_data.
-bool DecodeMetadata(const WebPData& encoded_data,
-                    Metadata metadata[Metadata::kNum]);
+// Allocates data->decoded_image and returns a decoder outputting RGBA samples
+// into it, multithreaded if possible, or nullptr. data->read_config.input must
+// be set.
+WebPIDecoder* NewIncrementalDecoder(Data* const data);
+
+// Reads data->file_size bytes of the file opened by host into data->file_data,
+// by chunks. If it is a still image, the chunks are given to an incremental
+// decoder on another thread while the next ones are read, and the RGBA pixels
+// are stored in data->decoded_image. Sets *result to userCanceledErr if
+// cancelled.
+void ReadFileData(FormatRecordPtr format_record, Data* const data,
+                  int16* const result);
+
 // Sends metadata to host (current Photoshop document).
 OSErr SetHostMetadata(FormatRecordPtr format_record,
                       const Metadata metadata[Metadata::kNum]);
@@ -288,6 +637,47 @@ void ReleaseAnimDecoder(FormatRecordPtr format_record, Data* const data);
 // continue selectors, according to PIFormat.h.
 void SetPlaneColRowBytes(FormatRecordPtr format_record);
 
+//------------------------------------------------------------------------------
+// Thread utils
+
+// Returns the number of threads that can run concurrently, at least 1.
+int GetNumWorkerThreads();
+
+// Calls task(i) for each i in [0:num_tasks) on up to num_threads threads and
+// returns once all tasks are done. Returns false if any task returned false or
+// threw, in which case the remaining tasks may not be run.
+// If 'progress' is not null, the calling thread polls it while waiting and
+// stops starting new tasks once cancelled.
+bool RunInParallel(size_t num_tasks, int num_threads,
+                   const std::function<bool(size_t task_index)>& task,
+                   Progress* const progress);
+
+// Calls produce(i) on the calling thread then consume(i) on one of up to
+// num_threads threads, for each i in [0:num_items) in order. Production waits
+// when max_num_in_flight items are produced but not consumed yet, bounding the
+// memory. Returns false if any call returned false or threw, in which case the
+// remaining items may not be produced or consumed.
+// If 'progress' is not null, the calling thread polls it while waiting.
+bool RunPipelined(size_t num_items, size_t max_num_in_flight, int num_threads,
+                  const std::function<bool(size_t item_index)>& produce,
+                  const std::function<bool(size_t item_index)>& consume,
+                  Progress* const progress);
+
+//------------------------------------------------------------------------------
+// Progress utils
+
+// Must be called from the host thread. 'format_record' may be null.
+void ProgressInit(FormatRecordPtr format_record, Progress* const progress);
+// Adds num_units to the total amount of work. Can be called from any thread.
+void ProgressAddWork(Progress* const progress, uint64_t num_units);
+// Marks num_units as done then polls. Can be called from any thread.
+bool ProgressAdvance(Progress* const progress, uint64_t num_units);
+// Reports the progress to the host and checks whether the user cancelled,
+// if called from the host thread and if the last poll is not too recent.
+// Returns false if cancelled. Can be called from any thread.
+bool ProgressPoll(Progress* const progress);
+bool ProgressIsCanceled(const Progress* const progress);
+
 //------------------------------------------------------------------------------
 // Animation utils
 
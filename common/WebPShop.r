@@ -173,6 +173,12 @@ resource 'aete'(webpshopResourceID, plugInName " dictionary", purgeable){
              "compression level",
              flagsSingleProperty,
 
+             "Profile",
+             keyWriteConfig_profile,
+             typeInteger,
+             "0 standard, 1 multithreaded, 2 low memory, 3 small alpha",
+             flagsSingleProperty,
+
              "Keep EXIF",
              keyWriteConfig_keep_exif,
              typeBoolean,
@@ -197,6 +203,78 @@ resource 'aete'(webpshopResourceID, plugInName " dictionary", purgeable){
              "loop the animation forever",
              flagsSingleProperty,
 
+             "Parallel Animation",
+             keyWriteConfig_parallel_animation,
+             typeBoolean,
+             "encode animation segments concurrently",
+             flagsSingleProperty,
+
+             "Target Size",
+             keyWriteConfig_target_size,
+             typeInteger,
+             "maximum file size in bytes, 0 to use quality",
+             flagsSingleProperty,
+
+             "Target Metric",
+             keyWriteConfig_target_metric,
+             typeInteger,
+             "0 to use quality, 1 for PSNR, 2 for SSIM",
+             flagsSingleProperty,
+
+             "Target Distortion",
+             keyWriteConfig_target_distortion,
+             typeFloat,
+             "minimum PSNR in dB or SSIM",
+             flagsSingleProperty,
+
+             "Race Lossless",
+             keyWriteConfig_race_lossless,
+             typeBoolean,
+             "also encode losslessly and keep the smaller",
+             flagsSingleProperty,
+
+             "Time Budget",
+             keyWriteConfig_time_budget,
+             typeInteger,
+             "encoding time in milliseconds, 0 to use compression",
+             flagsSingleProperty,
+
+             "Encode Cache Size",
+             keyWriteConfig_encode_cache_size,
+             typeInteger,
+             "disk space in megabytes to reuse encodings, 0 to disable",
+             flagsSingleProperty,
+
+             "Downscaled Copies",
+             keyWriteConfig_num_downscaled_copies,
+             typeInteger,
+             "also save images of half, quarter etc. the size",
+             flagsSingleProperty,
+
+             "Thumbnail Size",
+             keyWriteConfig_thumbnail_size,
+             typeInteger,
+             "also save an image fitting in this many pixels, 0 to disable",
+             flagsSingleProperty,
+
+             "Quality Ladder",
+             keyWriteConfig_quality_ladder,
+             typeChar,
+             "other qualities to save, separated by spaces",
+             flagsSingleProperty,
+
+             "Layers To Files",
+             keyWriteConfig_layers_to_files,
+             typeBoolean,
+             "also save each layer to its own file",
+             flagsSingleProperty,
+
+             "Auto Preset",
+             keyWriteConfig_auto_preset,
+             typeBoolean,
+             "choose quality and compression from the image content",
+             flagsSingleProperty,
+
              "Using POSIX I/O",
              keyUsePOSIX,
              typeBoolean,
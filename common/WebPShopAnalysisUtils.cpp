@@ -0,0 +1,358 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WEBPSHOP_USE_SSE2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define WEBPSHOP_USE_NEON
+#endif
+
+#include "WebPShop.h"
+
+// Pixels are BGRA or BGR (host layout, opaque). Each visible pixel is classified by the
+// biggest difference of its color channels with its right and bottom
+// neighbors. Fully transparent pixels are only counted as such because their
+// color does not matter. Only some rows are sampled.
+// All implementations below give the exact same results. Only BGRA is
+// vectorized.
+
+// A pixel is on an edge if a channel differs at least by this much.
+static const int kEdgeThreshold = 64;
+// A pixel is in a smooth gradient if no channel differs by more than this,
+// and at least one differs.
+static const int kSmoothThreshold = 8;
+// Gradients are measured on at most this many rows.
+static const int32 kMaxNumSampledRows = 512;
+
+struct PixelCounts {
+  uint64_t edge = 0, smooth = 0, flat = 0;
+  uint64_t transparent = 0, translucent = 0;
+};
+
+//------------------------------------------------------------------------------
+// Gradients and alpha
+
+static inline uint32_t LoadBGRA(const uint8_t* const bgra) {
+  return (uint32_t)bgra[0] | ((uint32_t)bgra[1] << 8) |
+         ((uint32_t)bgra[2] << 16) | ((uint32_t)bgra[3] << 24);
+}
+
+static inline uint32_t LoadPixel(const uint8_t* const pixel,
+                                 int num_channels) {
+  return (num_channels == 4) ? LoadBGRA(pixel)
+                             : (uint32_t)pixel[0] | ((uint32_t)pixel[1] << 8) |
+                                   ((uint32_t)pixel[2] << 16) | 0xff000000u;
+}
+
+static inline int GetMaxColorDiff(uint32_t a, uint32_t b) {
+  int max_diff = 0;
+  for (int shift = 0; shift < 24; shift += 8) {
+    max_diff = std::max(
+        max_diff, std::abs((int)((a >> shift) & 0xff) -
+                           (int)((b >> shift) & 0xff)));
+  }
+  return max_diff;
+}
+
+static void CountRowPixels_C(const uint8_t* row, const uint8_t* next_row,
+                             int num_pixels, int num_channels,
+                             PixelCounts* const counts) {
+  for (int x = 0; x < num_pixels;
+       ++x, row += num_channels, next_row += num_channels) {
+    const uint32_t pixel = LoadPixel(row, num_channels);
+    const int alpha = (int)(pixel >> 24);
+    if (alpha == 0) {
+      ++counts->transparent;
+      continue;
+    }
+    if (alpha < 255) ++counts->translucent;
+    const int diff = std::max(
+        GetMaxColorDiff(pixel, LoadPixel(row + num_channels, num_channels)),
+        GetMaxColorDiff(pixel, LoadPixel(next_row, num_channels)));
+    if (diff >= kEdgeThreshold) {
+      ++counts->edge;
+    } else if (diff == 0) {
+      ++counts->flat;
+    } else if (diff <= kSmoothThreshold) {
+      ++counts->smooth;
+    }
+  }
+}
+
+#if defined(WEBPSHOP_USE_SSE2)
+
+static inline __m128i AbsDiff_SSE2(__m128i a, __m128i b) {
+  return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+}
+
+static uint32_t SumLanes_SSE2(__m128i v) {
+  uint32_t lanes[4];
+  _mm_storeu_si128((__m128i*)lanes, v);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+static void CountRowPixels(const uint8_t* row, const uint8_t* next_row,
+                           int num_pixels, PixelCounts* const counts) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i color_mask = _mm_set1_epi32(0x00ffffff);
+  const __m128i low_byte = _mm_set1_epi32(0xff);
+  const __m128i edge_min = _mm_set1_epi32(kEdgeThreshold - 1);
+  const __m128i smooth_max = _mm_set1_epi32(kSmoothThreshold + 1);
+  const int simd_num_pixels = num_pixels & ~3;
+  // Lanes count at most 16383 / 4 pixels per row so they cannot overflow.
+  __m128i edge = zero, smooth = zero, flat = zero;
+  __m128i transparent = zero, translucent = zero;
+  int x = 0;
+  for (; x < simd_num_pixels; x += 4) {
+    const __m128i p = _mm_loadu_si128((const __m128i*)(row + 4 * x));
+    const __m128i right = _mm_loadu_si128((const __m128i*)(row + 4 * x + 4));
+    const __m128i down = _mm_loadu_si128((const __m128i*)(next_row + 4 * x));
+    __m128i diff = _mm_and_si128(
+        _mm_max_epu8(AbsDiff_SSE2(p, right), AbsDiff_SSE2(p, down)),
+        color_mask);
+    diff = _mm_max_epu8(diff, _mm_srli_epi32(diff, 8));
+    diff = _mm_and_si128(_mm_max_epu8(diff, _mm_srli_epi32(diff, 16)),
+                         low_byte);
+    const __m128i alpha = _mm_srli_epi32(p, 24);
+    const __m128i is_transparent = _mm_cmpeq_epi32(alpha, zero);
+    const __m128i is_flat = _mm_cmpeq_epi32(diff, zero);
+    // Masks are -1, subtracting them counts the pixels.
+    transparent = _mm_sub_epi32(transparent, is_transparent);
+    translucent = _mm_sub_epi32(
+        translucent,
+        _mm_andnot_si128(is_transparent,
+                         _mm_cmplt_epi32(alpha, low_byte)));
+    edge = _mm_sub_epi32(
+        edge,
+        _mm_andnot_si128(is_transparent, _mm_cmpgt_epi32(diff, edge_min)));
+    flat = _mm_sub_epi32(flat, _mm_andnot_si128(is_transparent, is_flat));
+    smooth = _mm_sub_epi32(
+        smooth,
+        _mm_andnot_si128(_mm_or_si128(is_transparent, is_flat),
+                         _mm_cmplt_epi32(diff, smooth_max)));
+  }
+  counts->edge += SumLanes_SSE2(edge);
+  counts->smooth += SumLanes_SSE2(smooth);
+  counts->flat += SumLanes_SSE2(flat);
+  counts->transparent += SumLanes_SSE2(transparent);
+  counts->translucent += SumLanes_SSE2(translucent);
+  CountRowPixels_C(row + 4 * x, next_row + 4 * x, num_pixels - x,
+                   /*num_channels=*/4, counts);
+}
+
+#elif defined(WEBPSHOP_USE_NEON)
+
+static void CountRowPixels(const uint8_t* row, const uint8_t* next_row,
+                           int num_pixels, PixelCounts* const counts) {
+  const uint32x4_t zero = vdupq_n_u32(0);
+  const uint32x4_t low_byte = vdupq_n_u32(0xff);
+  const int simd_num_pixels = num_pixels & ~3;
+  // Lanes count at most 16383 / 4 pixels per row so they cannot overflow.
+  uint32x4_t edge = zero, smooth = zero, flat = zero;
+  uint32x4_t transparent = zero, translucent = zero;
+  int x = 0;
+  for (; x < simd_num_pixels; x += 4) {
+    const uint8x16_t p = vld1q_u8(row + 4 * x);
+    const uint8x16_t right = vld1q_u8(row + 4 * x + 4);
+    const uint8x16_t down = vld1q_u8(next_row + 4 * x);
+    uint32x4_t diff =
+        vandq_u32(vreinterpretq_u32_u8(
+                      vmaxq_u8(vabdq_u8(p, right), vabdq_u8(p, down))),
+                  vdupq_n_u32(0x00ffffff));
+    diff = vreinterpretq_u32_u8(vmaxq_u8(
+        vreinterpretq_u8_u32(diff), vreinterpretq_u8_u32(vshrq_n_u32(diff, 8))));
+    diff = vandq_u32(
+        vreinterpretq_u32_u8(
+            vmaxq_u8(vreinterpretq_u8_u32(diff),
+                     vreinterpretq_u8_u32(vshrq_n_u32(diff, 16)))),
+        low_byte);
+    const uint32x4_t alpha = vshrq_n_u32(vreinterpretq_u32_u8(p), 24);
+    const uint32x4_t is_transparent = vceqq_u32(alpha, zero);
+    const uint32x4_t is_flat = vceqq_u32(diff, zero);
+    // Masks are all ones, subtracting them counts the pixels.
+    transparent = vsubq_u32(transparent, is_transparent);
+    translucent = vsubq_u32(
+        translucent, vbicq_u32(vcltq_u32(alpha, low_byte), is_transparent));
+    edge = vsubq_u32(
+        edge, vbicq_u32(vcgeq_u32(diff, vdupq_n_u32(kEdgeThreshold)),
+                        is_transparent));
+    flat = vsubq_u32(flat, vbicq_u32(is_flat, is_transparent));
+    smooth = vsubq_u32(
+        smooth, vbicq_u32(vcleq_u32(diff, vdupq_n_u32(kSmoothThreshold)),
+                          vorrq_u32(is_transparent, is_flat)));
+  }
+  counts->edge += vaddvq_u32(edge);
+  counts->smooth += vaddvq_u32(smooth);
+  counts->flat += vaddvq_u32(flat);
+  counts->transparent += vaddvq_u32(transparent);
+  counts->translucent += vaddvq_u32(translucent);
+  CountRowPixels_C(row + 4 * x, next_row + 4 * x, num_pixels - x,
+                   /*num_channels=*/4, counts);
+}
+
+#else
+
+static void CountRowPixels(const uint8_t* row, const uint8_t* next_row,
+                           int num_pixels, PixelCounts* const counts) {
+  CountRowPixels_C(row, next_row, num_pixels, /*num_channels=*/4, counts);
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Colors
+
+// Counts the distinct colors, stopping at kMaxNumColors + 1.
+static int CountColors(const ImageMemoryDesc& image) {
+  static const int kMaxNumColors = 256;
+  static const uint32_t kHashSize = 1024;  // Power of 2, mostly empty.
+  std::vector<uint32_t> hash_table(kHashSize);
+  std::vector<bool> used(kHashSize, false);
+  int num_colors = 0;
+  const int num_channels = image.num_channels;
+  const uint8_t* row = (const uint8_t*)image.pixels.data;
+  for (int32 y = 0; y < image.height; ++y) {
+    uint32_t last_color = LoadPixel(row, num_channels);
+    bool last_is_known = false;
+    for (int32 x = 0; x < image.width; ++x) {
+      const uint32_t color = LoadPixel(row + num_channels * x, num_channels);
+      if (last_is_known && color == last_color) continue;  // Runs are common.
+      uint32_t key = (color * 0x1E35A7BDu) >> 22;
+      while (used[key] && hash_table[key] != color) {
+        key = (key + 1) & (kHashSize - 1);
+      }
+      if (!used[key]) {
+        if (++num_colors > kMaxNumColors) return num_colors;
+        used[key] = true;
+        hash_table[key] = color;
+      }
+      last_color = color;
+      last_is_known = true;
+    }
+    row += image.pixels.rowBits / 8;
+  }
+  return num_colors;
+}
+
+//------------------------------------------------------------------------------
+
+bool AnalyzeImage(const ImageMemoryDesc& image, ImageStats* const stats) {
+  if (image.pixels.data == nullptr || image.width < 1 || image.height < 1 ||
+      (image.num_channels != 3 && image.num_channels != 4) ||
+      image.pixels.depth != 8 ||
+      stats == nullptr) {
+    LOG("/!\\ Unsupported ImageMemoryDesc layout.");
+    return false;
+  }
+  START_TIMER(AnalyzeImage);
+
+  *stats = ImageStats();
+  stats->num_colors = CountColors(image);
+
+  // The last row and column have no bottom or right neighbor.
+  PixelCounts counts;
+  const int32 num_rows = image.height - 1;
+  const int32 row_step = std::max(1, num_rows / kMaxNumSampledRows);
+  const size_t stride = (size_t)(image.pixels.rowBits / 8);
+  uint64_t num_sampled_pixels = 0;
+  for (int32 y = 0; y < num_rows; y += row_step) {
+    const uint8_t* row = (const uint8_t*)image.pixels.data + y * stride;
+    if (image.num_channels == 4) {
+      CountRowPixels(row, row + stride, (int)image.width - 1, &counts);
+    } else {
+      CountRowPixels_C(row, row + stride, (int)image.width - 1,
+                       image.num_channels, &counts);
+    }
+    num_sampled_pixels += (uint64_t)(image.width - 1);
+  }
+
+  const uint64_t num_visible_pixels = num_sampled_pixels - counts.transparent;
+  if (num_visible_pixels > 0) {
+    stats->edge_density = (double)counts.edge / num_visible_pixels;
+    stats->smoothness = (double)counts.smooth / num_visible_pixels;
+    stats->flatness = (double)counts.flat / num_visible_pixels;
+  }
+  if (num_sampled_pixels > 0) {
+    stats->transparency = (double)counts.transparent / num_sampled_pixels;
+    stats->translucency = (double)counts.translucent / num_sampled_pixels;
+  }
+
+  STOP_TIMER(AnalyzeImage);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+// These thresholds are a starting point, to be tuned on real content.
+// Graphics (text, UI, line art) are mostly flat areas with sharp edges, which
+// near-lossless keeps crisp at a reasonable size. Photos have soft gradients
+// or noise.
+static const double kMinGraphicsFlatness = 0.5;
+static const double kMaxGraphicsSmoothness = 0.25;
+// Content with soft alpha (shadows, anti-aliased cutouts) needs the slower
+// effort to avoid color bleeding around the translucent pixels.
+static const double kMinSoftAlpha = 0.01;
+// The effort is lowered for big images to keep the encoding time reasonable.
+static const double kMaxNumPixelsForSlowest = 1 << 20;
+static const double kMaxNumPixelsForDefault = 1 << 24;
+
+void ApplyAutoPreset(const ImageMemoryDesc& image,
+                     WriteConfig* const write_config) {
+  write_config->auto_preset = false;
+  ImageStats stats;
+  if (!AnalyzeImage(image, &stats)) return;  // Keep the user settings.
+
+  const char* reason;
+  if (stats.num_colors <= 256) {
+    write_config->quality = 100;  // Lossless, palette.
+    reason = "few colors";
+  } else if (stats.flatness >= kMinGraphicsFlatness &&
+             stats.smoothness <= kMaxGraphicsSmoothness) {
+    write_config->quality = 99;  // Near-lossless.
+    reason = "graphics";
+  } else {
+    // Lossy. Keep the chosen quality if it is lossy.
+    if (write_config->quality >= 98) write_config->quality = 90;
+    reason = "photo";
+  }
+
+  const double num_pixels = (double)image.width * image.height;
+  if (num_pixels <= kMaxNumPixelsForSlowest ||
+      (write_config->quality < 98 && stats.translucency >= kMinSoftAlpha &&
+       num_pixels <= kMaxNumPixelsForDefault)) {
+    write_config->compression = Compression::SLOWEST;
+  } else if (num_pixels <= kMaxNumPixelsForDefault) {
+    write_config->compression = Compression::DEFAULT;
+  } else {
+    write_config->compression = Compression::FASTEST;
+  }
+
+  (void)reason;
+  LOG("Auto preset: " << reason << " -> quality " << write_config->quality
+                      << ", compression " << write_config->compression
+                      << " (colors " << stats.num_colors << ", edges "
+                      << stats.edge_density << ", smooth " << stats.smoothness
+                      << ", flat " << stats.flatness << ", transparent "
+                      << stats.transparency << ", translucent "
+                      << stats.translucency << ", " << image.width << "x"
+                      << image.height << ")");
+}
@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
 #include <vector>
 
 #include "PIFormat.h"
@@ -54,8 +55,9 @@ static int CountChannels(const ReadChannelDesc* rgb_channels,
 
 //------------------------------------------------------------------------------
 
+// Copies the rows of 'channel' starting at 'top' into destination.
 static void CopyChannel(Data* const data, int16* const result,
-                        const ReadChannelDesc* const channel,
+                        const ReadChannelDesc* const channel, int32 top,
                         ImageMemoryDesc* const destination) {
   if (channel->port == nullptr) {
     LOG("/!\\ The channel has no port.");
@@ -100,8 +102,8 @@ static void CopyChannel(Data* const data, int16* const result,
   VRect read_rect;
   read_rect.left = 0;
   read_rect.right = destination->width;
-  read_rect.top = 0;
-  read_rect.bottom = destination->height;
+  read_rect.top = top;
+  read_rect.bottom = top + destination->height;
 
   if (data->sPSChannelPortsSuite->ReadPixelsFromLevel(
           channel->port, 0, &read_rect, &destination->pixels)) {
@@ -121,10 +123,81 @@ static void CopyChannel(Data* const data, int16* const result,
   }
 }
 
+// Returns true if the alpha channel is fully opaque. It is read by bands of
+// rows so that the first translucent pixel stops it early.
+static bool IsChannelOpaque(Data* const data,
+                            const ReadChannelDesc* const channel,
+                            int32 canvas_width, int32 canvas_height,
+                            int32 bit_depth) {
+  if (channel->port == nullptr || data->sPSChannelPortsSuite == nullptr ||
+      data->sPSChannelPortsSuite->ReadPixelsFromLevel == nullptr ||
+      (bit_depth != 8 && bit_depth != 16 && bit_depth != 32)) {
+    return false;
+  }
+  static const int32 kBandHeight = 64;
+  const size_t row_size = (size_t)canvas_width * (bit_depth / 8);
+  std::vector<uint8_t> band(row_size * kBandHeight);
+  PixelMemoryDesc pixels = {band.data(), (int32)(row_size * 8), bit_depth, 0,
+                            bit_depth};
+  for (int32 top = 0; top < canvas_height; top += kBandHeight) {
+    VRect read_rect;
+    read_rect.left = 0;
+    read_rect.right = canvas_width;
+    read_rect.top = top;
+    read_rect.bottom = std::min(canvas_height, top + kBandHeight);
+    const int32 band_height = GetHeight(read_rect);
+    if (data->sPSChannelPortsSuite->ReadPixelsFromLevel(
+            channel->port, 0, &read_rect, &pixels) ||
+        GetWidth(read_rect) != canvas_width ||
+        GetHeight(read_rect) != band_height) {
+      LOG("/!\\ Unable to read the alpha channel.");
+      return false;
+    }
+    // See To8bit() for the maximum values.
+    const size_t num_values = (size_t)canvas_width * band_height;
+    for (size_t i = 0; i < num_values; ++i) {
+      if (bit_depth == 8) {
+        if (band[i] != 255) return false;
+      } else if (bit_depth == 16) {
+        if (reinterpret_cast<const uint16_t*>(band.data())[i] < 32768) {
+          return false;
+        }
+      } else if (reinterpret_cast<const float*>(band.data())[i] < 1.f) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Returns true if all the transparency channels among 'a_channels' are fully
+// opaque.
+static bool AreChannelsOpaque(Data* const data,
+                              const ReadChannelDesc* const a_channels,
+                              int32 canvas_width, int32 canvas_height,
+                              int32 bit_depth) {
+  const ReadChannelDesc* channel = a_channels;
+  int channel_index = 0;
+  while (channel != nullptr && channel_index < MAX_NUM_BROWSED_CHANNELS) {
+    if ((channel->channelType == ctLayerMask ||
+         channel->channelType == ctTransparency) &&
+        !IsChannelOpaque(data, channel, canvas_width, canvas_height,
+                         bit_depth)) {
+      return false;
+    }
+    ++channel_index;
+    channel = channel->next;
+  }
+  return true;
+}
+
+// Outputs 8-bit BGRA (or BGR if keep_rgb), or the channels at their original
+// bit depth if keep_bit_depth.
 static void CopyChannels(Data* const data, int16* const result,
                          const ReadChannelDesc* rgb_channels,
                          const ReadChannelDesc* a_channels, int32 canvas_width,
-                         int32 canvas_height, int32 bit_depth,
+                         int32 canvas_height, int32 bit_depth, bool keep_rgb,
+                         bool keep_bit_depth,
                          ImageMemoryDesc* const destination) {
   if (rgb_channels == nullptr || destination == nullptr) {
     LOG("/!\\ Source or destination is null.");
@@ -132,23 +205,36 @@ static void CopyChannels(Data* const data, int16* const result,
     return;
   }
 
-  const int num_channels = CountChannels(rgb_channels, a_channels);
+  int num_channels = CountChannels(rgb_channels, a_channels);
   if (num_channels < 3 || num_channels > 4) {
     LOG("/!\\ Unhandled number of channels: " << num_channels);
     *result = writErr;
     return;
   }
 
+  // Documents often have a transparency channel without using it.
+  if (keep_rgb && num_channels == 4 &&
+      AreChannelsOpaque(data, a_channels, canvas_width, canvas_height,
+                        bit_depth)) {
+    LOG("The alpha channel is fully opaque, discarding it.");
+    num_channels = 3;
+    a_channels = nullptr;
+  }
+  // Opaque images are kept as BGR if allowed, otherwise as BGRA.
+  const int num_dst_channels = keep_rgb ? num_channels : 4;
+
   // The pixels can only be extracted with their original bit depth.
-  // Four 8-bit channels are needed by WebPEncode() so either allocate them
-  // directly or just what is necessary and downscale afterwards.
+  // Either allocate the 8-bit channels directly or just what is necessary and
+  // downscale afterwards.
   // TODO: Modify CopyChannel() to read line by line to avoid allocating
   //       the whole canvas twice.
   ImageMemoryDesc destination_16b_or_32b;
-  ImageMemoryDesc* const tmp_dst =
-      (bit_depth == 8) ? destination : &destination_16b_or_32b;
+  ImageMemoryDesc* const tmp_dst = (bit_depth == 8 || keep_bit_depth)
+                                       ? destination
+                                       : &destination_16b_or_32b;
   if (!AllocateImage(tmp_dst, canvas_width, canvas_height,
-                     (bit_depth == 8) ? 4 : num_channels, bit_depth)) {
+                     (bit_depth == 8) ? num_dst_channels : num_channels,
+                     bit_depth)) {
     LOG("/!\\ AllocateImage() failed.");
     *result = memFullErr;
     return;
@@ -159,7 +245,7 @@ static void CopyChannels(Data* const data, int16* const result,
 
   while (channel != nullptr && channel_index < MAX_NUM_BROWSED_CHANNELS &&
          *result == noErr) {
-    CopyChannel(data, result, channel, tmp_dst);
+    CopyChannel(data, result, channel, /*top=*/0, tmp_dst);
 
     ++channel_index;
     channel = channel->next;
@@ -170,13 +256,13 @@ static void CopyChannels(Data* const data, int16* const result,
 
   while (channel != nullptr && channel_index < MAX_NUM_BROWSED_CHANNELS &&
          *result == noErr) {
-    CopyChannel(data, result, channel, tmp_dst);
+    CopyChannel(data, result, channel, /*top=*/0, tmp_dst);
 
     ++channel_index;
     channel = channel->next;
   }
 
-  if (num_channels == 3 && tmp_dst->pixels.depth == 8) {
+  if (num_channels == 3 && tmp_dst->num_channels == 4) {
     for (size_t y = 0; y < tmp_dst->height; ++y) {
       uint8_t* dst_data = reinterpret_cast<uint8_t*>(tmp_dst->pixels.data) +
                           y * (tmp_dst->pixels.rowBits / 8) +
@@ -190,7 +276,8 @@ static void CopyChannels(Data* const data, int16* const result,
 
   if (tmp_dst != destination &&
       !To8bit(destination_16b_or_32b,
-              /*add_alpha=*/(destination_16b_or_32b.num_channels < 4),
+              /*add_alpha=*/(destination_16b_or_32b.num_channels <
+                             num_dst_channels),
               destination)) {
     *result = writErr;
   }
@@ -223,7 +310,8 @@ static bool GetDocumentDimensions(FormatRecordPtr format_record,
 }
 
 void CopyWholeCanvas(FormatRecordPtr format_record, Data* const data,
-                     int16* const result, ImageMemoryDesc* const destination) {
+                     bool keep_rgb, int16* const result,
+                     ImageMemoryDesc* const destination) {
   START_TIMER(CopyWholeCanvas);
 
   int32 canvas_width, canvas_height, bit_depth;
@@ -235,28 +323,134 @@ void CopyWholeCanvas(FormatRecordPtr format_record, Data* const data,
   CopyChannels(data, result,
                format_record->documentInfo->mergedCompositeChannels,
                format_record->documentInfo->mergedTransparency, canvas_width,
-               canvas_height, bit_depth, destination);
+               canvas_height, bit_depth, keep_rgb, /*keep_bit_depth=*/false,
+               destination);
   LOG("Copied " << destination->num_channels << " channels.");
 
   STOP_TIMER(CopyWholeCanvas);
 }
 
-void CopyAllLayers(FormatRecordPtr format_record, Data* const data,
-                   int16* const result,
-                   std::vector<FrameMemoryDesc>* const destination) {
-  START_TIMER(CopyAllLayers);
-
-  if (destination == nullptr) {
-    LOG("/!\\ Destination is null.");
-    *result = writErr;
-    return;
+// Number of rows read from the host at once by StreamWholeCanvas(). It is
+// even so that each band maps to whole chroma rows.
+static const int32 kStreamingBandHeight = 256;
+
+// Copies the 8-bit BGR(A) 'rows' into the ARGB samples of 'dst' from 'top'.
+static void CopyRowsToARGB(const ImageMemoryDesc& rows, int32 top,
+                           WebPPicture* const dst) {
+  for (int32 y = 0; y < rows.height; ++y) {
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(rows.pixels.data) +
+                         y * (rows.pixels.rowBits / 8);
+    uint8_t* dst_row =
+        reinterpret_cast<uint8_t*>(dst->argb + (top + y) * dst->argb_stride);
+    if (rows.num_channels == 4) {
+      std::copy(src, src + rows.width * 4, dst_row);  // BGRA is little-endian
+      continue;                                       // ARGB.
+    }
+    for (int32 x = 0; x < rows.width; ++x, src += 3, dst_row += 4) {
+      dst_row[0] = src[0];
+      dst_row[1] = src[1];
+      dst_row[2] = src[2];
+      dst_row[3] = 255;
+    }
   }
+}
+
+void StreamWholeCanvas(FormatRecordPtr format_record, Data* const data,
+                       bool use_argb, Progress* const progress,
+                       int16* const result, WebPPicture* const destination) {
+  START_TIMER(StreamWholeCanvas);
 
   int32 canvas_width, canvas_height, bit_depth;
   if (!GetDocumentDimensions(format_record, result, &canvas_width,
                              &canvas_height, &bit_depth)) {
     return;
   }
+  const ReadChannelDesc* const rgb_channels =
+      format_record->documentInfo->mergedCompositeChannels;
+  const ReadChannelDesc* a_channels =
+      format_record->documentInfo->mergedTransparency;
+  int num_channels = CountChannels(rgb_channels, a_channels);
+  if (num_channels < 3 || num_channels > 4) {
+    LOG("/!\\ Unhandled number of channels: " << num_channels);
+    *result = writErr;
+    return;
+  }
+  if (num_channels == 4 && AreChannelsOpaque(data, a_channels, canvas_width,
+                                             canvas_height, bit_depth)) {
+    LOG("The alpha channel is fully opaque, discarding it.");
+    num_channels = 3;
+    a_channels = nullptr;
+  }
+
+  WebPPictureFree(destination);
+  destination->use_argb = use_argb ? 1 : 0;
+  destination->colorspace = (num_channels == 4) ? WEBP_YUV420A : WEBP_YUV420;
+  destination->width = canvas_width;
+  destination->height = canvas_height;
+  if (!WebPPictureAlloc(destination)) {
+    LOG("/!\\ WebPPictureAlloc() failed.");
+    *result = memFullErr;
+    return;
+  }
+
+  // Only one band is held at the source depth and at 8 bits.
+  ProgressAddWork(progress, (uint64_t)canvas_height);
+  ImageMemoryDesc band, band_8b;
+  for (int32 top = 0; top < canvas_height && *result == noErr;
+       top += kStreamingBandHeight) {
+    const int32 band_height =
+        std::min(kStreamingBandHeight, canvas_height - top);
+    if (!AllocateImage(&band, canvas_width, band_height, num_channels,
+                       bit_depth)) {
+      LOG("/!\\ AllocateImage() failed.");
+      *result = memFullErr;
+      break;
+    }
+    for (const ReadChannelDesc* channels : {rgb_channels, a_channels}) {
+      const ReadChannelDesc* channel = channels;
+      size_t channel_index = 0;
+      while (channel != nullptr &&
+             channel_index < MAX_NUM_BROWSED_CHANNELS && *result == noErr) {
+        CopyChannel(data, result, channel, top, &band);
+        ++channel_index;
+        channel = channel->next;
+      }
+    }
+    if (*result != noErr) break;
+
+    const ImageMemoryDesc* rows = &band;
+    if (bit_depth != 8) {
+      if (!To8bit(band, /*add_alpha=*/false, &band_8b)) {
+        *result = writErr;
+        break;
+      }
+      rows = &band_8b;
+    }
+    if (use_argb) {
+      CopyRowsToARGB(*rows, top, destination);
+    } else if (!ImportYUVARows(*rows, top, destination)) {
+      *result = writErr;
+      break;
+    }
+    if (!ProgressAdvance(progress, (uint64_t)band_height)) {
+      *result = userCanceledErr;
+    }
+  }
+  DeallocateImage(&band);
+  DeallocateImage(&band_8b);
+  if (*result != noErr) WebPPictureFree(destination);
+
+  STOP_TIMER(StreamWholeCanvas);
+}
+
+bool GetLayers(FormatRecordPtr format_record, int16* const result,
+               std::vector<const ReadLayerDesc*>* const layers) {
+  layers->clear();
+  if (format_record == nullptr || format_record->documentInfo == nullptr) {
+    LOG("/!\\ Unable to access document info.");
+    *result = writErr;
+    return false;
+  }
 
   const size_t expected_num_layers =
       (size_t)format_record->documentInfo->layerCount;
@@ -264,36 +458,89 @@ void CopyAllLayers(FormatRecordPtr format_record, Data* const data,
       expected_num_layers >= MAX_NUM_BROWSED_LAYERS) {
     LOG("/!\\ Invalid number of layers (" << expected_num_layers << ").");
     *result = writErr;
-    return;
+    return false;
   }
 
-  ResizeFrameVector(destination, expected_num_layers);
-
   const ReadLayerDesc* layer_desc =
       format_record->documentInfo->layersDescriptor;
+  while (layer_desc != nullptr && layers->size() < expected_num_layers) {
+    layers->push_back(layer_desc);
+    layer_desc = layer_desc->next;
+  }
+  if (layers->size() != expected_num_layers) {
+    LOG("/!\\ Missing layers (" << layers->size() << " / "
+                                 << expected_num_layers << ").");
+    *result = writErr;
+    return false;
+  }
+  return true;
+}
+
+void CopyLayer(FormatRecordPtr format_record, Data* const data,
+               const ReadLayerDesc& layer, bool keep_rgb, int16* const result,
+               ImageMemoryDesc* const destination) {
+  int32 canvas_width, canvas_height, bit_depth;
+  if (!GetDocumentDimensions(format_record, result, &canvas_width,
+                             &canvas_height, &bit_depth)) {
+    return;
+  }
+  CopyChannels(data, result, layer.compositeChannelsList, layer.transparency,
+               canvas_width, canvas_height, bit_depth, keep_rgb,
+               /*keep_bit_depth=*/false, destination);
+}
+
+void CopyLayerAtSourceDepth(FormatRecordPtr format_record, Data* const data,
+                            const ReadLayerDesc& layer, int16* const result,
+                            ImageMemoryDesc* const destination) {
+  int32 canvas_width, canvas_height, bit_depth;
+  if (!GetDocumentDimensions(format_record, result, &canvas_width,
+                             &canvas_height, &bit_depth)) {
+    return;
+  }
+  CopyChannels(data, result, layer.compositeChannelsList, layer.transparency,
+               canvas_width, canvas_height, bit_depth, /*keep_rgb=*/false,
+               /*keep_bit_depth=*/true, destination);
+}
+
+void CopyAllLayers(FormatRecordPtr format_record, Data* const data,
+                   Progress* const progress, int16* const result,
+                   std::vector<FrameMemoryDesc>* const destination) {
+  START_TIMER(CopyAllLayers);
+
+  if (destination == nullptr) {
+    LOG("/!\\ Destination is null.");
+    *result = writErr;
+    return;
+  }
+
+  std::vector<const ReadLayerDesc*> layers;
+  if (!GetLayers(format_record, result, &layers)) return;
+
+  ResizeFrameVector(destination, layers.size());
+  ProgressAddWork(progress, layers.size());
+
   size_t layer_count = 0;
-  while (*result == noErr && layer_desc != nullptr &&
-         layer_count < expected_num_layers) {
+  while (*result == noErr && layer_count < layers.size()) {
+    const ReadLayerDesc& layer = *layers[layer_count];
     int frame_duration;
-    if (!TryExtractDuration(layer_desc->unicodeName, &frame_duration)) {
+    if (!TryExtractDuration(layer.unicodeName, &frame_duration)) {
       LOG("/!\\ Can't extract duration from layer name.");
       *result = writErr;
     } else {
       FrameMemoryDesc& frame = (*destination)[layer_count];
       frame.duration_ms = frame_duration;
-
-      CopyChannels(data, result, layer_desc->compositeChannelsList,
-                   layer_desc->transparency, canvas_width, canvas_height,
-                   bit_depth, &frame.image);
+      // Animation frames must be BGRA.
+      CopyLayer(format_record, data, layer, /*keep_rgb=*/false, result,
+                &frame.image);
     }
-    layer_desc = layer_desc->next;
     ++layer_count;
+    if (*result == noErr && !ProgressAdvance(progress, 1)) {
+      LOG("Cancelled after " << layer_count << " layers.");
+      *result = userCanceledErr;
+      return;
+    }
   }
-  LOG("Copied " << layer_count << " / " << expected_num_layers << " layers.");
-  if (layer_count != expected_num_layers) {
-    LOG("/!\\ Missing layers.");
-    *result = writErr;
-  }
+  LOG("Copied " << layer_count << " / " << layers.size() << " layers.");
 
   STOP_TIMER(CopyAllLayers);
 }
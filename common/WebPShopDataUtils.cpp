@@ -12,32 +12,59 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
 #include <fstream>
 #include <string>
 
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __PIMac__
+#include <sys/mman.h>
+#else
+#include <io.h>
+#include <windows.h>
+#endif
+
 #include "FileUtilities.h"
 #include "WebPShop.h"
 
 //------------------------------------------------------------------------------
 
+// PSSDKRead() and PSSDKWrite() take an int32 count. Bigger buffers are
+// transferred in several calls.
+static const size_t kMaxIOChunkSize = 1 << 24;
+
 void ReadSome(size_t count, void* const buffer, FormatRecordPtr format_record,
               int16* const result) {
   if (*result != noErr) return;
-  int32 read_count = (int32)count;
-  *result = PSSDKRead((int32)format_record->dataFork,
-                      format_record->posixFileDescriptor,
-                      format_record->pluginUsingPOSIXIO, &read_count, buffer);
-  if (*result == noErr && (size_t)read_count != count) *result = eofErr;
+  uint8_t* bytes = (uint8_t*)buffer;
+  for (size_t remaining = count; remaining > 0 && *result == noErr;) {
+    const int32 chunk_size = (int32)std::min(remaining, kMaxIOChunkSize);
+    int32 read_count = chunk_size;
+    *result = PSSDKRead((int32)format_record->dataFork,
+                        format_record->posixFileDescriptor,
+                        format_record->pluginUsingPOSIXIO, &read_count, bytes);
+    if (*result == noErr && read_count != chunk_size) *result = eofErr;
+    bytes += chunk_size;
+    remaining -= (size_t)chunk_size;
+  }
   if (*result != noErr) LOG("/!\\ Unable to read " << count << " bytes.");
 }
 void WriteSome(size_t count, const void* const buffer,
                FormatRecordPtr format_record, int16* const result) {
   if (*result != noErr) return;
-  int32 write_count = (int32)count;
-  *result = PSSDKWrite(
-      (int32)format_record->dataFork, format_record->posixFileDescriptor,
-      format_record->pluginUsingPOSIXIO, &write_count, (void*)buffer);
-  if (*result == noErr && (size_t)write_count != count) *result = dskFulErr;
+  const uint8_t* bytes = (const uint8_t*)buffer;
+  for (size_t remaining = count; remaining > 0 && *result == noErr;) {
+    const int32 chunk_size = (int32)std::min(remaining, kMaxIOChunkSize);
+    int32 write_count = chunk_size;
+    *result = PSSDKWrite((int32)format_record->dataFork,
+                         format_record->posixFileDescriptor,
+                         format_record->pluginUsingPOSIXIO, &write_count,
+                         (void*)bytes);
+    if (*result == noErr && write_count != chunk_size) *result = dskFulErr;
+    bytes += chunk_size;
+    remaining -= (size_t)chunk_size;
+  }
   if (*result != noErr) LOG("/!\\ Unable to write " << count << " bytes.");
 }
 
@@ -83,6 +110,94 @@ void Deallocate(void** const buffer) {
 
 //------------------------------------------------------------------------------
 
+// Returns the size of the file opened by host, if it is known.
+static bool GetHostFileSize(FormatRecordPtr format_record, size_t* const size) {
+  if (!format_record->pluginUsingPOSIXIO) return false;
+#ifdef __PIMac__
+  struct stat info;
+  if (fstat(format_record->posixFileDescriptor, &info) != 0) {
+#else
+  struct _stat64 info;
+  if (_fstat64(format_record->posixFileDescriptor, &info) != 0) {
+#endif
+    LOG("/!\\ Unable to get the file size.");
+    return false;
+  }
+  if (info.st_size < 0) return false;
+  *size = (size_t)info.st_size;
+  return true;
+}
+
+// Maps the first 'count' bytes of the file opened by host as read-only
+// memory. Returns nullptr on failure.
+static void* MapHostFile(size_t count, FormatRecordPtr format_record) {
+#ifdef __PIMac__
+  void* const address = mmap(nullptr, count, PROT_READ, MAP_PRIVATE,
+                             format_record->posixFileDescriptor, 0);
+  if (address == MAP_FAILED) {
+    LOG("/!\\ mmap() failed.");
+    return nullptr;
+  }
+  return address;
+#else
+  const HANDLE file =
+      (HANDLE)_get_osfhandle(format_record->posixFileDescriptor);
+  if (file == INVALID_HANDLE_VALUE) {
+    LOG("/!\\ _get_osfhandle() failed.");
+    return nullptr;
+  }
+  const HANDLE mapping =
+      CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapping == nullptr) {
+    LOG("/!\\ CreateFileMappingW() failed.");
+    return nullptr;
+  }
+  void* const address = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, count);
+  CloseHandle(mapping);  // The view keeps the mapping alive.
+  if (address == nullptr) LOG("/!\\ MapViewOfFile() failed.");
+  return address;
+#endif
+}
+
+static void UnmapHostFile(void* const address, size_t count) {
+#ifdef __PIMac__
+  munmap(address, count);
+#else
+  (void)count;
+  UnmapViewOfFile(address);
+#endif
+}
+
+bool MapFileData(FormatRecordPtr format_record, Data* const data) {
+  ReleaseFileData(data);
+
+  // The pages are read by the system when WebPGetFeatures() and the decoders
+  // access them, without a copy in memory managed by host. Accessing a page
+  // past the end of the file would crash, so its size must be known.
+  size_t host_file_size;
+  if (!GetHostFileSize(format_record, &host_file_size) ||
+      data->file_size == 0 || data->file_size > host_file_size) {
+    return false;
+  }
+  data->file_data = MapHostFile(data->file_size, format_record);
+  if (data->file_data == nullptr) return false;
+  data->file_data_is_mapped = true;
+  LOG("Mapped " << data->file_size << " bytes.");
+  return true;
+}
+
+void ReleaseFileData(Data* const data) {
+  if (data->file_data_is_mapped) {
+    UnmapHostFile(data->file_data, data->file_size);
+    data->file_data = nullptr;
+    data->file_data_is_mapped = false;
+  } else {
+    Deallocate(&data->file_data);
+  }
+}
+
+//------------------------------------------------------------------------------
+
 bool ReadAndCheckHeader(FormatRecordPtr format_record, int16* const result,
                         size_t* file_size) {
   if (*result != noErr) return false;
@@ -107,6 +222,16 @@ bool ReadAndCheckHeader(FormatRecordPtr format_record, int16* const result,
                   (file_header[6] << 16) | (file_header[7] << 24)) +
                  8;
     LOG("File size: " << *file_size);
+
+    // Do not allocate or map more than what the file contains.
+    size_t host_file_size;
+    if (GetHostFileSize(format_record, &host_file_size) &&
+        *file_size > host_file_size) {
+      LOG("/!\\ The RIFF size exceeds the file size (" << host_file_size
+                                                       << ").");
+      *result = eofErr;
+      return false;
+    }
   }
   return true;
 }
@@ -31,7 +31,7 @@ void PrintDuration(int frame_index, int frame_duration, uint16 output[],
 
 //------------------------------------------------------------------------------
 
-bool DecodeAllFrames(const WebPData& encoded_data,
+bool DecodeAllFrames(const WebPData& encoded_data, Progress* const progress,
                      std::vector<FrameMemoryDesc>* const compressed_frames) {
   START_TIMER(DecodeAllFrames);
 
@@ -68,6 +68,7 @@ bool DecodeAllFrames(const WebPData& encoded_data,
   }
 
   ResizeFrameVector(compressed_frames, info.frame_count);
+  ProgressAddWork(progress, info.frame_count);
   size_t frame_counter = 0;
   int last_frame_timestamp_ms = 0;
   while (WebPAnimDecoderHasMoreFrames(anim_decoder) &&
@@ -97,6 +98,13 @@ bool DecodeAllFrames(const WebPData& encoded_data,
 
     last_frame_timestamp_ms = timestamp;
     ++frame_counter;
+
+    if (!ProgressAdvance(progress, 1)) {
+      LOG("Cancelled at frame " << frame_counter << ".");
+      WebPAnimDecoderDelete(anim_decoder);
+      ClearFrameVector(compressed_frames);
+      return false;
+    }
   }
 
   WebPAnimDecoderDelete(anim_decoder);
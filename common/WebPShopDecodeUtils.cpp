@@ -12,10 +12,17 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include "FileUtilities.h"
 #include "PIProperties.h"
 #include "WebPShop.h"
 #include "webp/decode.h"
-#include "webp/demux.h"
 
 bool DecodeOneImage(const WebPData& encoded_data,
                     ImageMemoryDesc* const compressed_image) {
@@ -54,6 +61,8 @@ bool DecodeOneImage(const WebPData& encoded_data,
   decoder_config.output.is_external_memory = 1;
   decoder_config.output.width = decoder_config.input.width;
   decoder_config.output.height = decoder_config.input.height;
+  // Lossy filtering runs on another thread. Lossless decoding ignores it.
+  decoder_config.options.use_threads = (GetNumWorkerThreads() > 1) ? 1 : 0;
 
   if ((status = WebPDecode(encoded_data.bytes, encoded_data.size,
                            &decoder_config)) != VP8_STATUS_OK) {
@@ -68,37 +77,201 @@ bool DecodeOneImage(const WebPData& encoded_data,
   return true;
 }
 
-bool DecodeMetadata(const WebPData& encoded_data,
-                    Metadata metadata[Metadata::kNum]) {
-  DeallocateMetadata(metadata);  // Get rid of any previous data.
+//------------------------------------------------------------------------------
+
+// Small enough for the decoder to start early, big enough for few host calls.
+static const size_t kReadChunkSize = (size_t)1 << 18;
+
+// Decodes the bytes of data->file_data as they are read by the host thread.
+struct IncrementalDecoder {
+  WebPIDecoder* idec = nullptr;
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable bytes_read;
+  size_t num_read_bytes = 0;  // Available in data->file_data.
+  bool all_read = false;      // Or stopped.
+  bool decoded = false;
+  double decoding_ms = 0;     // Excluding the waits for bytes.
+};
+
+static double MillisecondsSince(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - begin)
+      .count();
+}
 
-  WebPDemuxer* const demux = WebPDemux(&encoded_data);
-  if (demux == nullptr) {
-    LOG("/!\\ WebPDemux failed.");
+WebPIDecoder* NewIncrementalDecoder(Data* const data) {
+  const WebPBitstreamFeatures& features = data->read_config.input;
+  ImageMemoryDesc& image = data->decoded_image;
+  if (!AllocateImage(&image, features.width, features.height,
+                     /*num_channels=*/4, /*bit_depth=*/8)) {
+    LOG("/!\\ AllocateImage failed.");
+    return nullptr;
+  }
+  WebPDecBuffer& output = data->read_config.output;
+  output.colorspace = MODE_RGBA;  // As WebPAnimDecoder.
+  output.u.RGBA.rgba = (uint8_t*)image.pixels.data;
+  output.u.RGBA.stride = (int)(image.pixels.rowBits / 8);
+  output.u.RGBA.size = (size_t)output.u.RGBA.stride * image.height;
+  output.is_external_memory = 1;
+  output.width = image.width;
+  output.height = image.height;
+  // The rows are decoded straight into the buffer given to the host, so the
+  // only gain left is running the lossy filtering on another thread.
+  data->read_config.options.use_threads = (GetNumWorkerThreads() > 1) ? 1 : 0;
+
+  WebPIDecoder* const idec = WebPIDecode(nullptr, 0, &data->read_config);
+  if (idec == nullptr) {
+    LOG("/!\\ WebPIDecode failed.");
+    DeallocateImage(&image);
+  }
+  return idec;
+}
+
+// Starts a thread decoding data->file_data into data->decoded_image as it is
+// read. Returns false if it is not possible.
+static bool StartIncrementalDecoder(Data* const data,
+                                    IncrementalDecoder* const decoder) {
+  decoder->idec = NewIncrementalDecoder(data);
+  if (decoder->idec == nullptr) return false;
+  ImageMemoryDesc& image = data->decoded_image;
+
+  // WebPIUpdate() is given the same buffer, growing as the file is read.
+  const uint8_t* const file_data = (const uint8_t*)data->file_data;
+  const auto decode = [decoder, file_data]() {
+    std::unique_lock<std::mutex> lock(decoder->mutex);
+    size_t num_given_bytes = 0;
+    while (true) {
+      decoder->bytes_read.wait(lock, [&]() {
+        return decoder->num_read_bytes > num_given_bytes || decoder->all_read;
+      });
+      if (decoder->num_read_bytes == num_given_bytes) break;  // No more.
+      num_given_bytes = decoder->num_read_bytes;
+      lock.unlock();
+      const std::chrono::steady_clock::time_point begin =
+          std::chrono::steady_clock::now();
+      const VP8StatusCode status =
+          WebPIUpdate(decoder->idec, file_data, num_given_bytes);
+      const double elapsed_ms = MillisecondsSince(begin);
+      lock.lock();
+      decoder->decoding_ms += elapsed_ms;
+      if (status == VP8_STATUS_OK) {
+        decoder->decoded = true;
+        break;
+      }
+      if (status != VP8_STATUS_SUSPENDED) {
+        LOG("/!\\ WebPIUpdate failed (" << status << ")");
+        break;
+      }
+    }
+  };
+  try {
+    decoder->thread = std::thread(decode);
+  } catch (const std::exception& e) {
+    (void)e;
+    LOG("/!\\ Unable to start the decoding thread: " << e.what());
+    WebPIDelete(decoder->idec);
+    decoder->idec = nullptr;
+    DeallocateImage(&image);
     return false;
   }
+  return true;
+}
+
+// Makes the first num_read_bytes of data->file_data available to the decoder.
+static void SignalBytesRead(IncrementalDecoder* const decoder,
+                            size_t num_read_bytes, bool all_read) {
+  {
+    std::lock_guard<std::mutex> lock(decoder->mutex);
+    decoder->num_read_bytes = num_read_bytes;
+    decoder->all_read = all_read;
+  }
+  decoder->bytes_read.notify_one();
+}
 
-  bool success = true;
-  for (int i = 0; success && i < Metadata::kNum; ++i) {
-    WebPChunkIterator iter;
-    const int found = WebPDemuxGetChunk(demux, metadata[i].four_cc, 0, &iter);
-    if (found != 0 && iter.chunk.bytes != nullptr && iter.chunk.size > 0) {
-      if (!WebPDataCopy(&iter.chunk, &metadata[i].chunk)) {
-        LOG("/!\\ WebPDataCopy of " << metadata[i].four_cc << " chunk ("
-                                    << iter.chunk.size << " bytes) failed.");
-        success = false;
-      } else {
-        LOG("Retrieved " << metadata[i].four_cc << " chunk ("
-                         << metadata[i].chunk.size << " bytes).");
+void ReadFileData(FormatRecordPtr format_record, Data* const data,
+                  int16* const result) {
+  if (*result != noErr) return;
+  START_TIMER(ReadFileData);
+  const std::chrono::steady_clock::time_point begin =
+      std::chrono::steady_clock::now();
+
+  ReleaseFileData(data);
+  DeallocateImage(&data->decoded_image);
+  Allocate(data->file_size, &data->file_data, result);
+  if (*result != noErr) return;
+  *result = PSSDKSetFPos((int32)format_record->dataFork,
+                         format_record->posixFileDescriptor,
+                         format_record->pluginUsingPOSIXIO, fsFromStart, 0);
+  if (*result != noErr) {
+    LOG("/!\\ Unable to set cursor at the beginning of the file.");
+    ReleaseFileData(data);
+    return;
+  }
+
+  Progress progress;
+  ProgressInit(format_record, &progress);
+  ProgressAddWork(&progress, data->file_size);
+
+  IncrementalDecoder decoder;
+  bool features_known = false;
+  double reading_ms = 0;
+  size_t num_read_bytes = 0;
+  while (num_read_bytes < data->file_size && *result == noErr) {
+    const size_t chunk_size =
+        std::min(kReadChunkSize, data->file_size - num_read_bytes);
+    const std::chrono::steady_clock::time_point read_begin =
+        std::chrono::steady_clock::now();
+    ReadSome(chunk_size, (uint8_t*)data->file_data + num_read_bytes,
+             format_record, result);
+    reading_ms += MillisecondsSince(read_begin);
+    if (*result != noErr) break;
+    num_read_bytes += chunk_size;
+
+    // Animations are decoded by WebPAnimDecoder once the whole file is read.
+    if (!features_known) {
+      const VP8StatusCode status =
+          WebPGetFeatures((const uint8_t*)data->file_data, num_read_bytes,
+                          &data->read_config.input);
+      features_known = (status != VP8_STATUS_NOT_ENOUGH_DATA);
+      if (status == VP8_STATUS_OK && !data->read_config.input.has_animation) {
+        // Even on one core, the decoder runs while the host waits for I/O.
+        StartIncrementalDecoder(data, &decoder);
       }
     }
-    // Only the last chunk of each type is imported.
-    WebPDemuxReleaseChunkIterator(&iter);
+    if (decoder.idec != nullptr) {
+      SignalBytesRead(&decoder, num_read_bytes,
+                      /*all_read=*/num_read_bytes == data->file_size);
+    }
+    if (!ProgressAdvance(&progress, chunk_size)) {
+      LOG("Cancelled after reading " << num_read_bytes << " bytes.");
+      *result = userCanceledErr;
+    }
+  }
+
+  if (decoder.idec != nullptr) {
+    SignalBytesRead(&decoder, num_read_bytes, /*all_read=*/true);
+    decoder.thread.join();
+    WebPIDelete(decoder.idec);
+    if (*result == noErr && decoder.decoded) {
+      LOG("Read " << num_read_bytes << " bytes in " << reading_ms
+                  << " ms while decoding in " << decoder.decoding_ms
+                  << " ms, " << MillisecondsSince(begin) << " ms in total.");
+    } else {
+      // Decoded again from the start by ReadStillImage(), whose WebPIDecoder
+      // tells whether the file is really broken. Animations never get here,
+      // their errors are reported by WebPAnimDecoder in InitAnimDecoder().
+      DeallocateImage(&data->decoded_image);
+    }
   }
-  WebPDemuxDelete(demux);
-  return success;
+  if (*result != noErr) ReleaseFileData(data);
+  (void)begin;  // Only used by LOG().
+
+  STOP_TIMER(ReadFileData);
 }
 
+//------------------------------------------------------------------------------
+
 static OSErr SetHostProperty(const Metadata& metadata, PIType key) {
   OSErr result = noErr;
   const WebPData& chunk = metadata.chunk;
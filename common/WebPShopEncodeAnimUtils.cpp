@@ -12,6 +12,15 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "WebPShop.h"
 #include "webp/mux.h"
 
@@ -71,15 +80,28 @@ bool TryExtractDuration(const uint16* const layer_name,
 
 //------------------------------------------------------------------------------
 
-bool EncodeAllFrames(const std::vector<FrameMemoryDesc>& original_frames,
-                     const WriteConfig& write_config,
-                     WebPData* const encoded_data) {
-  START_TIMER(EncodeAllFrames);
+// Only checks for cancellation: WebPAnimEncoderAdd() encodes several
+// candidates per frame so the progress is counted in frames instead.
+static int PollProgress(int percent, const WebPPicture* picture) {
+  (void)percent;
+  return ProgressPoll((Progress*)picture->user_data) ? 1 : 0;
+}
 
-  if (original_frames.empty() || encoded_data == nullptr) {
-    LOG("/!\\ Bad input/output.");
-    return false;
-  }
+// Returns the frame at 'index', or nullptr on failure. The frame only needs to
+// stay valid until the next call. Sets *same_as_previous if its pixels are
+// known to be identical to the previous frame.
+typedef std::function<const FrameMemoryDesc*(size_t index,
+                                             bool* const same_as_previous)>
+    FrameGetter;
+
+// Encodes the 'num_frames' frames returned in order by get_frame() into
+// encoded_data. Each frame counts as one unit of 'progress'.
+static bool EncodeFrames(const FrameGetter& get_frame, size_t num_frames,
+                         const WriteConfig& write_config,
+                         Progress* const progress,
+                         WebPData* const encoded_data) {
+  const std::chrono::steady_clock::time_point begin =
+      std::chrono::steady_clock::now();
 
   WebPConfig config;
   if (!WebPConfigInit(&config)) {
@@ -102,37 +124,93 @@ bool EncodeAllFrames(const std::vector<FrameMemoryDesc>& original_frames,
   anim_encoder_options.anim_params.loop_count =
       write_config.loop_forever ? 0 : 1;
 
-  WebPAnimEncoder* anim_encoder = WebPAnimEncoderNew(
-      original_frames[0].image.width, original_frames[0].image.height,
-      &anim_encoder_options);
-  if (anim_encoder == nullptr) {
-    LOG("/!\\ WebPAnimEncoderNew() failed.");
+  // Created with the first frame, which gives the canvas dimensions.
+  WebPAnimEncoder* anim_encoder = nullptr;
+  const auto fail = [&]() {
+    WebPPictureFree(&pic);
+    WebPAnimEncoderDelete(anim_encoder);
     return false;
-  }
+  };
 
   int timestamp_ms = 0;
+  ProgressAddWork(progress, num_frames);
 
-  for (size_t i = 0; i < original_frames.size(); ++i) {
-    const FrameMemoryDesc& frame = original_frames[i];
-    if (!CastToWebPPicture(config, frame.image, &pic)) {
-      WebPPictureFree(&pic);
-      WebPAnimEncoderDelete(anim_encoder);
-      return false;
+  size_t num_skipped_frames = 0;
+  for (size_t i = 0; i < num_frames; ++i) {
+    bool same_as_previous = false;
+    const FrameMemoryDesc* const frame = get_frame(i, &same_as_previous);
+    if (frame == nullptr) return fail();
+
+    // WebPAnimEncoder would find an empty difference and extend the previous
+    // frame anyway. Skipping it spares the conversion and the comparison.
+    if (i > 0 && same_as_previous) {
+      ++num_skipped_frames;
+      timestamp_ms += frame->duration_ms;
+      if (!ProgressAdvance(progress, 1)) {
+        LOG("Cancelled at frame " << i << ".");
+        return fail();
+      }
+      continue;
     }
 
-    if (!WebPAnimEncoderAdd(anim_encoder, &pic, timestamp_ms, &config)) {
-      LOG("/!\\ WebPAnimEncoderAdd failed (" << pic.error_code << ").");
-      WebPPictureFree(&pic);
-      WebPAnimEncoderDelete(anim_encoder);
-      return false;
+    if (i == 0) {
+      if (write_config.time_budget_ms > 0 &&
+          !SetWebPConfigForTimeBudget(
+              frame->image,
+              (double)frame->image.width * frame->image.height * num_frames,
+              write_config.time_budget_ms, &config)) {
+        return fail();
+      }
+      anim_encoder = WebPAnimEncoderNew(
+          frame->image.width, frame->image.height, &anim_encoder_options);
+      if (anim_encoder == nullptr) {
+        LOG("/!\\ WebPAnimEncoderNew() failed.");
+        return fail();
+      }
     }
 
-    timestamp_ms += frame.duration_ms;
+    // Use the fastest method for the remaining frames if behind schedule.
+    if (write_config.time_budget_ms > 0 && config.method > 0) {
+      const double elapsed_ms =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now() - begin)
+              .count();
+      if (elapsed_ms * num_frames >
+          (double)write_config.time_budget_ms * (i + 1)) {
+        LOG("Method " << config.method << " is behind the time budget at frame "
+                      << i << ", switching to method 0.");
+        config.method = 0;
+        config.use_sharp_yuv = 0;
+      }
+    }
+
+    if (!CastToWebPPicture(config, frame->image, &pic)) return fail();
+    if (progress != nullptr) {
+      pic.progress_hook = PollProgress;
+      pic.user_data = progress;
+    }
+
+    if (!WebPAnimEncoderAdd(anim_encoder, &pic, timestamp_ms, &config) ||
+        !ProgressAdvance(progress, 1)) {
+      if (ProgressIsCanceled(progress)) {
+        LOG("Cancelled at frame " << i << ".");
+      } else {
+        LOG("/!\\ WebPAnimEncoderAdd failed (" << pic.error_code << ").");
+      }
+      return fail();
+    }
+
+    timestamp_ms += frame->duration_ms;
   }
 
   WebPPictureFree(&pic);
+  if (num_skipped_frames > 0) {
+    LOG("Skipped " << num_skipped_frames << " frames identical to the "
+                   << "previous one.");
+  }
 
-  if (!WebPAnimEncoderAdd(anim_encoder, nullptr, timestamp_ms, nullptr)) {
+  if (anim_encoder == nullptr ||
+      !WebPAnimEncoderAdd(anim_encoder, nullptr, timestamp_ms, nullptr)) {
     LOG("/!\\ Last WebPAnimEncoderAdd() failed.");
     WebPAnimEncoderDelete(anim_encoder);
     return false;
@@ -146,9 +224,507 @@ bool EncodeAllFrames(const std::vector<FrameMemoryDesc>& original_frames,
   }
 
   WebPAnimEncoderDelete(anim_encoder);
+  return true;
+}
+
+// Encodes original_frames[first_frame:last_frame) into encoded_data.
+static bool EncodeFrames(const std::vector<FrameMemoryDesc>& original_frames,
+                         size_t first_frame, size_t last_frame,
+                         const WriteConfig& write_config,
+                         Progress* const progress,
+                         WebPData* const encoded_data) {
+  return EncodeFrames(
+      [&original_frames, first_frame](size_t index, bool* const) {
+        return &original_frames[first_frame + index];
+      },
+      last_frame - first_frame, write_config, progress, encoded_data);
+}
+
+//------------------------------------------------------------------------------
+
+// Minimum number of frames per independently encoded animation segment.
+// Shorter segments lose too much inter-frame compression.
+static const size_t kMinNumFramesPerSegment = 16;
+
+static bool IsOpaque(const ImageMemoryDesc& image) {
+  if (image.num_channels != 4 || image.pixels.depth != 8) return false;
+  for (int32 y = 0; y < image.height; ++y) {
+    const uint8_t* alpha = reinterpret_cast<const uint8_t*>(image.pixels.data) +
+                           y * (image.pixels.rowBits / 8) + /*channel=*/3;
+    for (int32 x = 0; x < image.width; ++x, alpha += 4) {
+      if (*alpha != 255) return false;
+    }
+  }
+  return true;
+}
+
+// WebPAnimEncoder encodes the first frame of an animation relatively to a
+// fully transparent canvas. A fully opaque frame thus becomes a full-canvas,
+// non-blended key-frame which does not depend on the frames before it: the
+// animation can be cut right before it without changing the rendering.
+// The cuts only depend on the frames, not on the number of threads.
+static std::vector<size_t> FindSegmentStarts(
+    const std::vector<FrameMemoryDesc>& original_frames) {
+  std::vector<size_t> segment_starts(1, 0);
+  for (size_t i = kMinNumFramesPerSegment;
+       i + kMinNumFramesPerSegment <= original_frames.size(); ++i) {
+    if (i - segment_starts.back() >= kMinNumFramesPerSegment &&
+        IsOpaque(original_frames[i].image)) {
+      segment_starts.push_back(i);
+    }
+  }
+  return segment_starts;
+}
+
+// Concatenates the frames of all encoded segments into encoded_data.
+static bool StitchSegments(const std::vector<WebPData>& segments,
+                           const std::vector<int>& segment_durations_ms,
+                           int canvas_width, int canvas_height,
+                           const WebPMuxAnimParams& anim_params,
+                           WebPData* const encoded_data) {
+  WebPMux* const mux = WebPMuxNew();
+  if (mux == nullptr) {
+    LOG("/!\\ WebPMuxNew() failed.");
+    return false;
+  }
+
+  bool success = true;
+  if (WebPMuxSetAnimationParams(mux, &anim_params) != WEBP_MUX_OK) {
+    LOG("/!\\ WebPMuxSetAnimationParams() failed.");
+    success = false;
+  }
+  for (size_t s = 0; success && s < segments.size(); ++s) {
+    WebPMux* const segment_mux = WebPMuxCreate(&segments[s], /*copy_data=*/0);
+    uint32_t flags = 0;
+    if (segment_mux == nullptr ||
+        WebPMuxGetFeatures(segment_mux, &flags) != WEBP_MUX_OK) {
+      LOG("/!\\ Unable to parse segment " << s << ".");
+      WebPMuxDelete(segment_mux);
+      success = false;
+      break;
+    }
+
+    // WebPAnimEncoder outputs a still image if the segment ends up with a
+    // single frame (identical frames are merged). Its duration is lost.
+    const bool is_animated = (flags & ANIMATION_FLAG) != 0;
+    for (uint32_t n = 1; success; ++n) {
+      WebPMuxFrameInfo frame;
+      const WebPMuxError mux_error = WebPMuxGetFrame(segment_mux, n, &frame);
+      if (mux_error == WEBP_MUX_NOT_FOUND) break;
+      if (mux_error != WEBP_MUX_OK) {
+        LOG("/!\\ WebPMuxGetFrame(" << n << ") failed (" << mux_error
+                                     << ").");
+        success = false;
+        break;
+      }
+      if (!is_animated) {
+        frame.id = WEBP_CHUNK_ANMF;  // Was WEBP_CHUNK_IMAGE.
+        frame.x_offset = 0;
+        frame.y_offset = 0;
+        frame.duration = segment_durations_ms[s];
+        frame.dispose_method = WEBP_MUX_DISPOSE_NONE;
+        frame.blend_method = WEBP_MUX_NO_BLEND;
+      }
+      if (WebPMuxPushFrame(mux, &frame, /*copy_data=*/1) != WEBP_MUX_OK) {
+        LOG("/!\\ WebPMuxPushFrame() failed.");
+        success = false;
+      }
+      WebPDataClear(&frame.bitstream);
+    }
+    WebPMuxDelete(segment_mux);
+  }
+
+  if (success &&
+      WebPMuxSetCanvasSize(mux, canvas_width, canvas_height) != WEBP_MUX_OK) {
+    LOG("/!\\ WebPMuxSetCanvasSize() failed.");
+    success = false;
+  }
+
+  if (success) {
+    WebPData mux_data = {nullptr, 0};
+    const WebPMuxError mux_error = WebPMuxAssemble(mux, &mux_data);
+    if (mux_error != WEBP_MUX_OK) {
+      LOG("/!\\ WebPMuxAssemble failed (" << mux_error << ").");
+      WebPDataClear(&mux_data);
+      success = false;
+    } else {
+      WebPDataClear(encoded_data);
+      *encoded_data = mux_data;
+    }
+  }
+  WebPMuxDelete(mux);
+  return success;
+}
+
+static bool EncodeSegments(const std::vector<FrameMemoryDesc>& original_frames,
+                           const std::vector<size_t>& segment_starts,
+                           const WriteConfig& write_config,
+                           Progress* const progress,
+                           WebPData* const encoded_data) {
+  const size_t num_segments = segment_starts.size();
+  std::vector<WebPData> segments(num_segments);
+  std::vector<int> segment_durations_ms(num_segments, 0);
+  for (WebPData& segment : segments) WebPDataInit(&segment);
+
+  const auto segment_end = [&](size_t s) {
+    return (s + 1 < num_segments) ? segment_starts[s + 1]
+                                  : original_frames.size();
+  };
+  for (size_t s = 0; s < num_segments; ++s) {
+    for (size_t i = segment_starts[s]; i < segment_end(s); ++i) {
+      segment_durations_ms[s] += original_frames[i].duration_ms;
+    }
+  }
+
+  const int num_threads = GetNumWorkerThreads();
+  LOG("Encoding " << num_segments << " segments with up to " << num_threads
+                  << " threads.");
+  bool success = RunInParallel(
+      num_segments, num_threads,
+      [&](size_t s) {
+        return EncodeFrames(original_frames, segment_starts[s], segment_end(s),
+                            write_config, progress, &segments[s]);
+      },
+      progress);
+
+  // Same animation parameters as the ones set by WebPAnimEncoder.
+  WebPAnimEncoderOptions anim_encoder_options;
+  if (success && !WebPAnimEncoderOptionsInit(&anim_encoder_options)) {
+    LOG("/!\\ WebPAnimEncoderOptionsInit() failed.");
+    success = false;
+  }
+  anim_encoder_options.anim_params.loop_count =
+      write_config.loop_forever ? 0 : 1;
+
+  if (success) {
+    success = StitchSegments(segments, segment_durations_ms,
+                             original_frames[0].image.width,
+                             original_frames[0].image.height,
+                             anim_encoder_options.anim_params, encoded_data);
+  }
+  for (WebPData& segment : segments) WebPDataClear(&segment);
+  return success;
+}
+
+bool EncodeAllFrames(const std::vector<FrameMemoryDesc>& original_frames,
+                     const WriteConfig& write_config, Progress* const progress,
+                     WebPData* const encoded_data) {
+  START_TIMER(EncodeAllFrames);
+
+  if (original_frames.empty() || encoded_data == nullptr) {
+    LOG("/!\\ Bad input/output.");
+    return false;
+  }
+
+  if (write_config.target_size > 0) {
+    return EncodeToTargetSize(
+        write_config,
+        [&original_frames, progress](const WriteConfig& probe_config,
+                                     WebPData* const probe_data) {
+          return EncodeAllFrames(original_frames, probe_config, progress,
+                                 probe_data);
+        },
+        progress, encoded_data);
+  }
+  if (write_config.target_metric != DistortionMetric::NO_METRIC) {
+    return EncodeToTargetDistortion(
+        write_config,
+        [&original_frames, progress](const WriteConfig& probe_config,
+                                     WebPData* const probe_data) {
+          return EncodeAllFrames(original_frames, probe_config, progress,
+                                 probe_data);
+        },
+        [&original_frames](const WebPData& probe_data, DistortionMetric metric,
+                           double* const distortion) {
+          return MeasureAllFrames(original_frames, probe_data, metric,
+                                  distortion);
+        },
+        progress, encoded_data);
+  }
+
+  const std::vector<size_t> segment_starts =
+      write_config.parallel_animation ? FindSegmentStarts(original_frames)
+                                      : std::vector<size_t>(1, 0);
+  if (segment_starts.size() > 1) {
+    if (!EncodeSegments(original_frames, segment_starts, write_config,
+                        progress, encoded_data)) {
+      return false;
+    }
+  } else if (!EncodeFrames(original_frames, 0, original_frames.size(),
+                           write_config, progress, encoded_data)) {
+    return false;
+  }
+
   LOG("Encoded " << original_frames.size() << " frames into "
                  << encoded_data->size << " bytes.");
 
   STOP_TIMER(EncodeAllFrames);
   return true;
 }
+
+//------------------------------------------------------------------------------
+
+bool CanStreamAllLayers(const WriteConfig& write_config) {
+  return write_config.animation && !write_config.parallel_animation &&
+         write_config.target_size <= 0 &&
+         write_config.target_metric == DistortionMetric::NO_METRIC &&
+         write_config.encode_cache_size_mb <= 0;
+}
+
+// Reads, converts and encodes each layer in turn on the calling thread.
+static bool EncodeLayersInTurn(FormatRecordPtr format_record,
+                               Data* const data,
+                               const std::vector<const ReadLayerDesc*>& layers,
+                               Progress* const progress, int16* const result,
+                               WebPData* const encoded_data) {
+  // A single frame is in memory at a time: each layer is read into the same
+  // buffer once the previous one was given to WebPAnimEncoder, which only
+  // keeps its own canvases and the encoded frames.
+  FrameMemoryDesc frame;
+  const bool success = EncodeFrames(
+      [&](size_t index, bool* const) -> const FrameMemoryDesc* {
+        const ReadLayerDesc& layer = *layers[index];
+        if (!TryExtractDuration(layer.unicodeName, &frame.duration_ms)) {
+          LOG("/!\\ Can't extract duration from layer name.");
+          *result = writErr;
+          return nullptr;
+        }
+        // Animation frames must be BGRA.
+        CopyLayer(format_record, data, layer, /*keep_rgb=*/false, result,
+                  &frame.image);
+        if (*result != noErr) return nullptr;
+        if (!ProgressAdvance(progress, 1)) {
+          LOG("Cancelled after " << index << " layers.");
+          *result = userCanceledErr;
+          return nullptr;
+        }
+        return &frame;
+      },
+      layers.size(), data->write_config, progress, encoded_data);
+  DeallocateImage(&frame.image);
+  return success;
+}
+
+//------------------------------------------------------------------------------
+
+// Maximum number of frames read but not given to WebPAnimEncoder yet.
+static const size_t kMaxNumPipelinedFrames = 4;
+// Delay between two polls of the progress while the host thread waits.
+static const std::chrono::milliseconds kPipelinePollInterval(10);
+
+// A layer going through the pipeline.
+struct PipelinedFrame {
+  ImageMemoryDesc source;  // At the bit depth of the document.
+  FrameMemoryDesc frame;   // 8-bit BGRA.
+  std::string key;         // Identifies the pixels of 'frame'.
+  bool converted = false;
+};
+
+static double MillisecondsSince(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - begin)
+      .count();
+}
+
+// Reads the layers on the calling thread (the host can only be called from
+// it), converts them to 8 bits and hashes them on worker threads, and encodes
+// them on another thread, all at the same time. At most
+// kMaxNumPipelinedFrames frames are in memory. Returns false without
+// encoding anything if the encoding thread could not be started.
+static bool EncodeLayersPipelined(
+    FormatRecordPtr format_record, Data* const data,
+    const std::vector<const ReadLayerDesc*>& layers, Progress* const progress,
+    int16* const result, bool* const success, WebPData* const encoded_data) {
+  const size_t num_layers = layers.size();
+  std::vector<PipelinedFrame> frames(num_layers);
+  const int num_convert_threads = std::max(GetNumWorkerThreads() - 1, 1);
+
+  std::mutex mutex;
+  std::condition_variable frame_converted, frame_encoded;
+  size_t num_encoded_frames = 0;  // Freed once given to WebPAnimEncoder.
+  bool failed = false;
+  bool encoder_finished = false;
+  // Busy time of each stage, to find the bottleneck.
+  double read_ms = 0, convert_ms = 0, encode_wait_ms = 0;
+  size_t num_duplicates = 0;
+
+  const auto release_frame = [&](size_t index) {
+    DeallocateImage(&frames[index].source);
+    DeallocateImage(&frames[index].frame.image);
+  };
+
+  // Encoding stage: frames are given to WebPAnimEncoder in order.
+  bool encoded = false;
+  const auto get_frame = [&](size_t index, bool* const same_as_previous)
+      -> const FrameMemoryDesc* {
+    const std::chrono::steady_clock::time_point wait_begin =
+        std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex);
+    if (index > 0) {
+      // WebPAnimEncoder made its own copy of the previous frame.
+      release_frame(index - 1);
+      num_encoded_frames = index;
+      frame_encoded.notify_all();
+    }
+    frame_converted.wait(
+        lock, [&]() { return frames[index].converted || failed; });
+    encode_wait_ms += MillisecondsSince(wait_begin);
+    if (failed) return nullptr;
+    *same_as_previous =
+        (index > 0 && frames[index].key == frames[index - 1].key);
+    if (*same_as_previous) ++num_duplicates;
+    return &frames[index].frame;
+  };
+  const std::chrono::steady_clock::time_point begin =
+      std::chrono::steady_clock::now();
+  std::thread encoder_thread;
+  try {
+    encoder_thread = std::thread([&]() {
+      try {
+        encoded = EncodeFrames(get_frame, num_layers, data->write_config,
+                               progress, encoded_data);
+      } catch (...) {
+        LOG("/!\\ Caught an exception in the encoding thread.");
+        encoded = false;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!encoded) failed = true;
+      encoder_finished = true;
+      frame_converted.notify_all();
+      frame_encoded.notify_all();
+    });
+  } catch (const std::exception& e) {
+    (void)e;
+    LOG("/!\\ Unable to start the encoding thread: " << e.what());
+    return false;
+  }
+
+  // Reading stage, on this thread. Waits for the encoder to bound the memory.
+  const auto read_layer = [&](size_t index) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (index >= num_encoded_frames + kMaxNumPipelinedFrames && !failed) {
+        if (!frame_encoded.wait_for(lock, kPipelinePollInterval, [&]() {
+              return index < num_encoded_frames + kMaxNumPipelinedFrames;
+            })) {
+          lock.unlock();
+          if (!ProgressPoll(progress)) *result = userCanceledErr;
+          lock.lock();
+          if (*result != noErr) failed = true;
+        }
+      }
+      if (failed) return false;
+    }
+    const std::chrono::steady_clock::time_point read_begin =
+        std::chrono::steady_clock::now();
+    PipelinedFrame& frame = frames[index];
+    const ReadLayerDesc& layer = *layers[index];
+    if (!TryExtractDuration(layer.unicodeName, &frame.frame.duration_ms)) {
+      LOG("/!\\ Can't extract duration from layer name.");
+      *result = writErr;
+    } else {
+      CopyLayerAtSourceDepth(format_record, data, layer, result,
+                             &frame.source);
+    }
+    if (*result == noErr && !ProgressAdvance(progress, 1)) {
+      LOG("Cancelled after " << index << " layers.");
+      *result = userCanceledErr;
+    }
+    read_ms += MillisecondsSince(read_begin);
+    return *result == noErr;
+  };
+
+  // Conversion stage, on worker threads in any order.
+  const auto convert_frame = [&](size_t index) {
+    const std::chrono::steady_clock::time_point convert_begin =
+        std::chrono::steady_clock::now();
+    PipelinedFrame& frame = frames[index];
+    bool converted = true;
+    if (frame.source.pixels.depth == 8) {
+      std::swap(frame.source, frame.frame.image);
+    } else {
+      converted = To8bit(frame.source,
+                         /*add_alpha=*/frame.source.num_channels < 4,
+                         &frame.frame.image);
+      DeallocateImage(&frame.source);
+    }
+    if (converted) frame.key = GetImageKey(frame.frame.image);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    convert_ms += MillisecondsSince(convert_begin);
+    if (converted) {
+      frame.converted = true;
+    } else {
+      failed = true;
+    }
+    frame_converted.notify_all();
+    return converted;
+  };
+
+  const bool pipelined =
+      RunPipelined(num_layers, kMaxNumPipelinedFrames, num_convert_threads,
+                   read_layer, convert_frame, progress);
+
+  // Keep the host responsive until the last frames are encoded.
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!pipelined) {
+      failed = true;
+      frame_converted.notify_all();
+    }
+    while (!frame_encoded.wait_for(lock, kPipelinePollInterval,
+                                   [&]() { return encoder_finished; })) {
+      lock.unlock();
+      ProgressPoll(progress);  // The encoder checks it too.
+      lock.lock();
+    }
+  }
+  encoder_thread.join();
+  for (size_t i = 0; i < num_layers; ++i) release_frame(i);
+
+  const double elapsed_ms = std::max(MillisecondsSince(begin), 1.);
+  LOG("Pipelined " << num_layers << " layers in " << elapsed_ms
+                   << " ms. Busy: read " << (int)(100 * read_ms / elapsed_ms)
+                   << "%, convert "
+                   << (int)(100 * convert_ms /
+                            (elapsed_ms * num_convert_threads))
+                   << "% (" << num_convert_threads << " threads), encode "
+                   << (int)(100 * (elapsed_ms - encode_wait_ms) / elapsed_ms)
+                   << "%. " << num_duplicates << " duplicate frames.");
+  (void)elapsed_ms;  // Only used by LOG().
+
+  *success = pipelined && encoded;
+  return true;
+}
+
+void EncodeAllLayers(FormatRecordPtr format_record, Data* const data,
+                     Progress* const progress, int16* const result,
+                     WebPData* const encoded_data) {
+  if (*result != noErr) return;
+  START_TIMER(EncodeAllLayers);
+
+  std::vector<const ReadLayerDesc*> layers;
+  if (!GetLayers(format_record, result, &layers)) return;
+  ProgressAddWork(progress, layers.size());
+
+  bool success = false;
+  if (GetNumWorkerThreads() < 2 ||
+      !EncodeLayersPipelined(format_record, data, layers, progress, result,
+                             &success, encoded_data)) {
+    success = EncodeLayersInTurn(format_record, data, layers, progress,
+                                 result, encoded_data);
+  }
+
+  if (*result == noErr && (!success || encoded_data->bytes == nullptr ||
+                           encoded_data->size == 0)) {
+    *result = ProgressIsCanceled(progress) ? userCanceledErr : writErr;
+  }
+  if (*result != noErr) {
+    WebPDataClear(encoded_data);
+    return;
+  }
+  LOG("Encoded " << layers.size() << " layers into " << encoded_data->size
+                 << " bytes.");
+
+  STOP_TIMER(EncodeAllLayers);
+}
@@ -0,0 +1,141 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <chrono>
+
+#include "WebPShop.h"
+#include "webp/encode.h"
+
+//------------------------------------------------------------------------------
+
+// Effort levels, from the fastest to the slowest.
+struct EffortLevel {
+  int method;
+  bool use_sharp_yuv;
+};
+static const EffortLevel kEffortLevels[] = {
+    {0, false}, {1, false}, {2, false}, {3, false},
+    {4, false}, {5, false}, {6, false}, {6, true}};
+
+// Width and height of the crop used to measure the encoding speed. Big enough
+// to be representative, small enough to be negligible compared to the image.
+static const int32 kCalibrationSize = 128;
+
+static double GetElapsedMs(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - begin)
+             .count() /
+         1000.0;
+}
+
+static int DiscardWrite(const uint8_t* data, size_t data_size,
+                        const WebPPicture* picture) {
+  (void)data;
+  (void)data_size;
+  (void)picture;
+  return 1;
+}
+
+bool SetWebPConfigForTimeBudget(const ImageMemoryDesc& sample_image,
+                                double num_pixels, int32 time_budget_ms,
+                                WebPConfig* const config) {
+  START_TIMER(SetWebPConfigForTimeBudget);
+  const std::chrono::steady_clock::time_point begin =
+      std::chrono::steady_clock::now();
+
+  if (time_budget_ms <= 0 || num_pixels <= 0. || config == nullptr) {
+    LOG("/!\\ Bad time budget or config.");
+    return false;
+  }
+
+  // Calibrate on the center of the image, where the content usually is.
+  const int32 crop_width = std::min(sample_image.width, kCalibrationSize);
+  const int32 crop_height = std::min(sample_image.height, kCalibrationSize);
+  ImageMemoryDesc crop;
+  if (!Crop(sample_image, &crop, (size_t)crop_width, (size_t)crop_height,
+            (size_t)((sample_image.width - crop_width) / 2),
+            (size_t)((sample_image.height - crop_height) / 2))) {
+    LOG("/!\\ Crop failed.");
+    return false;
+  }
+  const double crop_num_pixels = (double)crop_width * crop_height;
+
+  // Measure the throughput of each effort level in increasing order and stop
+  // at the first one that would not fit in what is left of the budget. The
+  // fastest level is kept even if it does not fit.
+  size_t chosen_level = 0;
+  double chosen_predicted_ms = 0.;
+  bool success = true;
+  for (size_t level = 0;
+       success && level < sizeof(kEffortLevels) / sizeof(kEffortLevels[0]);
+       ++level) {
+    if (kEffortLevels[level].use_sharp_yuv && config->lossless) break;
+
+    WebPConfig calibration_config = *config;
+    calibration_config.method = kEffortLevels[level].method;
+    calibration_config.use_sharp_yuv = kEffortLevels[level].use_sharp_yuv;
+
+    WebPPicture pic;
+    if (!WebPPictureInit(&pic)) {
+      LOG("/!\\ WebPPictureInit() failed.");
+      success = false;
+      break;
+    }
+    if (!CastToWebPPicture(calibration_config, crop, &pic)) {
+      WebPPictureFree(&pic);
+      success = false;
+      break;
+    }
+    pic.writer = DiscardWrite;
+    const std::chrono::steady_clock::time_point calibration_begin =
+        std::chrono::steady_clock::now();
+    if (!WebPEncode(&calibration_config, &pic)) {
+      LOG("/!\\ WebPEncode failed (" << pic.error_code << ").");
+      WebPPictureFree(&pic);
+      success = false;
+      break;
+    }
+    const double crop_ms =
+        std::max(GetElapsedMs(calibration_begin), 0.001);
+    WebPPictureFree(&pic);
+
+    const double predicted_ms = crop_ms * num_pixels / crop_num_pixels;
+    LOG("Method " << calibration_config.method
+                  << (calibration_config.use_sharp_yuv ? " + sharp YUV" : "")
+                  << ": " << (crop_num_pixels / crop_ms / 1000.0)
+                  << " Mpixels/s, " << predicted_ms << " ms predicted.");
+    if (level > 0 && GetElapsedMs(begin) + predicted_ms > time_budget_ms) {
+      break;
+    }
+    chosen_level = level;
+    chosen_predicted_ms = predicted_ms;
+  }
+  DeallocateImage(&crop);
+  (void)chosen_predicted_ms;  // Only logged.
+
+  if (success) {
+    config->method = kEffortLevels[chosen_level].method;
+    config->use_sharp_yuv = kEffortLevels[chosen_level].use_sharp_yuv;
+    LOG("Chose method " << config->method
+                        << (config->use_sharp_yuv ? " + sharp YUV" : "")
+                        << " to encode " << num_pixels << " pixels in "
+                        << chosen_predicted_ms << " / " << time_budget_ms
+                        << " ms (calibration took " << GetElapsedMs(begin)
+                        << " ms).");
+  }
+
+  STOP_TIMER(SetWebPConfigForTimeBudget);
+  return success;
+}
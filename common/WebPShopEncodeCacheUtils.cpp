@@ -0,0 +1,485 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __PIMac__
+#include <dirent.h>
+#include <utime.h>
+#else
+#include <direct.h>
+#include <io.h>
+#include <sys/utime.h>
+#define NOMINMAX  // Keeps std::min() usable.
+#include <windows.h>
+#endif
+
+#include "WebPShop.h"
+#include "webp/decode.h"
+#include "webp/encode.h"
+
+//------------------------------------------------------------------------------
+// Hash
+
+// Streamed 64-bit multiply-rotate hash over four lanes, in the manner of
+// xxHash64. The lanes are finalized twice to get a 128-bit key: collisions
+// would silently export the wrong pixels.
+struct Hasher {
+  uint64_t lanes[4];
+  uint8_t stripe[32];  // Buffered until it is full.
+  size_t stripe_size;
+  uint64_t total_size;
+};
+
+static const uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+static const uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+static uint64_t RotateLeft(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t Read64(const uint8_t* const data) {
+  uint64_t value;
+  memcpy(&value, data, sizeof(value));  // Little-endian hosts only.
+  return value;
+}
+
+static uint64_t Round(uint64_t lane, uint64_t input) {
+  lane += input * kPrime2;
+  return RotateLeft(lane, 31) * kPrime1;
+}
+
+static uint64_t Avalanche(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= kPrime2;
+  hash ^= hash >> 29;
+  hash *= kPrime3;
+  return hash ^ (hash >> 32);
+}
+
+static void HasherInit(Hasher* const hasher) {
+  hasher->lanes[0] = kPrime1 + kPrime2;
+  hasher->lanes[1] = kPrime2;
+  hasher->lanes[2] = 0;
+  hasher->lanes[3] = 0 - kPrime1;
+  hasher->stripe_size = 0;
+  hasher->total_size = 0;
+}
+
+static void HashStripe(Hasher* const hasher, const uint8_t* const stripe) {
+  for (int i = 0; i < 4; ++i) {
+    hasher->lanes[i] = Round(hasher->lanes[i], Read64(stripe + 8 * i));
+  }
+}
+
+static void HasherUpdate(Hasher* const hasher, const void* const data,
+                         size_t size) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  hasher->total_size += size;
+  if (hasher->stripe_size > 0) {
+    const size_t num_bytes = std::min(size, 32 - hasher->stripe_size);
+    memcpy(hasher->stripe + hasher->stripe_size, bytes, num_bytes);
+    hasher->stripe_size += num_bytes;
+    bytes += num_bytes;
+    size -= num_bytes;
+    if (hasher->stripe_size < 32) return;
+    HashStripe(hasher, hasher->stripe);
+    hasher->stripe_size = 0;
+  }
+  for (; size >= 32; bytes += 32, size -= 32) HashStripe(hasher, bytes);
+  memcpy(hasher->stripe, bytes, size);
+  hasher->stripe_size = size;
+}
+
+template <typename T>
+static void HasherUpdateValue(Hasher* const hasher, const T& value) {
+  HasherUpdate(hasher, &value, sizeof(value));
+}
+
+// Returns 32 hexadecimal characters.
+static std::string HasherFinish(const Hasher& hasher) {
+  uint64_t tail = hasher.total_size * kPrime5;
+  for (size_t i = 0; i < hasher.stripe_size; ++i) {
+    tail = RotateLeft(tail ^ (hasher.stripe[i] * kPrime5), 11) * kPrime1;
+  }
+  const uint64_t* const lanes = hasher.lanes;
+  const uint64_t low =
+      Avalanche(RotateLeft(lanes[0], 1) + RotateLeft(lanes[1], 7) +
+                RotateLeft(lanes[2], 12) + RotateLeft(lanes[3], 18) + tail);
+  const uint64_t high = Avalanche(
+      (lanes[0] * kPrime4) ^ RotateLeft(lanes[1] * kPrime3, 17) ^
+      RotateLeft(lanes[2] * kPrime2, 29) ^ RotateLeft(lanes[3] * kPrime1, 43) ^
+      (tail + kPrime4));
+
+  static const char kDigits[] = "0123456789abcdef";
+  std::string key(32, '0');
+  for (int i = 0; i < 16; ++i) {
+    key[i] = kDigits[(high >> (60 - 4 * i)) & 0xf];
+    key[16 + i] = kDigits[(low >> (60 - 4 * i)) & 0xf];
+  }
+  return key;
+}
+
+//------------------------------------------------------------------------------
+// Key
+
+// Must list every field affecting the bitstream, as HaveSameBitstream() in
+// WebPShopUI.cpp. Metadata is added when writing the file but the target size
+// is expected to be fitted to it by FitTargetSizeToFile().
+static void HashSettings(const WriteConfig& write_config,
+                         Hasher* const hasher) {
+  static const char kVersion[] = "WebPShop encode cache 1";
+  HasherUpdate(hasher, kVersion, sizeof(kVersion));
+  HasherUpdateValue(hasher, WebPGetEncoderVersion());
+  HasherUpdateValue(hasher, (int32)write_config.quality);
+  HasherUpdateValue(hasher, (int32)write_config.compression);
+  HasherUpdateValue(hasher, (int32)write_config.profile);
+  HasherUpdateValue(hasher, (uint8_t)write_config.loop_forever);
+  HasherUpdateValue(hasher, (uint8_t)write_config.animation);
+  HasherUpdateValue(hasher, (uint8_t)write_config.parallel_animation);
+  HasherUpdateValue(hasher, write_config.target_size);
+  HasherUpdateValue(hasher, (int32)write_config.target_metric);
+  HasherUpdateValue(hasher, write_config.target_distortion);
+  HasherUpdateValue(hasher, (uint8_t)write_config.race_lossless);
+  HasherUpdateValue(hasher, write_config.time_budget_ms);
+  HasherUpdateValue(hasher, (uint8_t)write_config.auto_preset);
+}
+
+static void HashImage(const ImageMemoryDesc& image, Hasher* const hasher) {
+  HasherUpdateValue(hasher, image.width);
+  HasherUpdateValue(hasher, image.height);
+  HasherUpdateValue(hasher, (int32)image.num_channels);
+  HasherUpdateValue(hasher, image.pixels.depth);
+  const size_t row_size =
+      (size_t)image.width * image.num_channels * (image.pixels.depth / 8);
+  for (int32 y = 0; y < image.height; ++y) {
+    HasherUpdate(hasher,
+                 reinterpret_cast<const uint8_t*>(image.pixels.data) +
+                     y * (image.pixels.rowBits / 8),
+                 row_size);
+  }
+}
+
+std::string GetEncodeCacheKey(const ImageMemoryDesc& original_image,
+                              const WriteConfig& write_config) {
+  START_TIMER(GetEncodeCacheKey);
+  Hasher hasher;
+  HasherInit(&hasher);
+  HashSettings(write_config, &hasher);
+  HashImage(original_image, &hasher);
+  const std::string key = HasherFinish(hasher);
+  STOP_TIMER(GetEncodeCacheKey);
+  return key;
+}
+
+std::string GetEncodeCacheKey(
+    const std::vector<FrameMemoryDesc>& original_frames,
+    const WriteConfig& write_config) {
+  START_TIMER(GetEncodeCacheKey);
+  Hasher hasher;
+  HasherInit(&hasher);
+  HashSettings(write_config, &hasher);
+  HasherUpdateValue(&hasher, (uint64_t)original_frames.size());
+  for (const FrameMemoryDesc& frame : original_frames) {
+    HasherUpdateValue(&hasher, (int32)frame.duration_ms);
+    HashImage(frame.image, &hasher);
+  }
+  const std::string key = HasherFinish(hasher);
+  STOP_TIMER(GetEncodeCacheKey);
+  return key;
+}
+
+std::string GetImageKey(const ImageMemoryDesc& image) {
+  Hasher hasher;
+  HasherInit(&hasher);
+  HashImage(image, &hasher);
+  return HasherFinish(hasher);
+}
+
+//------------------------------------------------------------------------------
+// Files
+
+#ifdef __PIMac__
+static const char kPathSeparator = '/';
+#else
+static const char kPathSeparator = '\\';
+#endif
+
+static const char kEntryExtension[] = ".webp";
+static const char kTemporaryExtension[] = ".tmp";
+
+// Paths are UTF-8 encoded. The Windows branches use the wide CRT functions,
+// the narrow ones would interpret them in the ANSI code page.
+#ifndef __PIMac__
+static std::wstring ToWidePath(const std::string& path) {
+  const int length =
+      MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+  if (length <= 0) return std::wstring();
+  std::vector<wchar_t> wide_path(length);
+  MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, wide_path.data(), length);
+  return std::wstring(wide_path.data());
+}
+
+static std::string ToUtf8Path(const std::wstring& wide_path) {
+  const int size = WideCharToMultiByte(CP_UTF8, 0, wide_path.c_str(), -1,
+                                       nullptr, 0, nullptr, nullptr);
+  if (size <= 0) return std::string();
+  std::vector<char> utf8_path(size);
+  WideCharToMultiByte(CP_UTF8, 0, wide_path.c_str(), -1, utf8_path.data(),
+                      size, nullptr, nullptr);
+  return std::string(utf8_path.data());
+}
+#endif
+
+static FILE* OpenFile(const std::string& path, bool for_writing) {
+#ifdef __PIMac__
+  return fopen(path.c_str(), for_writing ? "wb" : "rb");
+#else
+  return _wfopen(ToWidePath(path).c_str(), for_writing ? L"wb" : L"rb");
+#endif
+}
+
+static bool RemoveFile(const std::string& path) {
+#ifdef __PIMac__
+  return remove(path.c_str()) == 0;
+#else
+  return _wremove(ToWidePath(path).c_str()) == 0;
+#endif
+}
+
+static bool RenameFile(const std::string& old_path,
+                       const std::string& new_path) {
+#ifdef __PIMac__
+  return rename(old_path.c_str(), new_path.c_str()) == 0;
+#else
+  return _wrename(ToWidePath(old_path).c_str(),
+                  ToWidePath(new_path).c_str()) == 0;
+#endif
+}
+
+// Returns the folder containing the entries, created if needed, or an empty
+// string if it is not available.
+static std::string GetCacheFolder() {
+#ifdef __PIMac__
+  const char* const home = std::getenv("HOME");
+  if (home == nullptr || home[0] == '\0') return std::string();
+  const std::string folders[] = {std::string(home) + "/Library/Caches/WebPShop",
+                                 std::string(home) +
+                                     "/Library/Caches/WebPShop/EncodeCache"};
+  for (const std::string& folder : folders) mkdir(folder.c_str(), 0755);
+  struct stat info;
+  if (stat(folders[1].c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) {
+    return std::string();
+  }
+  return folders[1] + kPathSeparator;
+#else
+  const wchar_t* const local_app_data = _wgetenv(L"LOCALAPPDATA");
+  if (local_app_data == nullptr || local_app_data[0] == L'\0') {
+    return std::string();
+  }
+  const std::wstring folders[] = {
+      std::wstring(local_app_data) + L"\\WebPShop",
+      std::wstring(local_app_data) + L"\\WebPShop\\EncodeCache"};
+  for (const std::wstring& folder : folders) _wmkdir(folder.c_str());
+  struct _stat64 info;
+  if (_wstat64(folders[1].c_str(), &info) != 0 || !(info.st_mode & _S_IFDIR)) {
+    return std::string();
+  }
+  const std::string folder = ToUtf8Path(folders[1]);
+  if (folder.empty()) return std::string();
+  return folder + kPathSeparator;
+#endif
+}
+
+struct CacheFile {
+  std::string name;
+  uint64_t size;
+  int64_t last_use;  // Modification time, refreshed on each hit.
+};
+
+static std::vector<CacheFile> ListCacheFiles(const std::string& folder) {
+  std::vector<CacheFile> files;
+#ifdef __PIMac__
+  DIR* const dir = opendir(folder.c_str());
+  if (dir == nullptr) return files;
+  while (const struct dirent* const entry = readdir(dir)) {
+    struct stat info;
+    if (stat((folder + entry->d_name).c_str(), &info) == 0 &&
+        S_ISREG(info.st_mode)) {
+      files.push_back(
+          {entry->d_name, (uint64_t)info.st_size, (int64_t)info.st_mtime});
+    }
+  }
+  closedir(dir);
+#else
+  struct _wfinddata64_t info;
+  const intptr_t handle =
+      _wfindfirst64(ToWidePath(folder + "*").c_str(), &info);
+  if (handle == -1) return files;
+  do {
+    if (!(info.attrib & _A_SUBDIR)) {
+      files.push_back({ToUtf8Path(info.name), (uint64_t)info.size,
+                       (int64_t)info.time_write});
+    }
+  } while (_wfindnext64(handle, &info) == 0);
+  _findclose(handle);
+#endif
+  return files;
+}
+
+static void MarkAsUsed(const std::string& path) {
+#ifdef __PIMac__
+  utime(path.c_str(), nullptr);
+#else
+  _wutime(ToWidePath(path).c_str(), nullptr);
+#endif
+}
+
+// Deletes the least recently used files until the total fits in max_size.
+// Temporary files of concurrent or crashed writers are counted too: the
+// latter end up deleted, the former are recent enough to be kept.
+static void EvictCacheFiles(const std::string& folder, uint64_t max_size) {
+  std::vector<CacheFile> files = ListCacheFiles(folder);
+  uint64_t total_size = 0;
+  for (const CacheFile& file : files) total_size += file.size;
+  if (total_size <= max_size) return;
+
+  std::sort(files.begin(), files.end(),
+            [](const CacheFile& a, const CacheFile& b) {
+              return a.last_use < b.last_use;
+            });
+  size_t num_deleted_files = 0;
+  for (const CacheFile& file : files) {
+    if (total_size <= max_size) break;
+    if (RemoveFile(folder + file.name)) {
+      total_size -= file.size;
+      ++num_deleted_files;
+    }
+  }
+  LOG("Evicted " << num_deleted_files << " cache files, " << total_size
+                 << " bytes left.");
+}
+
+//------------------------------------------------------------------------------
+
+bool LoadFromEncodeCache(const std::string& key, WebPData* const encoded_data) {
+  START_TIMER(LoadFromEncodeCache);
+  const std::string folder = GetCacheFolder();
+  if (folder.empty()) {
+    LOG("/!\\ Encode cache folder is unavailable.");
+    return false;
+  }
+  const std::string path = folder + key + kEntryExtension;
+
+  FILE* const file = OpenFile(path, /*for_writing=*/false);
+  if (file == nullptr) {
+    LOG("Encode cache miss for " << key << ".");
+    return false;
+  }
+  const long size = (fseek(file, 0, SEEK_END) == 0) ? ftell(file) : -1;
+  if (size < 12 || fseek(file, 0, SEEK_SET) != 0) {
+    LOG("/!\\ Encode cache file " << path << " is truncated.");
+    fclose(file);
+    return false;
+  }
+
+  uint8_t* const bytes = (uint8_t*)WebPMalloc((size_t)size);
+  if (bytes == nullptr) {
+    LOG("/!\\ Unable to allocate " << size << " bytes.");
+    fclose(file);
+    return false;
+  }
+  // Entries only appear once complete, but check anyway: the RIFF size must
+  // match the file size and the header must be valid.
+  uint32_t riff_size = 0;
+  if (fread(bytes, 1, (size_t)size, file) == (size_t)size) {
+    riff_size = (uint32_t)bytes[4] | ((uint32_t)bytes[5] << 8) |
+                ((uint32_t)bytes[6] << 16) | ((uint32_t)bytes[7] << 24);
+  }
+  fclose(file);
+  if ((uint64_t)riff_size + 8 != (uint64_t)size ||
+      !WebPGetInfo(bytes, (size_t)size, nullptr, nullptr)) {
+    LOG("/!\\ Encode cache file " << path << " is corrupted.");
+    WebPFree(bytes);
+    RemoveFile(path);
+    return false;
+  }
+
+  WebPDataClear(encoded_data);
+  encoded_data->bytes = bytes;
+  encoded_data->size = (size_t)size;
+  MarkAsUsed(path);
+  LOG("Encode cache hit for " << key << " (" << size << " bytes).");
+  STOP_TIMER(LoadFromEncodeCache);
+  return true;
+}
+
+void StoreInEncodeCache(const std::string& key, const WebPData& encoded_data,
+                        const WriteConfig& write_config) {
+  START_TIMER(StoreInEncodeCache);
+  const uint64_t max_size = (uint64_t)write_config.encode_cache_size_mb << 20;
+  if (encoded_data.bytes == nullptr || encoded_data.size > max_size) return;
+  const std::string folder = GetCacheFolder();
+  if (folder.empty()) {
+    LOG("/!\\ Encode cache folder is unavailable.");
+    return;
+  }
+
+  // Written to a unique temporary file then renamed, which is atomic on the
+  // same volume: a crash or a concurrent export never exposes a partial entry.
+  std::random_device random_device;
+  std::ostringstream temporary_name;
+  temporary_name << key << '.' << std::hex << random_device()
+                 << std::chrono::steady_clock::now().time_since_epoch().count()
+                 << kTemporaryExtension;
+  const std::string temporary_path = folder + temporary_name.str();
+  const std::string path = folder + key + kEntryExtension;
+
+  FILE* const file = OpenFile(temporary_path, /*for_writing=*/true);
+  bool ok = (file != nullptr);
+  if (ok) {
+    ok = (fwrite(encoded_data.bytes, 1, encoded_data.size, file) ==
+          encoded_data.size);
+    ok &= (fclose(file) == 0);
+  }
+  if (!ok) {
+    LOG("/!\\ Unable to write " << temporary_path << ".");
+    RemoveFile(temporary_path);
+    return;
+  }
+  if (!RenameFile(temporary_path, path)) {
+    // Most likely stored concurrently with the same content.
+    LOG("Unable to rename " << temporary_path << ", discarding it.");
+    RemoveFile(temporary_path);
+  } else {
+    LOG("Stored " << encoded_data.size << " bytes in encode cache as " << key
+                  << ".");
+  }
+
+  EvictCacheFiles(folder, max_size);
+  STOP_TIMER(StoreInEncodeCache);
+}
@@ -0,0 +1,219 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <vector>
+
+#include "WebPShop.h"
+
+//------------------------------------------------------------------------------
+
+// Highest quality slider value mapped to lossy encoding (see SetWebPConfig()).
+// The file size is not monotonic past it.
+static const int kMaxLossyQuality = 97;
+
+// Each probe holds a whole encoder state; limit the memory usage.
+static const int kMaxNumParallelProbes = 4;
+
+// Tells whether the encoded_data of a probe is on the upper side of the
+// searched boundary. Must be monotonic in quality.
+typedef std::function<bool(const WebPData& encoded_data, bool* const is_above)>
+    CheckFunction;
+
+// Closest probes found on each side of the boundary.
+struct QualityBoundary {
+  int below_quality = -1;  // Highest quality known to be below.
+  WebPData below_data = {nullptr, 0};
+  int above_quality = kMaxLossyQuality + 1;  // Lowest quality known above.
+  WebPData above_data = {nullptr, 0};
+  int num_encodings = 0;
+
+  ~QualityBoundary() {
+    WebPDataClear(&below_data);
+    WebPDataClear(&above_data);
+  }
+};
+
+// Narrows down the boundary with up to kMaxNumParallelProbes qualities
+// encoded concurrently and evenly spread in the unknown range each round.
+// It takes at most ceil(log(99) / log(num_probes + 1)) rounds, so 7 encodings
+// with a single thread or 12 encodings in 3 rounds with 4 threads.
+static bool SearchQualityBoundary(const WriteConfig& write_config,
+                                  const EncodeFunction& encode,
+                                  const CheckFunction& check,
+                                  Progress* const progress,
+                                  QualityBoundary* const boundary) {
+  const int num_probes =
+      std::min(GetNumWorkerThreads(), kMaxNumParallelProbes);
+
+  bool success = true;
+  while (success && boundary->above_quality - boundary->below_quality > 1) {
+    std::vector<int> qualities;
+    const int range = boundary->above_quality - boundary->below_quality;
+    for (int i = 1; i <= num_probes; ++i) {
+      const int quality =
+          boundary->below_quality + (range * i) / (num_probes + 1);
+      if (quality > boundary->below_quality &&
+          quality < boundary->above_quality &&
+          (qualities.empty() || quality != qualities.back())) {
+        qualities.push_back(quality);
+      }
+    }
+    if (qualities.empty()) qualities.push_back(boundary->below_quality + 1);
+
+    std::vector<WebPData> probes(qualities.size());
+    std::vector<char> is_above(qualities.size(), 0);
+    for (WebPData& probe : probes) WebPDataInit(&probe);
+    success = RunInParallel(
+        qualities.size(), num_probes,
+        [&](size_t i) {
+          WriteConfig probe_config = write_config;
+          probe_config.target_size = 0;
+          probe_config.target_metric = DistortionMetric::NO_METRIC;
+          probe_config.race_lossless = false;  // Would break the monotonicity.
+          probe_config.auto_preset = false;
+          probe_config.quality = qualities[i];
+          bool above;
+          if (!encode(probe_config, &probes[i]) || !check(probes[i], &above)) {
+            return false;
+          }
+          is_above[i] = above ? 1 : 0;
+          return true;
+        },
+        progress);
+    boundary->num_encodings += (int)qualities.size();
+
+    for (size_t i = 0; success && i < qualities.size(); ++i) {
+      if (!is_above[i] && qualities[i] > boundary->below_quality) {
+        boundary->below_quality = qualities[i];
+        WebPDataClear(&boundary->below_data);
+        boundary->below_data = probes[i];
+        WebPDataInit(&probes[i]);  // Ownership was transferred.
+      } else if (is_above[i] && qualities[i] < boundary->above_quality) {
+        boundary->above_quality = qualities[i];
+        WebPDataClear(&boundary->above_data);
+        boundary->above_data = probes[i];
+        WebPDataInit(&probes[i]);
+      }
+    }
+    for (WebPData& probe : probes) WebPDataClear(&probe);
+  }
+  return success;
+}
+
+// Moves 'src' into 'dst'.
+static void TransferWebPData(WebPData* const src, WebPData* const dst) {
+  WebPDataClear(dst);
+  *dst = *src;
+  WebPDataInit(src);
+}
+
+//------------------------------------------------------------------------------
+
+bool EncodeToTargetSize(const WriteConfig& write_config,
+                        const EncodeFunction& encode, Progress* const progress,
+                        WebPData* const encoded_data) {
+  START_TIMER(EncodeToTargetSize);
+
+  if (write_config.target_size <= 0 || encoded_data == nullptr) {
+    LOG("/!\\ Bad target size or output.");
+    return false;
+  }
+  const size_t target_size = (size_t)write_config.target_size;
+
+  // The file size is assumed to grow with the quality.
+  QualityBoundary boundary;
+  if (!SearchQualityBoundary(
+          write_config, encode,
+          [target_size](const WebPData& probe_data, bool* const is_too_big) {
+            LOG(probe_data.size << " / " << target_size << " bytes");
+            *is_too_big = (probe_data.size > target_size);
+            return true;
+          },
+          progress, &boundary)) {
+    return false;
+  }
+
+  if (boundary.below_data.bytes != nullptr) {
+    LOG("Quality " << boundary.below_quality << " fits in " << target_size
+                   << " bytes (" << boundary.num_encodings << " encodings).");
+    TransferWebPData(&boundary.below_data, encoded_data);
+  } else {
+    LOG("/!\\ Even quality 0 (" << boundary.above_data.size
+                                << " bytes) exceeds " << target_size
+                                << " bytes.");
+    TransferWebPData(&boundary.above_data, encoded_data);
+  }
+
+  STOP_TIMER(EncodeToTargetSize);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool EncodeToTargetDistortion(const WriteConfig& write_config,
+                              const EncodeFunction& encode,
+                              const MeasureFunction& measure,
+                              Progress* const progress,
+                              WebPData* const encoded_data) {
+  START_TIMER(EncodeToTargetDistortion);
+
+  if (write_config.target_metric == DistortionMetric::NO_METRIC ||
+      encoded_data == nullptr) {
+    LOG("/!\\ Bad target metric or output.");
+    return false;
+  }
+  const DistortionMetric metric = write_config.target_metric;
+  const double target_distortion = write_config.target_distortion;
+
+  // The fidelity is assumed to grow with the quality.
+  QualityBoundary boundary;
+  if (!SearchQualityBoundary(
+          write_config, encode,
+          [&](const WebPData& probe_data, bool* const is_good_enough) {
+            double distortion;
+            if (!measure(probe_data, metric, &distortion)) return false;
+            LOG(probe_data.size << " bytes, "
+                                << GetDistortionMetricName(metric) << " "
+                                << distortion);
+            *is_good_enough = (distortion >= target_distortion);
+            return true;
+          },
+          progress, &boundary)) {
+    return false;
+  }
+
+  if (boundary.above_data.bytes != nullptr) {
+    LOG("Quality " << boundary.above_quality << " reaches "
+                   << GetDistortionMetricName(metric) << " "
+                   << target_distortion << " in " << boundary.above_data.size
+                   << " bytes ("
+                   << boundary.num_encodings << " encodings).");
+    TransferWebPData(&boundary.above_data, encoded_data);
+  } else {
+    // Lossy encoding is not enough. Lossless is, except for metric values that
+    // cannot be reached at all, which is also the best that can be done.
+    LOG("/!\\ " << GetDistortionMetricName(metric) << " " << target_distortion
+                << " is not reached with lossy encoding, using lossless.");
+    WriteConfig lossless_config = write_config;
+    lossless_config.target_size = 0;
+    lossless_config.target_metric = DistortionMetric::NO_METRIC;
+    lossless_config.quality = 100;
+    lossless_config.auto_preset = false;
+    if (!encode(lossless_config, encoded_data)) return false;
+  }
+
+  STOP_TIMER(EncodeToTargetDistortion);
+  return true;
+}
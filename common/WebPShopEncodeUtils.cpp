@@ -12,13 +12,17 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstring>
+#include <limits>
 
 #include "FileUtilities.h"
 #include "PIProperties.h"
 #include "WebPShop.h"
 #include "webp/encode.h"
-#include "webp/mux.h"
 
 void SetWebPConfig(WebPConfig* const config, const WriteConfig& write_config) {
   if (write_config.quality < 0 || write_config.quality > 100) {
@@ -57,6 +61,19 @@ void SetWebPConfig(WebPConfig* const config, const WriteConfig& write_config) {
   // Low alpha qualities are terrible on gradients: limit to acceptable range.
   config->alpha_quality = 50 + write_config.quality / 2;
   if (config->alpha_quality > 100) config->alpha_quality = 100;
+
+  // Settings left out on purpose: 'segments' is already at its maximum (4),
+  // 'partitions' only helps incremental decoding at the cost of size, and
+  // 'pass' is only used by libwebp's own size and PSNR targets, which are
+  // searched by this plug-in instead.
+  if (write_config.profile == EncoderProfile::MULTITHREADED) {
+    config->thread_level = 1;
+  } else if (write_config.profile == EncoderProfile::LOW_MEMORY) {
+    config->low_memory = 1;
+    config->thread_level = 0;
+  } else if (write_config.profile == EncoderProfile::SMALL_ALPHA) {
+    config->alpha_filtering = 2;
+  }
 }
 
 bool CastToWebPPicture(const WebPConfig& config, const ImageMemoryDesc& src,
@@ -64,15 +81,30 @@ bool CastToWebPPicture(const WebPConfig& config, const ImageMemoryDesc& src,
   WebPPictureFree(dst);
 
   if (src.pixels.data == nullptr || src.width < 1 || src.height < 1 ||
-      src.num_channels != 4 || src.pixels.depth != 8) {
+      (src.num_channels != 3 && src.num_channels != 4) ||
+      src.pixels.depth != 8) {
     LOG("/!\\ Unsupported ImageMemoryDesc layout.");
     return false;
   }
 
-  dst->use_argb = 1;
   dst->width = src.width;
   dst->height = src.height;
 
+  if (src.num_channels == 3) {
+    // libwebp converts opaque samples straight to YUV for lossy encoding,
+    // without any ARGB buffer. Sharp YUV needs ARGB though.
+    dst->use_argb = (config.lossless || config.use_sharp_yuv) ? 1 : 0;
+    if (!WebPPictureImportBGR(dst,
+                              reinterpret_cast<const uint8_t*>(src.pixels.data),
+                              (int)(src.pixels.rowBits / 8))) {
+      LOG("/!\\ WebPPictureImportBGR() failed.");
+      return false;
+    }
+    return true;
+  }
+
+  dst->use_argb = 1;
+
   // The data can be mapped to a WebPPicture without allocation.
   assert(!config.show_compressed);  // 'dst->argb[]' will not be altered.
   dst->argb = const_cast<uint32_t*>(
@@ -81,10 +113,248 @@ bool CastToWebPPicture(const WebPConfig& config, const ImageMemoryDesc& src,
   return true;
 }
 
-bool EncodeOneImage(const ImageMemoryDesc& original_image,
-                    const WriteConfig& write_config,
-                    WebPData* const encoded_data) {
-  START_TIMER(EncodeOneImage);
+//------------------------------------------------------------------------------
+
+// Each band converted to YUVA has at least this many rows. It is even so that
+// the chroma rows of a band only depend on the rows of this band.
+static const int32 kMinConversionBandHeight = 64;
+
+// Returns the number of bands the conversion of 'image' to YUVA should be
+// split into, 1 meaning that it is left to WebPEncode().
+static int GetNumConversionBands(const WebPConfig& config,
+                                 const ImageMemoryDesc& image) {
+  // Sharp YUV refines the whole image iteratively and dithering draws from a
+  // single random sequence, so neither can be split without changing the
+  // output.
+  if (config.lossless || config.use_sharp_yuv ||
+      (config.preprocessing & 6) != 0) {
+    return 1;
+  }
+  const int32 max_num_bands =
+      (image.height + kMinConversionBandHeight - 1) / kMinConversionBandHeight;
+  return (int)std::min<int32>(GetNumWorkerThreads(), max_num_bands);
+}
+
+static void CopyPlane(const uint8_t* src, int src_stride, uint8_t* dst,
+                      int dst_stride, int width, int height) {
+  for (int y = 0; y < height; ++y, src += src_stride, dst += dst_stride) {
+    std::memcpy(dst, src, (size_t)width);
+  }
+}
+
+bool ImportYUVARows(const ImageMemoryDesc& rows, int32 top,
+                    WebPPicture* const dst) {
+  if (rows.pixels.data == nullptr || rows.pixels.depth != 8 ||
+      (rows.num_channels != 3 && rows.num_channels != 4) ||
+      (top & 1) != 0 || dst->use_argb || dst->y == nullptr ||
+      rows.width != dst->width || top + rows.height > dst->height) {
+    LOG("/!\\ Unsupported rows or picture.");
+    return false;
+  }
+  WebPPicture band;
+  if (!WebPPictureInit(&band)) return false;
+  band.use_argb = 0;
+  band.width = rows.width;
+  band.height = rows.height;
+  const uint8_t* const pixels =
+      reinterpret_cast<const uint8_t*>(rows.pixels.data);
+  const int stride = (int)(rows.pixels.rowBits / 8);
+  if (!(rows.num_channels == 4 ? WebPPictureImportBGRA(&band, pixels, stride)
+                               : WebPPictureImportBGR(&band, pixels, stride))) {
+    LOG("/!\\ Unable to convert rows " << top << " to "
+                                        << top + rows.height << ".");
+    WebPPictureFree(&band);
+    return false;
+  }
+  CopyPlane(band.y, band.y_stride, dst->y + top * dst->y_stride,
+            dst->y_stride, band.width, band.height);
+  const int uv_width = (band.width + 1) >> 1;
+  const int uv_height = (band.height + 1) >> 1;
+  const int uv_top = top >> 1;
+  CopyPlane(band.u, band.uv_stride, dst->u + uv_top * dst->uv_stride,
+            dst->uv_stride, uv_width, uv_height);
+  CopyPlane(band.v, band.uv_stride, dst->v + uv_top * dst->uv_stride,
+            dst->uv_stride, uv_width, uv_height);
+  if (dst->a != nullptr) {
+    uint8_t* const a = dst->a + top * dst->a_stride;
+    if (band.a != nullptr) {
+      CopyPlane(band.a, band.a_stride, a, dst->a_stride, band.width,
+                band.height);
+    } else {
+      for (int y = 0; y < band.height; ++y) {
+        std::memset(a + y * dst->a_stride, 255, (size_t)band.width);
+      }
+    }
+  }
+  WebPPictureFree(&band);
+  return true;
+}
+
+// Converts the BGR(A) 'src' into the YUV(A) 'dst', by 'num_bands' bands of
+// rows converted concurrently. libwebp converts each pair of rows on its own
+// so the samples are the same as with a single WebPPictureARGBToYUVA() call.
+static bool ImportYUVAInBands(const ImageMemoryDesc& src, int num_bands,
+                              WebPPicture* const dst) {
+  START_TIMER(ImportYUVAInBands);
+  const int32 band_height =
+      (((src.height + num_bands - 1) / num_bands) + 1) & ~1;
+  num_bands = (int)((src.height + band_height - 1) / band_height);
+  const size_t stride = (size_t)(src.pixels.rowBits / 8);
+  const uint8_t* const pixels =
+      reinterpret_cast<const uint8_t*>(src.pixels.data);
+
+  // libwebp only keeps an alpha plane if some alpha value is not 255.
+  std::vector<uint8_t> band_has_alpha((size_t)num_bands, 0);
+  if (src.num_channels == 4 &&
+      !RunInParallel(
+          (size_t)num_bands, num_bands,
+          [&](size_t band) {
+            const int32 top = (int32)band * band_height;
+            const int32 bottom = std::min(src.height, top + band_height);
+            for (int32 y = top; y < bottom && !band_has_alpha[band]; ++y) {
+              const uint8_t* const row = pixels + y * stride;
+              for (int32 x = 0; x < src.width; ++x) {
+                if (row[4 * x + 3] != 255) {
+                  band_has_alpha[band] = 1;
+                  break;
+                }
+              }
+            }
+            return true;
+          },
+          /*progress=*/nullptr)) {
+    return false;
+  }
+  const bool has_alpha =
+      std::find(band_has_alpha.begin(), band_has_alpha.end(), 1) !=
+      band_has_alpha.end();
+
+  WebPPictureFree(dst);
+  dst->use_argb = 0;
+  dst->colorspace = has_alpha ? WEBP_YUV420A : WEBP_YUV420;
+  dst->width = src.width;
+  dst->height = src.height;
+  if (!WebPPictureAlloc(dst)) {
+    LOG("/!\\ WebPPictureAlloc() failed.");
+    return false;
+  }
+
+  const bool success = RunInParallel(
+      (size_t)num_bands, num_bands,
+      [&](size_t band_index) {
+        const int32 top = (int32)band_index * band_height;
+        ImageMemoryDesc rows = src;  // Not owned.
+        rows.pixels.data = const_cast<uint8_t*>(pixels + top * stride);
+        rows.height = std::min(band_height, src.height - top);
+        return ImportYUVARows(rows, top, dst);
+      },
+      /*progress=*/nullptr);
+  if (!success) {
+    WebPPictureFree(dst);
+    return false;
+  }
+  LOG("Converted to YUVA in " << num_bands << " bands.");
+  STOP_TIMER(ImportYUVAInBands);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+// Watches an encoding through its writer and progress hook.
+struct EncodeMonitor {
+  WebPMemoryWriter memory_writer;
+  RIFFWriter* file_writer = nullptr;  // Output goes there instead, if any.
+  // Smallest output of a concurrent encoding of the same image, if any.
+  std::atomic<size_t>* best_size = nullptr;
+  bool lost_race = false;  // The output was dropped.
+  // Time after which the encoding is restarted with the fastest method.
+  bool has_deadline = false;
+  std::chrono::steady_clock::time_point deadline;
+  bool missed_deadline = false;
+  Progress* progress = nullptr;  // Advanced by each percent, if any.
+  int last_percent = 0;
+};
+
+static bool IsLosingRace(const EncodeMonitor& monitor, size_t data_size) {
+  return monitor.best_size != nullptr &&
+         monitor.memory_writer.size + data_size > *monitor.best_size;
+}
+
+// Drops the output if it is bigger than a finished concurrent encoding.
+// libwebp only writes once the whole image is encoded, so this saves the copy
+// of the bitstream but not the encoding time.
+static int MonitoredWrite(const uint8_t* data, size_t data_size,
+                          const WebPPicture* picture) {
+  EncodeMonitor& monitor = *(EncodeMonitor*)picture->user_data;
+  if (IsLosingRace(monitor, data_size)) {
+    monitor.lost_race = true;
+    return 0;
+  }
+  if (monitor.file_writer != nullptr) {
+    return RIFFWriterAppend(monitor.file_writer, data, data_size) ? 1 : 0;
+  }
+  return WebPMemoryWrite(data, data_size, picture);
+}
+
+static int MonitoredProgress(int percent, const WebPPicture* picture) {
+  EncodeMonitor* const monitor = (EncodeMonitor*)picture->user_data;
+  if (percent > monitor->last_percent) {
+    if (!ProgressAdvance(monitor->progress,
+                         (uint64_t)(percent - monitor->last_percent))) {
+      return 0;  // Cancelled.
+    }
+    monitor->last_percent = percent;
+  } else if (!ProgressPoll(monitor->progress)) {
+    return 0;
+  }
+  // Let almost finished encodings complete rather than starting over.
+  if (monitor->has_deadline && percent < 90 &&
+      std::chrono::steady_clock::now() > monitor->deadline) {
+    monitor->missed_deadline = true;
+    return 0;
+  }
+  return 1;
+}
+
+// Wraps original_image into pic. Makes a copy if 'private_copy'.
+// The conversion to YUVA that WebPEncode() would do on a single thread for
+// lossy encoding is done here by bands of rows instead, when possible.
+static bool PreparePicture(const WebPConfig& config,
+                           const ImageMemoryDesc& original_image,
+                           bool private_copy, WebPPicture* const pic) {
+  const int num_bands = GetNumConversionBands(config, original_image);
+  if (num_bands > 1) {
+    // Nothing is shared with original_image so it is always a private copy.
+    return ImportYUVAInBands(original_image, num_bands, pic);
+  }
+  if (!CastToWebPPicture(config, original_image, pic)) {
+    WebPPictureFree(pic);
+    return false;
+  }
+  if (private_copy) {
+    WebPPicture view = *pic;
+    WebPPictureInit(pic);
+    if (!WebPPictureCopy(&view, pic)) {
+      LOG("/!\\ WebPPictureCopy() failed.");
+      WebPPictureFree(pic);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Encodes original_image into encoded_data, or into 'file_writer' if not null.
+// If 'best_size' is not null, the output is dropped if it is bigger, in which
+// case true is returned with empty encoded_data.
+// Each encoding counts as 100 units of 'progress'.
+static bool EncodeImage(const ImageMemoryDesc& original_image,
+                        const WriteConfig& write_config,
+                        std::atomic<size_t>* const best_size,
+                        RIFFWriter* const file_writer, Progress* const progress,
+                        WebPData* const encoded_data) {
+  START_TIMER(EncodeImage);
+  const std::chrono::steady_clock::time_point begin =
+      std::chrono::steady_clock::now();
 
   WebPConfig config;
   if (!WebPConfigInit(&config)) {
@@ -92,6 +362,12 @@ bool EncodeOneImage(const ImageMemoryDesc& original_image,
     return false;
   }
   SetWebPConfig(&config, write_config);
+  if (write_config.time_budget_ms > 0 &&
+      !SetWebPConfigForTimeBudget(
+          original_image, (double)original_image.width * original_image.height,
+          write_config.time_budget_ms, &config)) {
+    return false;
+  }
 
   WebPPicture pic;
   if (!WebPPictureInit(&pic)) {
@@ -99,34 +375,449 @@ bool EncodeOneImage(const ImageMemoryDesc& original_image,
     return false;
   }
 
-  if (!CastToWebPPicture(config, original_image, &pic)) {
-    WebPPictureFree(&pic);
+  // Lossless encoding alters the invisible pixels of the input, which is
+  // concurrently read by a racing lossy encoding. Work on a private copy.
+  const bool private_copy = (best_size != nullptr && config.lossless);
+  if (!PreparePicture(config, original_image, private_copy, &pic)) {
     return false;
   }
 
   START_TIMER(WebPEncode);
-  WebPMemoryWriter memory_writer;
-  WebPMemoryWriterInit(&memory_writer);
-  pic.writer = WebPMemoryWrite;
-  pic.custom_ptr = &memory_writer;
-  if (!WebPEncode(&config, &pic)) {
-    LOG("/!\\ WebPEncode failed (" << pic.error_code << ").");
+  EncodeMonitor monitor;
+  monitor.best_size = best_size;
+  monitor.file_writer = file_writer;
+  // Nothing can be written to the file before a restart.
+  monitor.has_deadline = (write_config.time_budget_ms > 0 && !file_writer);
+  monitor.deadline =
+      begin + std::chrono::milliseconds(write_config.time_budget_ms);
+  monitor.progress = progress;
+  ProgressAddWork(progress, 100);
+  WebPMemoryWriterInit(&monitor.memory_writer);
+  pic.writer = MonitoredWrite;
+  pic.custom_ptr = &monitor.memory_writer;
+  pic.progress_hook = MonitoredProgress;
+  pic.user_data = &monitor;
+  bool encoded = WebPEncode(&config, &pic);
+  if (!encoded && monitor.missed_deadline) {
+    LOG("Method " << config.method << " exceeded the time budget of "
+                  << write_config.time_budget_ms
+                  << " ms, restarting with method 0.");
+    WebPMemoryWriterClear(&monitor.memory_writer);
+    WebPMemoryWriterInit(&monitor.memory_writer);
+    monitor.has_deadline = false;
+    ProgressAddWork(progress, 100);  // The first try does not count.
+    ProgressAdvance(progress, (uint64_t)(100 - monitor.last_percent));
+    monitor.last_percent = 0;
+    config.method = 0;
+    config.use_sharp_yuv = 0;
+    // Start from the original pixels again.
+    WebPPictureFree(&pic);
+    if (!PreparePicture(config, original_image, private_copy, &pic)) {
+      WebPMemoryWriterClear(&monitor.memory_writer);
+      return false;
+    }
+    pic.writer = MonitoredWrite;
+    pic.custom_ptr = &monitor.memory_writer;
+    pic.progress_hook = MonitoredProgress;
+    pic.user_data = &monitor;
+    encoded = WebPEncode(&config, &pic);
+  }
+  if (!encoded) {
+    const WebPEncodingError error_code = pic.error_code;
+    (void)error_code;  // Only used by LOG().
+    WebPMemoryWriterClear(&monitor.memory_writer);
     WebPPictureFree(&pic);
+    if (ProgressIsCanceled(progress)) {
+      LOG("Cancelled " << (config.lossless ? "lossless" : "lossy")
+                       << " encoding.");
+      return false;
+    }
+    if (monitor.lost_race) {
+      LOG("Dropped bigger " << (config.lossless ? "lossless" : "lossy")
+                            << " encoding.");
+      ProgressAdvance(progress, (uint64_t)(100 - monitor.last_percent));
+      WebPDataClear(encoded_data);
+      return true;
+    }
+    LOG("/!\\ WebPEncode failed (" << error_code << ").");
     return false;
   }
   STOP_TIMER(WebPEncode);
+  ProgressAdvance(progress, (uint64_t)(100 - monitor.last_percent));
 
   WebPPictureFree(&pic);
+  if (file_writer != nullptr) {
+    WebPMemoryWriterClear(&monitor.memory_writer);  // Unused.
+    STOP_TIMER(EncodeImage);
+    return RIFFWriterFinish(file_writer);
+  }
   WebPDataClear(encoded_data);
-  encoded_data->bytes = memory_writer.mem;
-  encoded_data->size = memory_writer.size;
+  encoded_data->bytes = monitor.memory_writer.mem;
+  encoded_data->size = monitor.memory_writer.size;
   // Do not clear memory_writer's data.
   LOG("Encoded " << encoded_data->size << " bytes.");
 
-  STOP_TIMER(EncodeOneImage);
+  STOP_TIMER(EncodeImage);
   return true;
 }
 
+// Encodes original_image both lossily and losslessly at the same time and
+// keeps the smaller one. Lossless is never worse so the quality is preserved.
+// Both encodings run to the end: libwebp does not tell the size of the output
+// before writing it, so the bigger one cannot be stopped earlier. Its output
+// is dropped instead of being copied.
+static bool EncodeLossyOrLossless(const ImageMemoryDesc& original_image,
+                                  const WriteConfig& write_config,
+                                  Progress* const progress,
+                                  WebPData* const encoded_data) {
+  START_TIMER(EncodeLossyOrLossless);
+
+  WriteConfig configs[2] = {write_config, write_config};
+  configs[0].race_lossless = configs[1].race_lossless = false;
+  configs[1].quality = 100;  // Lossless.
+
+  std::atomic<size_t> best_size(std::numeric_limits<size_t>::max());
+  WebPData results[2];
+  WebPDataInit(&results[0]);
+  WebPDataInit(&results[1]);
+  const bool success = RunInParallel(
+      2, 2,
+      [&](size_t i) {
+        if (!EncodeImage(original_image, configs[i], &best_size,
+                         /*file_writer=*/nullptr, progress, &results[i])) {
+          return false;
+        }
+        if (results[i].bytes != nullptr) {
+          size_t size = best_size;
+          while (results[i].size < size &&
+                 !best_size.compare_exchange_weak(size, results[i].size)) {
+          }
+        }
+        return true;
+      },
+      progress);
+
+  // Ties go to lossless.
+  const int winner =
+      (results[1].bytes != nullptr &&
+       (results[0].bytes == nullptr || results[1].size <= results[0].size))
+          ? 1
+          : 0;
+  if (success && results[winner].bytes != nullptr) {
+    LOG("Kept " << (winner == 1 ? "lossless" : "lossy") << " encoding ("
+                << results[winner].size << " bytes).");
+    WebPDataClear(encoded_data);
+    *encoded_data = results[winner];
+    WebPDataInit(&results[winner]);
+  }
+  WebPDataClear(&results[0]);
+  WebPDataClear(&results[1]);
+
+  STOP_TIMER(EncodeLossyOrLossless);
+  return success && encoded_data->bytes != nullptr;
+}
+
+bool EncodeOneImage(const ImageMemoryDesc& original_image,
+                    const WriteConfig& write_config, Progress* const progress,
+                    WebPData* const encoded_data) {
+  if (write_config.target_size > 0) {
+    return EncodeToTargetSize(
+        write_config,
+        [&original_image, progress](const WriteConfig& probe_config,
+                                    WebPData* const probe_data) {
+          return EncodeOneImage(original_image, probe_config, progress,
+                                probe_data);
+        },
+        progress, encoded_data);
+  }
+  if (write_config.target_metric != DistortionMetric::NO_METRIC) {
+    return EncodeToTargetDistortion(
+        write_config,
+        [&original_image, progress](const WriteConfig& probe_config,
+                                    WebPData* const probe_data) {
+          return EncodeOneImage(original_image, probe_config, progress,
+                                probe_data);
+        },
+        [&original_image](const WebPData& probe_data, DistortionMetric metric,
+                          double* const distortion) {
+          return MeasureOneImage(original_image, probe_data, metric,
+                                 distortion);
+        },
+        progress, encoded_data);
+  }
+
+  if (write_config.auto_preset) {
+    WriteConfig preset_config = write_config;
+    ApplyAutoPreset(original_image, &preset_config);
+    return EncodeOneImage(original_image, preset_config, progress,
+                          encoded_data);
+  }
+
+  if (write_config.race_lossless &&
+      write_config.quality < 98) {  // Otherwise it is already lossless.
+    return EncodeLossyOrLossless(original_image, write_config, progress,
+                                 encoded_data);
+  }
+  return EncodeImage(original_image, write_config, /*best_size=*/nullptr,
+                     /*file_writer=*/nullptr, progress, encoded_data);
+}
+
+//------------------------------------------------------------------------------
+
+// Encodes 'shared_picture' into encoded_data without altering it.
+static bool EncodeRung(const WebPConfig& config,
+                       const WebPPicture& shared_picture,
+                       Progress* const progress, WebPData* const encoded_data) {
+  // WebPEncode() may modify its input (transparent area cleanup, lossless
+  // transforms), so each rung works on its own copy of the shared samples.
+  WebPPicture pic;
+  if (!WebPPictureInit(&pic) || !WebPPictureCopy(&shared_picture, &pic)) {
+    LOG("/!\\ WebPPictureCopy() failed.");
+    return false;
+  }
+  EncodeMonitor monitor;
+  monitor.progress = progress;
+  ProgressAddWork(progress, 100);
+  WebPMemoryWriterInit(&monitor.memory_writer);
+  pic.writer = MonitoredWrite;
+  pic.custom_ptr = &monitor.memory_writer;
+  pic.progress_hook = MonitoredProgress;
+  pic.user_data = &monitor;
+  if (!WebPEncode(&config, &pic)) {
+    LOG("/!\\ WebPEncode failed (" << pic.error_code << ").");
+    WebPMemoryWriterClear(&monitor.memory_writer);
+    WebPPictureFree(&pic);
+    return false;
+  }
+  WebPPictureFree(&pic);
+  ProgressAdvance(progress, (uint64_t)(100 - monitor.last_percent));
+  WebPDataClear(encoded_data);
+  encoded_data->bytes = monitor.memory_writer.mem;
+  encoded_data->size = monitor.memory_writer.size;
+  return true;
+}
+
+bool EncodeQualityLadder(const ImageMemoryDesc& original_image,
+                         const WriteConfig& write_config,
+                         const std::vector<int>& qualities,
+                         Progress* const progress,
+                         std::vector<WebPData>* const encoded_data) {
+  START_TIMER(EncodeQualityLadder);
+  for (WebPData& data : *encoded_data) WebPDataClear(&data);
+  encoded_data->assign(qualities.size(), WebPData());
+  for (WebPData& data : *encoded_data) WebPDataInit(&data);
+
+  std::vector<WebPConfig> configs(qualities.size());
+  bool has_lossy_rung = false;
+  int num_conversion_bands = 1;
+  for (size_t i = 0; i < qualities.size(); ++i) {
+    WriteConfig rung_config = write_config;
+    rung_config.quality = qualities[i];
+    if (!WebPConfigInit(&configs[i])) {
+      LOG("/!\\ WebPConfigInit() failed.");
+      return false;
+    }
+    SetWebPConfig(&configs[i], rung_config);
+    if (!configs[i].lossless) {
+      has_lossy_rung = true;
+      num_conversion_bands = GetNumConversionBands(configs[i], original_image);
+    }
+  }
+
+  // The original pixels are shared by the lossless rungs. BGR images are
+  // imported as ARGB once, lossless being the only setting that ensures it.
+  WebPConfig argb_config = configs[0];
+  argb_config.lossless = 1;
+  WebPPicture argb_picture;
+  if (!WebPPictureInit(&argb_picture) ||
+      !CastToWebPPicture(argb_config, original_image, &argb_picture)) {
+    WebPPictureFree(&argb_picture);
+    return false;
+  }
+
+  // The RGBA to YUVA conversion, including the sharp YUV one which only
+  // depends on the compression effort, is done once for all lossy rungs. So
+  // is the smoothing of fully transparent blocks.
+  WebPPicture yuva_picture;
+  WebPPictureInit(&yuva_picture);
+  if (has_lossy_rung) {
+    START_TIMER(SharedConversion);
+    const bool use_sharp_yuv =
+        (write_config.compression == Compression::SLOWEST);
+    if (num_conversion_bands > 1) {
+      if (!ImportYUVAInBands(original_image, num_conversion_bands,
+                             &yuva_picture)) {
+        WebPPictureFree(&argb_picture);
+        return false;
+      }
+    } else if (!WebPPictureView(&argb_picture, 0, 0, argb_picture.width,
+                                argb_picture.height, &yuva_picture)) {
+      // The ARGB samples are not owned by the view.
+      LOG("/!\\ WebPPictureView() failed.");
+      WebPPictureFree(&argb_picture);
+      return false;
+    } else if (!(use_sharp_yuv
+                     ? WebPPictureSharpARGBToYUVA(&yuva_picture)
+                     : WebPPictureARGBToYUVA(&yuva_picture, WEBP_YUV420))) {
+      LOG("/!\\ RGBA to YUVA conversion failed.");
+      WebPPictureFree(&yuva_picture);
+      WebPPictureFree(&argb_picture);
+      return false;
+    }
+    yuva_picture.use_argb = 0;
+    yuva_picture.argb = nullptr;  // Not needed by the copies.
+    const bool has_transparency = WebPPictureHasTransparency(&yuva_picture);
+    if (has_transparency) WebPCleanupTransparentArea(&yuva_picture);
+    LOG("Converted to YUVA once for the lossy rungs ("
+        << (use_sharp_yuv ? "sharp" : "fast") << ", "
+        << (has_transparency ? "with" : "without") << " transparency).");
+    STOP_TIMER(SharedConversion);
+  }
+
+  std::vector<std::chrono::steady_clock::duration> durations(
+      qualities.size());
+  const bool success = RunInParallel(
+      qualities.size(), GetNumWorkerThreads(),
+      [&](size_t i) {
+        const std::chrono::steady_clock::time_point begin =
+            std::chrono::steady_clock::now();
+        const bool encoded = EncodeRung(
+            configs[i], configs[i].lossless ? argb_picture : yuva_picture,
+            progress, &(*encoded_data)[i]);
+        durations[i] = std::chrono::steady_clock::now() - begin;
+        return encoded;
+      },
+      progress);
+  WebPPictureFree(&yuva_picture);
+  WebPPictureFree(&argb_picture);
+
+  if (!success) {
+    for (WebPData& data : *encoded_data) WebPDataClear(&data);
+    return false;
+  }
+  for (size_t i = 0; i < qualities.size(); ++i) {
+    LOG("Quality " << qualities[i] << ": " << (*encoded_data)[i].size
+                   << " bytes in "
+                   << std::chrono::duration_cast<std::chrono::milliseconds>(
+                          durations[i])
+                          .count()
+                   << " ms.");
+  }
+  STOP_TIMER(EncodeQualityLadder);
+  return true;
+}
+
+void EncodeOneImageToFile(const ImageMemoryDesc& original_image,
+                          const WriteConfig& write_config,
+                          const Metadata metadata[Metadata::kNum],
+                          FormatRecordPtr format_record,
+                          Progress* const progress, int16* const result) {
+  if (*result != noErr) return;
+
+  if (write_config.auto_preset && write_config.target_size <= 0 &&
+      write_config.target_metric == DistortionMetric::NO_METRIC) {
+    WriteConfig preset_config = write_config;
+    ApplyAutoPreset(original_image, &preset_config);
+    EncodeOneImageToFile(original_image, preset_config, metadata,
+                         format_record, progress, result);
+    return;
+  }
+
+  if (write_config.target_size > 0 ||
+      write_config.target_metric != DistortionMetric::NO_METRIC ||
+      write_config.race_lossless || write_config.time_budget_ms > 0) {
+    // These modes encode several times or on other threads, where the host
+    // file cannot be written. Go through memory.
+    WebPData encoded_data = {nullptr, 0};
+    if (!EncodeOneImage(original_image, write_config, progress,
+                        &encoded_data) ||
+        encoded_data.bytes == nullptr || encoded_data.size == 0) {
+      *result = ProgressIsCanceled(progress) ? userCanceledErr : writErr;
+    } else {
+      WriteToFile(encoded_data, write_config, metadata, format_record, result);
+    }
+    WebPDataClear(&encoded_data);
+    return;
+  }
+
+  RIFFWriter file_writer;
+  RIFFWriterInitForHostFile(write_config, metadata, format_record, result,
+                            &file_writer);
+  if (*result == noErr &&
+      !EncodeImage(original_image, write_config, /*best_size=*/nullptr,
+                   &file_writer, progress, /*encoded_data=*/nullptr) &&
+      *result == noErr) {
+    *result = ProgressIsCanceled(progress) ? userCanceledErr : writErr;
+  }
+}
+
+bool CanStreamWholeCanvas(const WriteConfig& write_config) {
+  return !write_config.animation && write_config.target_size <= 0 &&
+         write_config.target_metric == DistortionMetric::NO_METRIC &&
+         !write_config.race_lossless && write_config.time_budget_ms <= 0 &&
+         !write_config.auto_preset && write_config.encode_cache_size_mb <= 0 &&
+         write_config.num_downscaled_copies <= 0 &&
+         write_config.thumbnail_size <= 0 &&
+         write_config.num_quality_rungs <= 0;
+}
+
+void EncodeWholeCanvasToFile(FormatRecordPtr format_record, Data* const data,
+                             Progress* const progress, int16* const result) {
+  if (*result != noErr) return;
+  START_TIMER(EncodeWholeCanvasToFile);
+
+  WebPConfig config;
+  WebPPicture pic;
+  if (!WebPConfigInit(&config) || !WebPPictureInit(&pic)) {
+    LOG("/!\\ WebPConfigInit() or WebPPictureInit() failed.");
+    *result = writErr;
+    return;
+  }
+  SetWebPConfig(&config, data->write_config);
+
+  // Lossless encoding needs ARGB samples anyway. So does sharp YUV, which
+  // refines the whole image at once: streamed YUVA bands would skip it.
+  const bool use_argb = (config.lossless || config.use_sharp_yuv);
+  if (!config.lossless && use_argb) LOG("Streaming ARGB for sharp YUV.");
+  StreamWholeCanvas(format_record, data, use_argb, progress, result, &pic);
+  if (*result != noErr) return;
+
+  RIFFWriter file_writer;
+  RIFFWriterInitForHostFile(data->write_config, data->metadata, format_record,
+                            result, &file_writer);
+  if (*result != noErr) {
+    WebPPictureFree(&pic);
+    return;
+  }
+  EncodeMonitor monitor;
+  monitor.file_writer = &file_writer;
+  monitor.progress = progress;
+  ProgressAddWork(progress, 100);
+  WebPMemoryWriterInit(&monitor.memory_writer);  // Unused.
+  pic.writer = MonitoredWrite;
+  pic.custom_ptr = &monitor.memory_writer;
+  pic.progress_hook = MonitoredProgress;
+  pic.user_data = &monitor;
+  const bool encoded = WebPEncode(&config, &pic);
+  const WebPEncodingError error_code = pic.error_code;
+  (void)error_code;  // Only used by LOG().
+  WebPMemoryWriterClear(&monitor.memory_writer);
+  WebPPictureFree(&pic);
+  if (!encoded) {
+    if (ProgressIsCanceled(progress)) {
+      *result = userCanceledErr;
+    } else {
+      LOG("/!\\ WebPEncode failed (" << error_code << ").");
+      if (*result == noErr) *result = writErr;
+    }
+    return;
+  }
+  ProgressAdvance(progress, (uint64_t)(100 - monitor.last_percent));
+  if (!RIFFWriterFinish(&file_writer) && *result == noErr) *result = writErr;
+
+  STOP_TIMER(EncodeWholeCanvasToFile);
+}
+
 static OSErr GetHostProperty(PIType key, Metadata* const metadata) {
   OSErr result = noErr;
 
@@ -220,86 +911,3 @@ OSErr GetHostMetadata(FormatRecordPtr format_record,
 
   return noErr;
 }
-
-bool EncodeMetadata(const WriteConfig& write_config,
-                    const Metadata metadata[Metadata::kNum],
-                    WebPData* const encoded_data) {
-  bool success = true;
-  WebPMux* mux = nullptr;  // Only create mux instance when needed.
-  const bool keep[Metadata::kNum] = {write_config.keep_exif,
-                                     write_config.keep_xmp,
-                                     write_config.keep_color_profile};
-
-  for (int i = 0; i < Metadata::kNum; ++i) {
-    if (metadata[i].chunk.size > 0 && metadata[i].chunk.bytes != nullptr &&
-        keep[i]) {
-      if (mux == nullptr) {
-        // Copy data into mux object as it will be overwritten.
-        mux = WebPMuxCreate(encoded_data, /*copy_data=*/1);
-        if (mux == nullptr) {
-          LOG("/!\\ WebPMuxCreate failed.");
-          success = false;
-          break;
-        }
-      }
-
-      const WebPMuxError mux_error = WebPMuxSetChunk(
-          mux, metadata[i].four_cc, &metadata[i].chunk, /*copy_data=*/0);
-      if (mux_error != WEBP_MUX_OK) {
-        LOG("/!\\ WebPMuxSetChunk(" << metadata[i].four_cc << ") failed ("
-                                    << mux_error << ").");
-        success = false;
-        break;
-      } else {
-        LOG("Added " << metadata[i].four_cc << " chunk ("
-                     << metadata[i].chunk.size << " bytes).");
-      }
-    }
-  }
-
-  if (mux != nullptr) {
-    if (success) {
-      WebPData mux_data = {nullptr, 0};
-      const WebPMuxError mux_error = WebPMuxAssemble(mux, &mux_data);
-      if (mux_error != WEBP_MUX_OK) {
-        LOG("/!\\ WebPMuxAssemble failed (" << mux_error << ").");
-        success = false;
-        WebPDataClear(&mux_data);
-      } else {
-        // Now the muxed data can safely replace the previous one.
-        WebPDataClear(encoded_data);
-        *encoded_data = mux_data;
-        mux_data.bytes = nullptr;  // Do not free memory.
-        mux_data.size = 0;
-      }
-    }
-    WebPMuxDelete(mux);
-  } else {
-    LOG("No metadata written.");
-  }
-  return success;
-}
-
-void WriteToFile(const WebPData& encoded_data, FormatRecordPtr format_record,
-                 int16* const result) {
-  START_TIMER(WriteToFile);
-
-  if (encoded_data.bytes == nullptr || encoded_data.size == 0) {
-    LOG("/!\\ Source is null.");
-    return;
-  }
-
-  if (*result == noErr) {
-    // Move cursor to the start of the output file.
-    *result = PSSDKSetFPos((int32)format_record->dataFork,
-                           format_record->posixFileDescriptor,
-                           format_record->pluginUsingPOSIXIO, fsFromStart, 0);
-  }
-
-  if (*result == noErr) {
-    LOG("Writing " << encoded_data.size << " bytes.");
-    WriteSome(encoded_data.size, encoded_data.bytes, format_record, result);
-  }
-
-  STOP_TIMER(WriteToFile);
-}
@@ -0,0 +1,376 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __PIMac__
+#include <fcntl.h>
+#include <sys/param.h>
+#else
+#include <io.h>
+#include <windows.h>
+#endif
+
+#include "WebPShop.h"
+
+//------------------------------------------------------------------------------
+// Sibling files
+
+static const char kExtension[] = ".webp";
+
+bool GetHostFileBasePath(FormatRecordPtr format_record,
+                         std::string* const base_path) {
+  std::string path;
+#ifdef __PIMac__
+  if (!format_record->pluginUsingPOSIXIO) {
+    LOG("/!\\ The path of the output file is only known with POSIX I/O.");
+    return false;
+  }
+  char buffer[MAXPATHLEN];
+  if (fcntl(format_record->posixFileDescriptor, F_GETPATH, buffer) == -1) {
+    LOG("/!\\ fcntl(F_GETPATH) failed.");
+    return false;
+  }
+  path = buffer;
+#else
+  const HANDLE handle =
+      format_record->pluginUsingPOSIXIO
+          ? (HANDLE)_get_osfhandle(format_record->posixFileDescriptor)
+          : (HANDLE)format_record->dataFork;
+  const DWORD length = GetFinalPathNameByHandleW(
+      handle, nullptr, 0, FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+  if (length == 0) {
+    LOG("/!\\ GetFinalPathNameByHandleW failed.");
+    return false;
+  }
+  std::vector<wchar_t> wide_path(length);
+  if (GetFinalPathNameByHandleW(handle, wide_path.data(), length,
+                                FILE_NAME_NORMALIZED | VOLUME_NAME_DOS) >=
+      length) {
+    LOG("/!\\ GetFinalPathNameByHandleW failed.");
+    return false;
+  }
+  const int size = WideCharToMultiByte(CP_UTF8, 0, wide_path.data(), -1,
+                                       nullptr, 0, nullptr, nullptr);
+  if (size <= 0) return false;
+  std::vector<char> utf8_path(size);
+  WideCharToMultiByte(CP_UTF8, 0, wide_path.data(), -1, utf8_path.data(), size,
+                      nullptr, nullptr);
+  path = utf8_path.data();
+#endif
+
+  // Remove the extension, if any.
+  const size_t last_separator = path.find_last_of("/\\");
+  const size_t last_dot = path.find_last_of('.');
+  if (last_dot != std::string::npos &&
+      (last_separator == std::string::npos || last_dot > last_separator)) {
+    path.resize(last_dot);
+  }
+  *base_path = path;
+  return true;
+}
+
+#ifndef __PIMac__
+static std::wstring ToWidePath(const std::string& path) {
+  const int length =
+      MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+  if (length <= 0) return std::wstring();
+  std::vector<wchar_t> wide_path(length);
+  MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, wide_path.data(), length);
+  return std::wstring(wide_path.data());
+}
+#endif
+
+// Paths are UTF-8 encoded.
+static FILE* OpenForWriting(const std::string& path) {
+#ifdef __PIMac__
+  return fopen(path.c_str(), "wb");
+#else
+  return _wfopen(ToWidePath(path).c_str(), L"wb");
+#endif
+}
+
+static void RemoveFile(const std::string& path) {
+#ifdef __PIMac__
+  remove(path.c_str());
+#else
+  _wremove(ToWidePath(path).c_str());
+#endif
+}
+
+bool WriteToSiblingFile(const std::string& base_path, const std::string& suffix,
+                        const WebPData& encoded_data,
+                        const WriteConfig& write_config,
+                        const Metadata metadata[Metadata::kNum]) {
+  if (encoded_data.bytes == nullptr || encoded_data.size == 0) {
+    LOG("/!\\ Source is null.");
+    return false;
+  }
+  const std::string path = base_path + suffix + kExtension;
+  FILE* const file = OpenForWriting(path);
+  if (file == nullptr) {
+    LOG("/!\\ Unable to open " << path << ".");
+    return false;
+  }
+
+  RIFFWriter writer;
+  RIFFWriterInit(write_config, metadata,
+                 [file](const uint8_t* data, size_t size) {
+                   return fwrite(data, 1, size, file) == size;
+                 },
+                 &writer);
+  bool success = RIFFWriterAppend(&writer, encoded_data.bytes,
+                                  encoded_data.size) &&
+                 RIFFWriterFinish(&writer);
+  success = (fclose(file) == 0) && success;
+  if (!success) {
+    LOG("/!\\ Unable to write " << path << ".");
+    RemoveFile(path);
+    return false;
+  }
+  LOG("Wrote " << path << ".");
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Downscaled copies
+
+// Returns the dimensions of the copies of an image of the given size, in
+// decreasing order and without duplicates.
+static std::vector<std::pair<int32, int32>> GetDownscaledSizes(
+    int32 width, int32 height, const WriteConfig& write_config) {
+  std::vector<std::pair<int32, int32>> sizes;
+  for (int32 i = 1; i <= write_config.num_downscaled_copies; ++i) {
+    const int32 w = (width + (1 << i) / 2) >> i;
+    const int32 h = (height + (1 << i) / 2) >> i;
+    if (w < 1 || h < 1) break;
+    sizes.emplace_back(w, h);
+  }
+  if (write_config.thumbnail_size > 0) {
+    int32 w = width, h = height;
+    if (ScaleToFit(&w, &h, write_config.thumbnail_size,
+                   write_config.thumbnail_size)) {
+      sizes.emplace_back(w, h);
+    }
+  }
+  std::sort(sizes.begin(), sizes.end(),
+            [](const std::pair<int32, int32>& a,
+               const std::pair<int32, int32>& b) { return a.first > b.first; });
+  sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+  return sizes;
+}
+
+void ExportDownscaledCopies(const ImageMemoryDesc& original_image,
+                            const WriteConfig& write_config,
+                            const Metadata metadata[Metadata::kNum],
+                            FormatRecordPtr format_record,
+                            Progress* const progress, int16* const result) {
+  const std::vector<std::pair<int32, int32>> sizes = GetDownscaledSizes(
+      original_image.width, original_image.height, write_config);
+  if (sizes.empty()) return;
+  START_TIMER(ExportDownscaledCopies);
+
+  std::string base_path;
+  if (!GetHostFileBasePath(format_record, &base_path)) {
+    LOG("/!\\ Skipping " << sizes.size() << " downscaled copies.");
+    return;
+  }
+
+  // A target size in bytes is meant for the full-size image.
+  WriteConfig copy_config = write_config;
+  copy_config.target_size = 0;
+
+  // Each copy is resampled from the shared canvas, encoded and written by a
+  // worker thread. The host is only polled by the calling thread.
+  const bool success = RunInParallel(
+      sizes.size(), GetNumWorkerThreads(),
+      [&](size_t i) {
+        const int32 width = sizes[i].first, height = sizes[i].second;
+        ImageMemoryDesc image;
+        WebPData encoded_data;
+        WebPDataInit(&encoded_data);
+        bool ok = ScaleDown(original_image, &image, (size_t)width,
+                            (size_t)height) &&
+                  EncodeOneImage(image, copy_config, progress, &encoded_data);
+        DeallocateImage(&image);
+        if (ok) {
+          const std::string suffix =
+              "_" + std::to_string(width) + "x" + std::to_string(height);
+          ok = WriteToSiblingFile(base_path, suffix, encoded_data,
+                                  copy_config, metadata);
+        }
+        WebPDataClear(&encoded_data);
+        return ok;
+      },
+      progress);
+  if (!success) {
+    *result = ProgressIsCanceled(progress) ? userCanceledErr : writErr;
+  }
+  LOG("Exported " << sizes.size() << " downscaled copies next to "
+                  << base_path << kExtension << ".");
+  STOP_TIMER(ExportDownscaledCopies);
+}
+
+//------------------------------------------------------------------------------
+// Quality ladder
+
+void ExportQualityLadder(const ImageMemoryDesc& original_image,
+                         const WriteConfig& write_config,
+                         const Metadata metadata[Metadata::kNum],
+                         FormatRecordPtr format_record,
+                         Progress* const progress, int16* const result) {
+  if (write_config.num_quality_rungs <= 0) return;
+  START_TIMER(ExportQualityLadder);
+  const std::vector<int> qualities(
+      write_config.quality_ladder,
+      write_config.quality_ladder + write_config.num_quality_rungs);
+
+  std::string base_path;
+  if (!GetHostFileBasePath(format_record, &base_path)) {
+    LOG("/!\\ Skipping " << qualities.size() << " quality rungs.");
+    return;
+  }
+
+  std::vector<WebPData> encoded_data;
+  if (!EncodeQualityLadder(original_image, write_config, qualities, progress,
+                           &encoded_data)) {
+    *result = ProgressIsCanceled(progress) ? userCanceledErr : writErr;
+    return;
+  }
+  for (size_t i = 0; i < qualities.size(); ++i) {
+    if (*result == noErr &&
+        !WriteToSiblingFile(base_path, "_q" + std::to_string(qualities[i]),
+                            encoded_data[i], write_config, metadata)) {
+      *result = writErr;
+    }
+    WebPDataClear(&encoded_data[i]);
+  }
+  STOP_TIMER(ExportQualityLadder);
+}
+
+//------------------------------------------------------------------------------
+// Layers to files
+
+static const char kForbiddenCharacters[] = "\\/:*?\"<>|";
+
+// Converts a null-terminated UTF-16 layer name to a UTF-8 file name suffix,
+// replacing the characters that are not allowed in file names.
+static std::string LayerNameToSuffix(const uint16* const layer_name) {
+  std::string name;
+  for (size_t i = 0; layer_name != nullptr && layer_name[i] != 0; ++i) {
+    uint32_t code_point = layer_name[i];
+    if (code_point >= 0xD800 && code_point < 0xDC00 &&
+        layer_name[i + 1] >= 0xDC00 && layer_name[i + 1] < 0xE000) {
+      code_point = 0x10000 + ((code_point - 0xD800) << 10) +
+                   (layer_name[i + 1] - 0xDC00);
+      ++i;
+    }
+    if (code_point < 0x20 || code_point == 0x7F ||
+        (code_point >= 0xD800 && code_point < 0xE000) ||
+        (code_point < 0x80 &&
+         strchr(kForbiddenCharacters, (int)code_point) != nullptr)) {
+      name += '_';
+    } else if (code_point < 0x80) {
+      name += (char)code_point;
+    } else if (code_point < 0x800) {
+      name += (char)(0xC0 | (code_point >> 6));
+      name += (char)(0x80 | (code_point & 0x3F));
+    } else if (code_point < 0x10000) {
+      name += (char)(0xE0 | (code_point >> 12));
+      name += (char)(0x80 | ((code_point >> 6) & 0x3F));
+      name += (char)(0x80 | (code_point & 0x3F));
+    } else {
+      name += (char)(0xF0 | (code_point >> 18));
+      name += (char)(0x80 | ((code_point >> 12) & 0x3F));
+      name += (char)(0x80 | ((code_point >> 6) & 0x3F));
+      name += (char)(0x80 | (code_point & 0x3F));
+    }
+  }
+  // Windows ignores trailing dots and spaces.
+  while (!name.empty() && (name.back() == '.' || name.back() == ' ')) {
+    name.pop_back();
+  }
+  return name;
+}
+
+void ExportLayersToFiles(FormatRecordPtr format_record, Data* const data,
+                         Progress* const progress, int16* const result) {
+  if (!data->write_config.layers_to_files) return;
+  START_TIMER(ExportLayersToFiles);
+
+  std::string base_path;
+  if (!GetHostFileBasePath(format_record, &base_path)) {
+    LOG("/!\\ Skipping the export of the layers.");
+    return;
+  }
+  std::vector<const ReadLayerDesc*> layers;
+  if (!GetLayers(format_record, result, &layers)) return;
+
+  // Unique suffixes, decided before any encoding.
+  std::vector<std::string> suffixes(layers.size());
+  for (size_t i = 0; i < layers.size(); ++i) {
+    std::string name = LayerNameToSuffix(layers[i]->unicodeName);
+    if (name.empty()) name = "layer" + std::to_string(i + 1);
+    suffixes[i] = "_" + name;
+    for (int n = 2; std::find(suffixes.begin(), suffixes.begin() + i,
+                              suffixes[i]) != suffixes.begin() + i;
+         ++n) {
+      suffixes[i] = "_" + name + "_" + std::to_string(n);
+    }
+  }
+
+  WriteConfig layer_config =
+      FitTargetSizeToFile(data->write_config, data->metadata);
+  layer_config.animation = false;
+
+  // Layers are copied one by one from host on this thread and encoded on the
+  // others. A few copies wait for a worker at most, whatever the number of
+  // layers.
+  const int num_threads = GetNumWorkerThreads();
+  std::vector<ImageMemoryDesc> images(layers.size());
+  ProgressAddWork(progress, layers.size());
+  const bool success = RunPipelined(
+      layers.size(), /*max_num_in_flight=*/(size_t)num_threads * 2,
+      num_threads,
+      [&](size_t i) {
+        int16 copy_result = noErr;
+        CopyLayer(format_record, data, *layers[i], /*keep_rgb=*/true,
+                  &copy_result, &images[i]);
+        if (copy_result != noErr) *result = copy_result;
+        return copy_result == noErr && ProgressAdvance(progress, 1);
+      },
+      [&](size_t i) {
+        WebPData encoded_data;
+        WebPDataInit(&encoded_data);
+        bool ok = EncodeOneImage(images[i], layer_config, progress,
+                                 &encoded_data);
+        DeallocateImage(&images[i]);
+        ok = ok && WriteToSiblingFile(base_path, suffixes[i], encoded_data,
+                                      layer_config, data->metadata);
+        WebPDataClear(&encoded_data);
+        return ok;
+      },
+      progress);
+  for (ImageMemoryDesc& image : images) DeallocateImage(&image);
+  if (!success && *result == noErr) {
+    *result = ProgressIsCanceled(progress) ? userCanceledErr : writErr;
+  }
+  LOG("Exported " << layers.size() << " layers next to " << base_path
+                  << kExtension << ".");
+  STOP_TIMER(ExportLayersToFiles);
+}
@@ -14,7 +14,9 @@
 
 #include "WebPShop.h"
 
+#include <algorithm>
 #include <cmath>
+#include <vector>
 
 //------------------------------------------------------------------------------
 
@@ -110,6 +112,107 @@ bool Scale(const ImageMemoryDesc& src, ImageMemoryDesc* const dst,
   return true;
 }
 
+// Source pixels covered by one destination pixel along an axis, with the
+// fraction of each one (summing to 1).
+struct AreaContribution {
+  size_t first;
+  std::vector<float> weights;
+};
+
+static std::vector<AreaContribution> GetAreaContributions(size_t src_size,
+                                                          size_t dst_size) {
+  std::vector<AreaContribution> contributions(dst_size);
+  const double scale = (double)src_size / dst_size;
+  for (size_t i = 0; i < dst_size; ++i) {
+    const double start = i * scale, end = std::min((i + 1) * scale,
+                                                   (double)src_size);
+    AreaContribution& contribution = contributions[i];
+    contribution.first = (size_t)start;
+    for (size_t s = contribution.first; (double)s < end; ++s) {
+      const double covered =
+          std::min(end, (double)(s + 1)) - std::max(start, (double)s);
+      contribution.weights.push_back((float)(covered / scale));
+    }
+  }
+  return contributions;
+}
+
+bool ScaleDown(const ImageMemoryDesc& src, ImageMemoryDesc* const dst,
+               size_t dst_width, size_t dst_height) {
+  if (src.pixels.data == nullptr || src.width < 1 || src.height < 1 ||
+      src.pixels.depth != 8 || dst == nullptr || &src == dst) {
+    LOG("/!\\ Invalid source or destination.");
+    return false;
+  }
+  if (dst_width < 1 || dst_height < 1 || dst_width > (size_t)src.width ||
+      dst_height > (size_t)src.height) {
+    LOG("/!\\ Invalid input.");
+    return false;
+  }
+  if (!AllocateImage(dst, (int32)dst_width, (int32)dst_height,
+                     src.num_channels, src.pixels.depth)) {
+    LOG("/!\\ AllocateImage failed.");
+    return false;
+  }
+  dst->mode = src.mode;
+
+  const std::vector<AreaContribution> columns =
+      GetAreaContributions((size_t)src.width, dst_width);
+  const std::vector<AreaContribution> rows =
+      GetAreaContributions((size_t)src.height, dst_height);
+  const int num_channels = src.num_channels;
+  // Colors are weighted by alpha so that transparent pixels do not bleed.
+  const int alpha_channel = (num_channels == 4) ? 3 : -1;
+  const size_t src_stride = (size_t)(src.pixels.rowBits / 8);
+  const size_t dst_stride = (size_t)(dst->pixels.rowBits / 8);
+
+  // One row of the destination width, accumulated from several source rows.
+  std::vector<float> row(dst_width * num_channels);
+  std::vector<float> sum(dst_width * num_channels);
+  for (size_t dst_y = 0; dst_y < dst_height; ++dst_y) {
+    std::fill(sum.begin(), sum.end(), 0.f);
+    const AreaContribution& rows_y = rows[dst_y];
+    for (size_t i = 0; i < rows_y.weights.size(); ++i) {
+      const uint8_t* src_row =
+          reinterpret_cast<const uint8_t*>(src.pixels.data) +
+          (rows_y.first + i) * src_stride;
+      for (size_t dst_x = 0; dst_x < dst_width; ++dst_x) {
+        float* const pixel = &row[dst_x * num_channels];
+        std::fill(pixel, pixel + num_channels, 0.f);
+        const AreaContribution& columns_x = columns[dst_x];
+        for (size_t j = 0; j < columns_x.weights.size(); ++j) {
+          const uint8_t* src_pixel =
+              src_row + (columns_x.first + j) * num_channels;
+          const float weight =
+              columns_x.weights[j] *
+              (alpha_channel >= 0 ? src_pixel[alpha_channel] / 255.f : 1.f);
+          for (int c = 0; c < num_channels; ++c) {
+            pixel[c] += (c == alpha_channel ? columns_x.weights[j] : weight) *
+                        src_pixel[c];
+          }
+        }
+      }
+      const float weight = rows_y.weights[i];
+      for (size_t k = 0; k < sum.size(); ++k) sum[k] += weight * row[k];
+    }
+
+    uint8_t* dst_row =
+        reinterpret_cast<uint8_t*>(dst->pixels.data) + dst_y * dst_stride;
+    for (size_t dst_x = 0; dst_x < dst_width; ++dst_x) {
+      const float* const pixel = &sum[dst_x * num_channels];
+      const float alpha =
+          (alpha_channel >= 0) ? pixel[alpha_channel] / 255.f : 1.f;
+      for (int c = 0; c < num_channels; ++c) {
+        float value = pixel[c];
+        if (c != alpha_channel) value = (alpha > 0.f) ? value / alpha : 0.f;
+        dst_row[dst_x * num_channels + c] =
+            (value >= 255.f) ? 255 : (uint8_t)std::lrint(std::max(value, 0.f));
+      }
+    }
+  }
+  return true;
+}
+
 bool Crop(const ImageMemoryDesc& src, ImageMemoryDesc* const dst,
           size_t crop_width, size_t crop_height, size_t crop_left,
           size_t crop_top) {
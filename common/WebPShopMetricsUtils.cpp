@@ -0,0 +1,439 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <sstream>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WEBPSHOP_USE_SSE2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define WEBPSHOP_USE_NEON
+#endif
+
+#include "WebPShop.h"
+
+// Original pixels are BGRA (host layout), compressed pixels are RGBA (decoder
+// output). Color channels are premultiplied by alpha as (color * alpha) >> 8
+// so that invisible pixels, which the encoder is free to alter, do not count.
+// Alpha is scaled the same way as (alpha * 255) >> 8 to stay comparable.
+// All implementations below give the exact same results.
+
+//------------------------------------------------------------------------------
+// Sum of squared errors
+
+// Maximum number of pixels summed in 32-bit accumulators before overflowing:
+// each lane gets at most 4 * 254^2 per group of 4 pixels.
+static const int kMaxNumPixelsPerAccumulation = 4 * 16384;
+
+static uint64_t GetRowSSE_C(const uint8_t* original, const uint8_t* compressed,
+                            int width) {
+  uint64_t sse = 0;
+  for (int x = 0; x < width; ++x, original += 4, compressed += 4) {
+    const int o_a = original[3], c_a = compressed[3];
+    const int diffs[4] = {
+        ((original[0] * o_a) >> 8) - ((compressed[2] * c_a) >> 8),
+        ((original[1] * o_a) >> 8) - ((compressed[1] * c_a) >> 8),
+        ((original[2] * o_a) >> 8) - ((compressed[0] * c_a) >> 8),
+        ((o_a * 255) >> 8) - ((c_a * 255) >> 8)};
+    for (int diff : diffs) sse += (uint64_t)(diff * diff);
+  }
+  return sse;
+}
+
+#if defined(WEBPSHOP_USE_SSE2)
+
+// Premultiplies two BGRA pixels stored as 16-bit lanes.
+static inline __m128i Premultiply_SSE2(__m128i bgra) {
+  const __m128i alpha_lanes = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+  __m128i alpha = _mm_shufflelo_epi16(bgra, _MM_SHUFFLE(3, 3, 3, 3));
+  alpha = _mm_shufflehi_epi16(alpha, _MM_SHUFFLE(3, 3, 3, 3));
+  alpha = _mm_or_si128(alpha, alpha_lanes);  // Alpha is multiplied by 255.
+  return _mm_srli_epi16(_mm_mullo_epi16(bgra, alpha), 8);
+}
+
+static uint64_t GetRowSSE(const uint8_t* original, const uint8_t* compressed,
+                          int width) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i green_alpha = _mm_set1_epi32((int)0xff00ff00u);
+  const __m128i low_byte = _mm_set1_epi32(0x000000ff);
+  const int simd_width = width & ~3;
+  uint64_t sse = 0;
+  int x = 0;
+  while (x < simd_width) {
+    const int end = std::min(simd_width, x + kMaxNumPixelsPerAccumulation);
+    __m128i sum = zero;
+    for (; x < end; x += 4) {
+      const __m128i o = _mm_loadu_si128((const __m128i*)(original + 4 * x));
+      __m128i c = _mm_loadu_si128((const __m128i*)(compressed + 4 * x));
+      // RGBA to BGRA.
+      c = _mm_or_si128(
+          _mm_and_si128(c, green_alpha),
+          _mm_or_si128(_mm_and_si128(_mm_srli_epi32(c, 16), low_byte),
+                       _mm_slli_epi32(_mm_and_si128(c, low_byte), 16)));
+      const __m128i diff_lo =
+          _mm_sub_epi16(Premultiply_SSE2(_mm_unpacklo_epi8(o, zero)),
+                        Premultiply_SSE2(_mm_unpacklo_epi8(c, zero)));
+      const __m128i diff_hi =
+          _mm_sub_epi16(Premultiply_SSE2(_mm_unpackhi_epi8(o, zero)),
+                        Premultiply_SSE2(_mm_unpackhi_epi8(c, zero)));
+      sum = _mm_add_epi32(sum, _mm_madd_epi16(diff_lo, diff_lo));
+      sum = _mm_add_epi32(sum, _mm_madd_epi16(diff_hi, diff_hi));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, sum);
+    sse += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+  return sse + GetRowSSE_C(original + 4 * x, compressed + 4 * x, width - x);
+}
+
+#elif defined(WEBPSHOP_USE_NEON)
+
+// Premultiplies four BGRA pixels.
+static inline uint8x16_t Premultiply_NEON(uint8x16_t bgra) {
+  static const uint8_t kAlphaIndices[16] = {3,  3,  3,  3,  7,  7,  7,  7,
+                                            11, 11, 11, 11, 15, 15, 15, 15};
+  const uint8x16_t alpha_lanes =
+      vreinterpretq_u8_u32(vdupq_n_u32(0xff000000u));
+  // Alpha is multiplied by 255.
+  const uint8x16_t alpha =
+      vorrq_u8(vqtbl1q_u8(bgra, vld1q_u8(kAlphaIndices)), alpha_lanes);
+  const uint16x8_t lo = vmull_u8(vget_low_u8(bgra), vget_low_u8(alpha));
+  const uint16x8_t hi = vmull_high_u8(bgra, alpha);
+  return vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8));
+}
+
+static uint64_t GetRowSSE(const uint8_t* original, const uint8_t* compressed,
+                          int width) {
+  static const uint8_t kSwapRedBlue[16] = {2,  1, 0,  3,  6,  5,  4,  7,
+                                           10, 9, 8, 11, 14, 13, 12, 15};
+  const uint8x16_t swap_red_blue = vld1q_u8(kSwapRedBlue);
+  const int simd_width = width & ~3;
+  uint64_t sse = 0;
+  int x = 0;
+  while (x < simd_width) {
+    const int end = std::min(simd_width, x + kMaxNumPixelsPerAccumulation);
+    uint32x4_t sum = vdupq_n_u32(0);
+    for (; x < end; x += 4) {
+      const uint8x16_t o = Premultiply_NEON(vld1q_u8(original + 4 * x));
+      const uint8x16_t c = Premultiply_NEON(
+          vqtbl1q_u8(vld1q_u8(compressed + 4 * x), swap_red_blue));
+      const uint8x16_t diff = vabdq_u8(o, c);
+      sum = vpadalq_u16(sum, vmull_u8(vget_low_u8(diff), vget_low_u8(diff)));
+      sum = vpadalq_u16(sum, vmull_high_u8(diff, diff));
+    }
+    sse += vaddlvq_u32(sum);
+  }
+  return sse + GetRowSSE_C(original + 4 * x, compressed + 4 * x, width - x);
+}
+
+#else
+
+static uint64_t GetRowSSE(const uint8_t* original, const uint8_t* compressed,
+                          int width) {
+  return GetRowSSE_C(original, compressed, width);
+}
+
+#endif
+
+static double ComputePSNR(const ImageMemoryDesc& original,
+                          const ImageMemoryDesc& compressed) {
+  const uint8_t* original_row = (const uint8_t*)original.pixels.data;
+  const uint8_t* compressed_row = (const uint8_t*)compressed.pixels.data;
+  uint64_t sse = 0;
+  for (int32 y = 0; y < original.height; ++y) {
+    sse += GetRowSSE(original_row, compressed_row, (int)original.width);
+    original_row += original.pixels.rowBits / 8;
+    compressed_row += compressed.pixels.rowBits / 8;
+  }
+  if (sse == 0) return 99.0;  // Same cap as WebPPictureDistortion().
+  const double num_samples = 4.0 * original.width * original.height;
+  return std::min(99.0, 10.0 * std::log10(255.0 * 255.0 * num_samples / sse));
+}
+
+//------------------------------------------------------------------------------
+// Structural similarity
+
+// SSIM is computed on non-overlapping square blocks, on the four channels at
+// once. Per-block sums fit exactly in floats (at most 64 * 254^2 < 2^24).
+static const int kSSIMBlockSize = 8;
+
+#if defined(WEBPSHOP_USE_SSE2)
+
+typedef __m128 Vec4;
+static inline Vec4 Zero() { return _mm_setzero_ps(); }
+static inline Vec4 Add(Vec4 a, Vec4 b) { return _mm_add_ps(a, b); }
+static inline Vec4 Mul(Vec4 a, Vec4 b) { return _mm_mul_ps(a, b); }
+static inline void Store(Vec4 v, float dst[4]) { _mm_storeu_ps(dst, v); }
+
+static inline Vec4 LoadPremultiplied(uint32_t bgra) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i v16 = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)bgra), zero);
+  const Vec4 v = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v16, zero));
+  const Vec4 color_lanes = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+  // Alpha is multiplied by 255.
+  const Vec4 alpha =
+      _mm_or_ps(_mm_and_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3)),
+                           color_lanes),
+                _mm_set_ps(255.f, 0.f, 0.f, 0.f));
+  // Products are exact integers below 2^16 so truncation is a shift by 8.
+  return _mm_cvtepi32_ps(_mm_cvttps_epi32(
+      _mm_mul_ps(_mm_mul_ps(v, alpha), _mm_set1_ps(1.f / 256.f))));
+}
+
+#elif defined(WEBPSHOP_USE_NEON)
+
+typedef float32x4_t Vec4;
+static inline Vec4 Zero() { return vdupq_n_f32(0.f); }
+static inline Vec4 Add(Vec4 a, Vec4 b) { return vaddq_f32(a, b); }
+static inline Vec4 Mul(Vec4 a, Vec4 b) { return vmulq_f32(a, b); }
+static inline void Store(Vec4 v, float dst[4]) { vst1q_f32(dst, v); }
+
+static inline Vec4 LoadPremultiplied(uint32_t bgra) {
+  const uint16x8_t v16 = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(bgra)));
+  const Vec4 v = vcvtq_f32_u32(vmovl_u16(vget_low_u16(v16)));
+  // Alpha is multiplied by 255.
+  const Vec4 alpha = vsetq_lane_f32(255.f, vdupq_laneq_f32(v, 3), 3);
+  // Products are exact integers below 2^16 so truncation is a shift by 8.
+  return vcvtq_f32_u32(
+      vcvtq_u32_f32(vmulq_n_f32(vmulq_f32(v, alpha), 1.f / 256.f)));
+}
+
+#else
+
+struct Vec4 {
+  float v[4];
+};
+static inline Vec4 Zero() { return {{0.f, 0.f, 0.f, 0.f}}; }
+static inline Vec4 Add(Vec4 a, Vec4 b) {
+  for (int i = 0; i < 4; ++i) a.v[i] += b.v[i];
+  return a;
+}
+static inline Vec4 Mul(Vec4 a, Vec4 b) {
+  for (int i = 0; i < 4; ++i) a.v[i] *= b.v[i];
+  return a;
+}
+static inline void Store(Vec4 v, float dst[4]) {
+  for (int i = 0; i < 4; ++i) dst[i] = v.v[i];
+}
+
+static inline Vec4 LoadPremultiplied(uint32_t bgra) {
+  const int alpha = (int)(bgra >> 24);
+  Vec4 v;
+  for (int i = 0; i < 3; ++i) {
+    v.v[i] = (float)(((int)((bgra >> (8 * i)) & 0xff) * alpha) >> 8);
+  }
+  v.v[3] = (float)((alpha * 255) >> 8);
+  return v;
+}
+
+#endif
+
+static inline uint32_t LoadBGRA(const uint8_t* const bgra) {
+  return (uint32_t)bgra[0] | ((uint32_t)bgra[1] << 8) |
+         ((uint32_t)bgra[2] << 16) | ((uint32_t)bgra[3] << 24);
+}
+
+static inline uint32_t LoadRGBAAsBGRA(const uint8_t* const rgba) {
+  return (uint32_t)rgba[2] | ((uint32_t)rgba[1] << 8) |
+         ((uint32_t)rgba[0] << 16) | ((uint32_t)rgba[3] << 24);
+}
+
+// Returns the sum of the SSIM of the four channels of a block.
+static double GetBlockSSIM(const uint8_t* original, size_t original_stride,
+                           const uint8_t* compressed, size_t compressed_stride,
+                           int width, int height) {
+  Vec4 sum_o = Zero(), sum_c = Zero();
+  Vec4 sum_oo = Zero(), sum_cc = Zero(), sum_oc = Zero();
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const Vec4 o = LoadPremultiplied(LoadBGRA(original + 4 * x));
+      const Vec4 c = LoadPremultiplied(LoadRGBAAsBGRA(compressed + 4 * x));
+      sum_o = Add(sum_o, o);
+      sum_c = Add(sum_c, c);
+      sum_oo = Add(sum_oo, Mul(o, o));
+      sum_cc = Add(sum_cc, Mul(c, c));
+      sum_oc = Add(sum_oc, Mul(o, c));
+    }
+    original += original_stride;
+    compressed += compressed_stride;
+  }
+
+  float s_o[4], s_c[4], s_oo[4], s_cc[4], s_oc[4];
+  Store(sum_o, s_o);
+  Store(sum_c, s_c);
+  Store(sum_oo, s_oo);
+  Store(sum_cc, s_cc);
+  Store(sum_oc, s_oc);
+
+  // Same constants as in the original SSIM paper.
+  const double c1 = (0.01 * 255.0) * (0.01 * 255.0);
+  const double c2 = (0.03 * 255.0) * (0.03 * 255.0);
+  const double n = (double)width * height;
+  double ssim = 0.;
+  for (int i = 0; i < 4; ++i) {
+    const double mean_o = s_o[i] / n, mean_c = s_c[i] / n;
+    const double var_o = s_oo[i] / n - mean_o * mean_o;
+    const double var_c = s_cc[i] / n - mean_c * mean_c;
+    const double covar = s_oc[i] / n - mean_o * mean_c;
+    ssim += ((2. * mean_o * mean_c + c1) * (2. * covar + c2)) /
+            ((mean_o * mean_o + mean_c * mean_c + c1) * (var_o + var_c + c2));
+  }
+  return ssim;
+}
+
+static double ComputeSSIM(const ImageMemoryDesc& original,
+                          const ImageMemoryDesc& compressed) {
+  const size_t original_stride = (size_t)(original.pixels.rowBits / 8);
+  const size_t compressed_stride = (size_t)(compressed.pixels.rowBits / 8);
+  double weighted_sum = 0.;
+  for (int32 y = 0; y < original.height; y += kSSIMBlockSize) {
+    const int height = (int)std::min(original.height - y, (int32)kSSIMBlockSize);
+    const uint8_t* const original_row =
+        (const uint8_t*)original.pixels.data + y * original_stride;
+    const uint8_t* const compressed_row =
+        (const uint8_t*)compressed.pixels.data + y * compressed_stride;
+    for (int32 x = 0; x < original.width; x += kSSIMBlockSize) {
+      const int width = (int)std::min(original.width - x, (int32)kSSIMBlockSize);
+      // Partial blocks on the edges are weighted by their area.
+      weighted_sum += width * height *
+                      GetBlockSSIM(original_row + 4 * x, original_stride,
+                                   compressed_row + 4 * x, compressed_stride,
+                                   width, height);
+    }
+  }
+  return weighted_sum / (4.0 * original.width * original.height);
+}
+
+//------------------------------------------------------------------------------
+
+bool ComputeDistortion(const ImageMemoryDesc& original,
+                       const ImageMemoryDesc& compressed,
+                       DistortionMetric metric, double* const distortion) {
+  if (original.pixels.data == nullptr || compressed.pixels.data == nullptr ||
+      original.width < 1 || original.height < 1 ||
+      original.width != compressed.width ||
+      original.height != compressed.height ||
+      (original.num_channels != 3 && original.num_channels != 4) ||
+      compressed.num_channels != 4 || original.pixels.depth != 8 ||
+      compressed.pixels.depth != 8 || distortion == nullptr) {
+    LOG("/!\\ Unsupported or mismatching images.");
+    return false;
+  }
+
+  if (original.num_channels == 3) {
+    // Opaque originals are compared as BGRA, like the decoded images.
+    ImageMemoryDesc original_bgra;
+    const bool success =
+        To8bit(original, /*add_alpha=*/true, &original_bgra) &&
+        ComputeDistortion(original_bgra, compressed, metric, distortion);
+    DeallocateImage(&original_bgra);
+    return success;
+  }
+
+  if (metric == DistortionMetric::PSNR) {
+    *distortion = ComputePSNR(original, compressed);
+  } else if (metric == DistortionMetric::SSIM) {
+    *distortion = ComputeSSIM(original, compressed);
+  } else {
+    LOG("/!\\ Unknown metric " << metric << ".");
+    return false;
+  }
+  return true;
+}
+
+const char* GetDistortionMetricName(DistortionMetric metric) {
+  return (metric == DistortionMetric::PSNR)   ? "PSNR"
+         : (metric == DistortionMetric::SSIM) ? "SSIM"
+                                              : "none";
+}
+
+//------------------------------------------------------------------------------
+
+bool MeasureOneImage(const ImageMemoryDesc& original_image,
+                     const WebPData& encoded_data, DistortionMetric metric,
+                     double* const distortion) {
+  START_TIMER(MeasureOneImage);
+
+  ImageMemoryDesc compressed_image;
+  if (!DecodeOneImage(encoded_data, &compressed_image)) return false;
+  const bool success =
+      ComputeDistortion(original_image, compressed_image, metric, distortion);
+  DeallocateImage(&compressed_image);
+
+  STOP_TIMER(MeasureOneImage);
+  return success;
+}
+
+bool MeasureAllFrames(const std::vector<FrameMemoryDesc>& original_frames,
+                      const WebPData& encoded_data, DistortionMetric metric,
+                      double* const distortion) {
+  START_TIMER(MeasureAllFrames);
+
+  if (original_frames.empty() || distortion == nullptr) {
+    LOG("/!\\ Bad input/output.");
+    return false;
+  }
+
+  std::vector<FrameMemoryDesc> compressed_frames;
+  if (!DecodeAllFrames(encoded_data, /*progress=*/nullptr,
+                       &compressed_frames)) {
+    ClearFrameVector(&compressed_frames);
+    return false;
+  }
+
+  // The encoder may merge frames, so match them by timestamp rather than by
+  // index: each original frame is compared with the compressed frame that is
+  // displayed when it starts.
+  std::ostringstream frame_distortions;
+  frame_distortions.precision(4);
+  bool success = true;
+  double worst_distortion = 0.;
+  int original_timestamp_ms = 0;
+  int compressed_end_timestamp_ms = compressed_frames.front().duration_ms;
+  size_t compressed_index = 0;
+  for (size_t i = 0; success && i < original_frames.size(); ++i) {
+    while (original_timestamp_ms >= compressed_end_timestamp_ms &&
+           compressed_index + 1 < compressed_frames.size()) {
+      ++compressed_index;
+      compressed_end_timestamp_ms +=
+          compressed_frames[compressed_index].duration_ms;
+    }
+    double frame_distortion;
+    success = ComputeDistortion(original_frames[i].image,
+                                compressed_frames[compressed_index].image,
+                                metric, &frame_distortion);
+    if (success) {
+      frame_distortions << (i == 0 ? "" : " ") << frame_distortion;
+      if (i == 0 || frame_distortion < worst_distortion) {
+        worst_distortion = frame_distortion;
+      }
+    }
+    original_timestamp_ms += original_frames[i].duration_ms;
+  }
+  ClearFrameVector(&compressed_frames);
+
+  if (success) {
+    LOG(GetDistortionMetricName(metric)
+        << " per frame: " << frame_distortions.str());
+    *distortion = worst_distortion;
+  }
+
+  STOP_TIMER(MeasureAllFrames);
+  return success;
+}
@@ -0,0 +1,79 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <limits>
+
+#include "PIFormat.h"
+#include "WebPShop.h"
+
+//------------------------------------------------------------------------------
+
+// Calling the host too often slows the task down. This is still frequent
+// enough for the cancellation to feel immediate.
+static const std::chrono::milliseconds kMinPollInterval(25);
+
+void ProgressInit(FormatRecordPtr format_record, Progress* const progress) {
+  progress->format_record = format_record;
+  progress->host_thread = std::this_thread::get_id();
+  progress->num_done_units = 0;
+  progress->num_units = 0;
+  progress->canceled = false;
+  progress->last_poll = std::chrono::steady_clock::time_point();
+}
+
+void ProgressAddWork(Progress* const progress, uint64_t num_units) {
+  if (progress != nullptr) progress->num_units += num_units;
+}
+
+bool ProgressAdvance(Progress* const progress, uint64_t num_units) {
+  if (progress == nullptr) return true;
+  progress->num_done_units += num_units;
+  return ProgressPoll(progress);
+}
+
+bool ProgressPoll(Progress* const progress) {
+  if (progress == nullptr) return true;
+  if (progress->canceled) return false;
+  if (progress->format_record == nullptr ||
+      std::this_thread::get_id() != progress->host_thread) {
+    return true;  // Only the host thread can call the host.
+  }
+
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  if (now - progress->last_poll < kMinPollInterval) return true;
+  progress->last_poll = now;
+
+  FormatRecordPtr format_record = progress->format_record;
+  if (format_record->progressProc != nullptr) {
+    uint64_t total = progress->num_units;
+    uint64_t done = std::min((uint64_t)progress->num_done_units, total);
+    while (total > (uint64_t)std::numeric_limits<int32>::max()) {
+      total >>= 1;
+      done >>= 1;
+    }
+    if (total > 0) format_record->progressProc((int32)done, (int32)total);
+  }
+  if (format_record->abortProc != nullptr && format_record->abortProc()) {
+    LOG("Cancelled by the user.");
+    progress->canceled = true;
+    return false;
+  }
+  return true;
+}
+
+bool ProgressIsCanceled(const Progress* const progress) {
+  return progress != nullptr && progress->canceled;
+}
@@ -0,0 +1,383 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cstring>
+
+#include "FileUtilities.h"
+#include "WebPShop.h"
+#include "webp/mux_types.h"
+
+//------------------------------------------------------------------------------
+
+static const size_t kRIFFHeaderSize = 12;  // "RIFF", size, "WEBP"
+static const size_t kChunkHeaderSize = 8;  // FourCC, size
+static const size_t kVP8XChunkSize = 18;   // Header, flags, width, height
+static const uint64_t kMaxRIFFSize = 0xfffffff6u;
+
+static uint32_t GetLE24(const uint8_t* const data) {
+  return (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+         ((uint32_t)data[2] << 16);
+}
+static uint32_t GetLE32(const uint8_t* const data) {
+  return GetLE24(data) | ((uint32_t)data[3] << 24);
+}
+static void PutLE24(uint8_t* const data, uint32_t value) {
+  data[0] = (uint8_t)(value & 0xff);
+  data[1] = (uint8_t)((value >> 8) & 0xff);
+  data[2] = (uint8_t)((value >> 16) & 0xff);
+}
+static void PutLE32(uint8_t* const data, uint32_t value) {
+  PutLE24(data, value);
+  data[3] = (uint8_t)((value >> 24) & 0xff);
+}
+
+// Returns the size of a chunk including its header and padding.
+static size_t GetChunkSize(size_t payload_size) {
+  return kChunkHeaderSize + payload_size + (payload_size & 1);
+}
+
+static bool IsKept(const bool keep[Metadata::kNum],
+                   const Metadata metadata[Metadata::kNum], int i) {
+  return keep[i] && metadata != nullptr && metadata[i].chunk.bytes != nullptr &&
+         metadata[i].chunk.size > 0;
+}
+
+static bool HasKeptMetadata(const bool keep[Metadata::kNum],
+                            const Metadata metadata[Metadata::kNum]) {
+  for (int i = 0; i < Metadata::kNum; ++i) {
+    if (IsKept(keep, metadata, i)) return true;
+  }
+  return false;
+}
+
+static void GetKeptFlags(const WriteConfig& write_config,
+                         bool keep[Metadata::kNum]) {
+  keep[Metadata::kEXIF] = write_config.keep_exif;
+  keep[Metadata::kXMP] = write_config.keep_xmp;
+  keep[Metadata::kICCP] = write_config.keep_color_profile;
+}
+
+//------------------------------------------------------------------------------
+// Reader
+
+bool FindMetadataChunks(const WebPData& encoded_data,
+                        Metadata metadata[Metadata::kNum]) {
+  for (int i = 0; i < Metadata::kNum; ++i) {
+    metadata[i].chunk.bytes = nullptr;
+    metadata[i].chunk.size = 0;
+  }
+
+  const uint8_t* const bytes = encoded_data.bytes;
+  if (bytes == nullptr || encoded_data.size < kRIFFHeaderSize ||
+      memcmp(bytes, "RIFF", 4) != 0 || memcmp(bytes + 8, "WEBP", 4) != 0) {
+    LOG("/!\\ Not a WebP file.");
+    return false;
+  }
+
+  // Anything after the RIFF payload is ignored. A truncated last chunk too.
+  const size_t end = (size_t)std::min<uint64_t>(
+      encoded_data.size, GetLE32(bytes + 4) + (uint64_t)8);
+  size_t offset = kRIFFHeaderSize;
+  while (offset + kChunkHeaderSize <= end) {
+    const uint8_t* const four_cc = bytes + offset;
+    const size_t payload_size = GetLE32(bytes + offset + 4);
+    const size_t payload_offset = offset + kChunkHeaderSize;
+    if (payload_size > end - payload_offset) {
+      LOG("/!\\ Truncated " << std::string((const char*)four_cc, 4)
+                            << " chunk.");
+      break;
+    }
+    for (int i = 0; i < Metadata::kNum; ++i) {
+      // Only the last chunk of each type is imported.
+      if (memcmp(four_cc, metadata[i].four_cc, 4) == 0) {
+        metadata[i].chunk.bytes = bytes + payload_offset;
+        metadata[i].chunk.size = payload_size;
+      }
+    }
+    offset = payload_offset + payload_size + (payload_size & 1);
+  }
+
+  for (int i = 0; i < Metadata::kNum; ++i) {
+    if (metadata[i].chunk.bytes != nullptr) {
+      LOG("Found " << metadata[i].four_cc << " chunk ("
+                   << metadata[i].chunk.size << " bytes).");
+    }
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Writer
+
+static bool WriteChunk(RIFFWriter* const writer, const Metadata& metadata) {
+  uint8_t header[kChunkHeaderSize];
+  memcpy(header, metadata.four_cc, 4);
+  PutLE32(header + 4, (uint32_t)metadata.chunk.size);
+  const uint8_t padding = 0;
+  if (!writer->sink(header, sizeof(header)) ||
+      !writer->sink(metadata.chunk.bytes, metadata.chunk.size) ||
+      ((metadata.chunk.size & 1) && !writer->sink(&padding, 1))) {
+    return false;
+  }
+  writer->num_written_bytes += GetChunkSize(metadata.chunk.size);
+  LOG("Added " << metadata.four_cc << " chunk (" << metadata.chunk.size
+               << " bytes).");
+  return true;
+}
+
+// Outputs the RIFF header followed by what was buffered in writer->prefix.
+// If there is metadata, the header of the encoder is replaced by a VP8X one
+// and the ICCP chunk is inserted before the image chunks.
+static bool WritePrefix(RIFFWriter* const writer) {
+  const uint8_t* const prefix = writer->prefix;
+  const size_t prefix_size = writer->prefix_size;
+  writer->prefix_parsed = true;
+
+  if (prefix_size < kRIFFHeaderSize + kChunkHeaderSize ||
+      memcmp(prefix, "RIFF", 4) != 0 || memcmp(prefix + 8, "WEBP", 4) != 0) {
+    LOG("/!\\ Not a WebP bitstream.");
+    return false;
+  }
+
+  if (!HasKeptMetadata(writer->keep, writer->metadata)) {
+    LOG("No metadata written.");
+    if (!writer->sink(prefix, prefix_size)) return false;
+    writer->num_written_bytes += prefix_size;
+    return true;
+  }
+
+  // The encoder knows the size of the whole bitstream before outputting it,
+  // so the final RIFF size can be deduced from its header.
+  const uint64_t encoder_file_size = GetLE32(prefix + 4) + (uint64_t)8;
+  uint32_t flags = 0, width, height;
+  size_t replaced_size = kRIFFHeaderSize;
+  if (memcmp(prefix + kRIFFHeaderSize, "VP8X", 4) == 0) {
+    if (prefix_size < kRIFFHeaderSize + kVP8XChunkSize) {
+      LOG("/!\\ Truncated VP8X chunk.");
+      return false;
+    }
+    const uint8_t* const vp8x = prefix + kRIFFHeaderSize + kChunkHeaderSize;
+    flags = GetLE32(vp8x);
+    width = GetLE24(vp8x + 4) + 1;
+    height = GetLE24(vp8x + 7) + 1;
+    replaced_size += kVP8XChunkSize;
+  } else {
+    WebPBitstreamFeatures features;
+    const VP8StatusCode status =
+        WebPGetFeatures(prefix, prefix_size, &features);
+    if (status != VP8_STATUS_OK) {
+      LOG("/!\\ WebPGetFeatures failed (" << status << ")");
+      return false;
+    }
+    if (features.has_alpha) flags |= ALPHA_FLAG;
+    width = (uint32_t)features.width;
+    height = (uint32_t)features.height;
+  }
+  if (encoder_file_size < replaced_size) {
+    LOG("/!\\ Bad RIFF size.");
+    return false;
+  }
+
+  const uint32_t metadata_flags[Metadata::kNum] = {EXIF_FLAG, XMP_FLAG,
+                                                   ICCP_FLAG};
+  uint64_t riff_size = 4 + kVP8XChunkSize + (encoder_file_size - replaced_size);
+  for (int i = 0; i < Metadata::kNum; ++i) {
+    if (IsKept(writer->keep, writer->metadata, i)) {
+      flags |= metadata_flags[i];
+      riff_size += GetChunkSize(writer->metadata[i].chunk.size);
+    }
+  }
+  if (riff_size > kMaxRIFFSize) {
+    LOG("/!\\ File too big (" << riff_size << " bytes).");
+    return false;
+  }
+
+  uint8_t header[kRIFFHeaderSize + kVP8XChunkSize] = {0};
+  memcpy(header, "RIFF", 4);
+  PutLE32(header + 4, (uint32_t)riff_size);
+  memcpy(header + 8, "WEBP", 4);
+  memcpy(header + 12, "VP8X", 4);
+  PutLE32(header + 16, (uint32_t)(kVP8XChunkSize - kChunkHeaderSize));
+  PutLE32(header + 20, flags);
+  PutLE24(header + 24, width - 1);
+  PutLE24(header + 27, height - 1);
+  if (!writer->sink(header, sizeof(header))) return false;
+  writer->num_written_bytes += sizeof(header);
+
+  if (IsKept(writer->keep, writer->metadata, Metadata::kICCP) &&
+      !WriteChunk(writer, writer->metadata[Metadata::kICCP])) {
+    return false;
+  }
+
+  if (!writer->sink(prefix + replaced_size, prefix_size - replaced_size)) {
+    return false;
+  }
+  writer->num_written_bytes += prefix_size - replaced_size;
+  return true;
+}
+
+void RIFFWriterInit(const WriteConfig& write_config,
+                    const Metadata metadata[Metadata::kNum],
+                    const RIFFSink& sink, RIFFWriter* const writer) {
+  writer->sink = sink;
+  writer->metadata = metadata;
+  GetKeptFlags(write_config, writer->keep);
+  writer->prefix_size = 0;
+  writer->prefix_parsed = false;
+  writer->failed = false;
+  writer->num_written_bytes = 0;
+}
+
+bool RIFFWriterAppend(RIFFWriter* const writer, const uint8_t* data,
+                      size_t data_size) {
+  if (writer->failed) return false;
+
+  if (!writer->prefix_parsed) {
+    const size_t size =
+        std::min(data_size, RIFFWriter::kPrefixSize - writer->prefix_size);
+    memcpy(writer->prefix + writer->prefix_size, data, size);
+    writer->prefix_size += size;
+    data += size;
+    data_size -= size;
+    if (writer->prefix_size < RIFFWriter::kPrefixSize) return true;
+    if (!WritePrefix(writer)) {
+      writer->failed = true;
+      return false;
+    }
+  }
+
+  if (data_size > 0) {
+    if (!writer->sink(data, data_size)) {
+      writer->failed = true;
+      return false;
+    }
+    writer->num_written_bytes += data_size;
+  }
+  return true;
+}
+
+bool RIFFWriterFinish(RIFFWriter* const writer) {
+  if (writer->failed) return false;
+  if (!writer->prefix_parsed && !WritePrefix(writer)) {
+    writer->failed = true;
+    return false;
+  }
+
+  // EXIF and XMP chunks go after the image data.
+  for (int i : {Metadata::kEXIF, Metadata::kXMP}) {
+    if (IsKept(writer->keep, writer->metadata, i) &&
+        !WriteChunk(writer, writer->metadata[i])) {
+      writer->failed = true;
+      return false;
+    }
+  }
+  LOG("Wrote " << writer->num_written_bytes << " bytes.");
+  return true;
+}
+
+int RIFFWriterWrite(const uint8_t* data, size_t data_size,
+                    const WebPPicture* picture) {
+  return RIFFWriterAppend((RIFFWriter*)picture->custom_ptr, data, data_size)
+             ? 1
+             : 0;
+}
+
+size_t GetFileSize(const WebPData& encoded_data,
+                   const WriteConfig& write_config,
+                   const Metadata metadata[Metadata::kNum]) {
+  bool keep[Metadata::kNum];
+  GetKeptFlags(write_config, keep);
+  size_t file_size = encoded_data.size;
+  if (!HasKeptMetadata(keep, metadata)) return file_size;
+  if (encoded_data.size < kRIFFHeaderSize + kChunkHeaderSize ||
+      memcmp(encoded_data.bytes + kRIFFHeaderSize, "VP8X", 4) != 0) {
+    file_size += kVP8XChunkSize;
+  }
+  for (int i = 0; i < Metadata::kNum; ++i) {
+    if (IsKept(keep, metadata, i)) {
+      file_size += GetChunkSize(metadata[i].chunk.size);
+    }
+  }
+  return file_size;
+}
+
+WriteConfig FitTargetSizeToFile(const WriteConfig& write_config,
+                                const Metadata metadata[Metadata::kNum]) {
+  WriteConfig bitstream_config = write_config;
+  if (write_config.target_size <= 0) return bitstream_config;
+  bool keep[Metadata::kNum];
+  GetKeptFlags(write_config, keep);
+  if (!HasKeptMetadata(keep, metadata)) return bitstream_config;
+
+  // Counts the VP8X chunk even if the bitstream already has one.
+  size_t overhead = kVP8XChunkSize;
+  for (int i = 0; i < Metadata::kNum; ++i) {
+    if (IsKept(keep, metadata, i)) {
+      overhead += GetChunkSize(metadata[i].chunk.size);
+    }
+  }
+  // At least one byte, otherwise it would not be a target anymore.
+  bitstream_config.target_size =
+      (overhead < (size_t)write_config.target_size)
+          ? write_config.target_size - (int32)overhead
+          : 1;
+  LOG("Target size " << write_config.target_size << " bytes minus "
+                     << overhead << " bytes of metadata.");
+  return bitstream_config;
+}
+
+//------------------------------------------------------------------------------
+// Host file
+
+void RIFFWriterInitForHostFile(const WriteConfig& write_config,
+                               const Metadata metadata[Metadata::kNum],
+                               FormatRecordPtr format_record,
+                               int16* const result, RIFFWriter* const writer) {
+  RIFFWriterInit(write_config, metadata,
+                 [format_record, result](const uint8_t* data, size_t size) {
+                   WriteSome(size, data, format_record, result);
+                   return *result == noErr;
+                 },
+                 writer);
+
+  if (*result == noErr) {
+    // Move cursor to the start of the output file.
+    *result = PSSDKSetFPos((int32)format_record->dataFork,
+                           format_record->posixFileDescriptor,
+                           format_record->pluginUsingPOSIXIO, fsFromStart, 0);
+  }
+  if (*result != noErr) writer->failed = true;
+}
+
+void WriteToFile(const WebPData& encoded_data, const WriteConfig& write_config,
+                 const Metadata metadata[Metadata::kNum],
+                 FormatRecordPtr format_record, int16* const result) {
+  START_TIMER(WriteToFile);
+
+  if (encoded_data.bytes == nullptr || encoded_data.size == 0) {
+    LOG("/!\\ Source is null.");
+    return;
+  }
+
+  RIFFWriter writer;
+  RIFFWriterInitForHostFile(write_config, metadata, format_record, result,
+                            &writer);
+  if (!RIFFWriterAppend(&writer, encoded_data.bytes, encoded_data.size) ||
+      !RIFFWriterFinish(&writer)) {
+    if (*result == noErr) *result = writErr;
+  }
+
+  STOP_TIMER(WriteToFile);
+}
@@ -12,10 +12,49 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <string>
+
 #include "PIActions.h"
 #include "PIUSuites.h"
 #include "WebPShop.h"
 
+// Parses qualities separated by any other character. Returns false if one is
+// out of bounds or if there are too many.
+static bool ParseQualityLadder(const std::string& text,
+                               WriteConfig* const write_config) {
+  int32 qualities[MAX_NUM_QUALITY_RUNGS];
+  int32 num_qualities = 0;
+  for (size_t i = 0; i < text.size();) {
+    if (text[i] < '0' || text[i] > '9') {
+      ++i;
+      continue;
+    }
+    int32 quality = 0;
+    for (; i < text.size() && text[i] >= '0' && text[i] <= '9'; ++i) {
+      quality = quality * 10 + (text[i] - '0');
+      if (quality > 100) return false;
+    }
+    if (num_qualities == MAX_NUM_QUALITY_RUNGS) return false;
+    qualities[num_qualities++] = quality;
+  }
+  if (write_config != nullptr) {
+    std::copy(qualities, qualities + num_qualities,
+              write_config->quality_ladder);
+    write_config->num_quality_rungs = num_qualities;
+  }
+  return true;
+}
+
+static std::string QualityLadderToString(const WriteConfig& write_config) {
+  std::string text;
+  for (int32 i = 0; i < write_config.num_quality_rungs; ++i) {
+    if (i > 0) text += ' ';
+    text += std::to_string(write_config.quality_ladder[i]);
+  }
+  return text;
+}
+
 static void LoadScriptingParameters(FormatRecordPtr format_record,
                                     WriteConfig* const write_config,
                                     bool* const use_posix,
@@ -74,6 +113,18 @@ static void LoadScriptingParameters(FormatRecordPtr format_record,
         LOG("Reading parameter: compression = " << i);
         break;
       }
+      case keyWriteConfig_profile: {
+        int32 i;
+        readProcs->getIntegerProc(token, &i);
+        if (i < (int32)EncoderProfile::STANDARD ||
+            i > (int32)EncoderProfile::SMALL_ALPHA) {
+          LOG("/!\\ Reading parameters: Out of bounds.");
+        } else if (write_config != nullptr) {
+          write_config->profile = (EncoderProfile)i;
+        }
+        LOG("Reading parameter: profile = " << i);
+        break;
+      }
       case keyWriteConfig_keep_exif: {
         Boolean b;
         readProcs->getBooleanProc(token, &b);
@@ -102,6 +153,134 @@ static void LoadScriptingParameters(FormatRecordPtr format_record,
         LOG("Reading parameter: loop forever = " << (bool)b);
         break;
       }
+      case keyWriteConfig_parallel_animation: {
+        Boolean b;
+        readProcs->getBooleanProc(token, &b);
+        if (write_config != nullptr) write_config->parallel_animation = (bool)b;
+        LOG("Reading parameter: parallel animation = " << (bool)b);
+        break;
+      }
+      case keyWriteConfig_target_size: {
+        int32 i;
+        readProcs->getIntegerProc(token, &i);
+        if (i < 0) {
+          LOG("/!\\ Reading parameters: Out of bounds.");
+        } else if (write_config != nullptr) {
+          write_config->target_size = i;
+        }
+        LOG("Reading parameter: target size = " << i);
+        break;
+      }
+      case keyWriteConfig_target_metric: {
+        int32 i;
+        readProcs->getIntegerProc(token, &i);
+        if (i < (int32)DistortionMetric::NO_METRIC ||
+            i > (int32)DistortionMetric::SSIM) {
+          LOG("/!\\ Reading parameters: Out of bounds.");
+        } else if (write_config != nullptr) {
+          write_config->target_metric = (DistortionMetric)i;
+        }
+        LOG("Reading parameter: target metric = " << i);
+        break;
+      }
+      case keyWriteConfig_target_distortion: {
+        double d;
+        readProcs->getFloatProc(token, &d);
+        if (!(d >= 0.0 && d <= 99.0)) {
+          LOG("/!\\ Reading parameters: Out of bounds.");
+        } else if (write_config != nullptr) {
+          write_config->target_distortion = d;
+        }
+        LOG("Reading parameter: target distortion = " << d);
+        break;
+      }
+      case keyWriteConfig_race_lossless: {
+        Boolean b;
+        readProcs->getBooleanProc(token, &b);
+        if (write_config != nullptr) write_config->race_lossless = (bool)b;
+        LOG("Reading parameter: race lossless = " << (bool)b);
+        break;
+      }
+      case keyWriteConfig_time_budget: {
+        int32 i;
+        readProcs->getIntegerProc(token, &i);
+        if (i < 0) {
+          LOG("/!\\ Reading parameters: Out of bounds.");
+        } else if (write_config != nullptr) {
+          write_config->time_budget_ms = i;
+        }
+        LOG("Reading parameter: time budget = " << i);
+        break;
+      }
+      case keyWriteConfig_encode_cache_size: {
+        int32 i;
+        readProcs->getIntegerProc(token, &i);
+        if (i < 0) {
+          LOG("/!\\ Reading parameters: Out of bounds.");
+        } else if (write_config != nullptr) {
+          write_config->encode_cache_size_mb = i;
+        }
+        LOG("Reading parameter: encode cache size = " << i);
+        break;
+      }
+      case keyWriteConfig_num_downscaled_copies: {
+        int32 i;
+        readProcs->getIntegerProc(token, &i);
+        if (i < 0 || i > MAX_NUM_DOWNSCALED_COPIES) {
+          LOG("/!\\ Reading parameters: Out of bounds.");
+        } else if (write_config != nullptr) {
+          write_config->num_downscaled_copies = i;
+        }
+        LOG("Reading parameter: downscaled copies = " << i);
+        break;
+      }
+      case keyWriteConfig_thumbnail_size: {
+        int32 i;
+        readProcs->getIntegerProc(token, &i);
+        if (i < 0 || i > 16383) {
+          LOG("/!\\ Reading parameters: Out of bounds.");
+        } else if (write_config != nullptr) {
+          write_config->thumbnail_size = i;
+        }
+        LOG("Reading parameter: thumbnail size = " << i);
+        break;
+      }
+      case keyWriteConfig_quality_ladder: {
+        Handle handle = nullptr;
+        readProcs->getTextProc(token, &handle);
+        std::string text;
+        if (handle != nullptr) {
+          Boolean oldLock = FALSE;
+          Ptr ptr = nullptr;
+          sPSHandle->SetLock(handle, true, &ptr, &oldLock);
+          if (ptr != nullptr) {
+            text.assign(ptr, (size_t)sPSHandle->GetSize(handle));
+            sPSHandle->SetLock(handle, false, &ptr, &oldLock);
+          }
+          sPSHandle->Dispose(handle);
+        }
+        if (!ParseQualityLadder(text, nullptr)) {
+          LOG("/!\\ Reading parameters: Out of bounds.");
+        } else {
+          ParseQualityLadder(text, write_config);
+        }
+        LOG("Reading parameter: quality ladder = " << text);
+        break;
+      }
+      case keyWriteConfig_layers_to_files: {
+        Boolean b;
+        readProcs->getBooleanProc(token, &b);
+        if (write_config != nullptr) write_config->layers_to_files = (bool)b;
+        LOG("Reading parameter: layers to files = " << (bool)b);
+        break;
+      }
+      case keyWriteConfig_auto_preset: {
+        Boolean b;
+        readProcs->getBooleanProc(token, &b);
+        if (write_config != nullptr) write_config->auto_preset = (bool)b;
+        LOG("Reading parameter: auto preset = " << (bool)b);
+        break;
+      }
       case keyUsePOSIX: {
         Boolean b;
         readProcs->getBooleanProc(token, &b);
@@ -152,17 +331,41 @@ void SaveWriteConfig(FormatRecordPtr format_record,
 
   LOG("Writing parameters: quality = " << write_config.quality);
   LOG("                    compression = " << write_config.compression);
+  LOG("                    profile = " << write_config.profile);
   LOG("                    keep "
       << (write_config.keep_exif ? "EXIF" : "NO EXIF") << ", "
       << (write_config.keep_xmp ? "XMP" : "NO XMP") << ", "
       << (write_config.keep_color_profile ? "ICC" : "NO ICC"));
   LOG("                    loop forever = "
       << (write_config.loop_forever ? "yes" : "no"));
+  LOG("                    parallel animation = "
+      << (write_config.parallel_animation ? "yes" : "no"));
+  LOG("                    target size = " << write_config.target_size);
+  LOG("                    target metric = "
+      << GetDistortionMetricName(write_config.target_metric));
+  LOG("                    target distortion = "
+      << write_config.target_distortion);
+  LOG("                    race lossless = "
+      << (write_config.race_lossless ? "yes" : "no"));
+  LOG("                    time budget = " << write_config.time_budget_ms);
+  LOG("                    encode cache size = "
+      << write_config.encode_cache_size_mb);
+  LOG("                    downscaled copies = "
+      << write_config.num_downscaled_copies);
+  LOG("                    thumbnail size = " << write_config.thumbnail_size);
+  LOG("                    quality ladder = "
+      << QualityLadderToString(write_config));
+  LOG("                    layers to files = "
+      << (write_config.layers_to_files ? "yes" : "no"));
+  LOG("                    auto preset = "
+      << (write_config.auto_preset ? "yes" : "no"));
 
   writeProcs->putIntegerProc(token, keyWriteConfig_quality,
                              write_config.quality);
   writeProcs->putIntegerProc(token, keyWriteConfig_compression,
                              write_config.compression);
+  writeProcs->putIntegerProc(token, keyWriteConfig_profile,
+                             write_config.profile);
   writeProcs->putBooleanProc(token, keyWriteConfig_keep_exif,
                              write_config.keep_exif);
   writeProcs->putBooleanProc(token, keyWriteConfig_keep_xmp,
@@ -171,6 +374,41 @@ void SaveWriteConfig(FormatRecordPtr format_record,
                              write_config.keep_color_profile);
   writeProcs->putBooleanProc(token, keyWriteConfig_loop_forever,
                              write_config.loop_forever);
+  writeProcs->putBooleanProc(token, keyWriteConfig_parallel_animation,
+                             write_config.parallel_animation);
+  writeProcs->putIntegerProc(token, keyWriteConfig_target_size,
+                             write_config.target_size);
+  writeProcs->putIntegerProc(token, keyWriteConfig_target_metric,
+                             write_config.target_metric);
+  writeProcs->putFloatProc(token, keyWriteConfig_target_distortion,
+                           &write_config.target_distortion);
+  writeProcs->putBooleanProc(token, keyWriteConfig_race_lossless,
+                             write_config.race_lossless);
+  writeProcs->putIntegerProc(token, keyWriteConfig_time_budget,
+                             write_config.time_budget_ms);
+  writeProcs->putIntegerProc(token, keyWriteConfig_encode_cache_size,
+                             write_config.encode_cache_size_mb);
+  writeProcs->putIntegerProc(token, keyWriteConfig_num_downscaled_copies,
+                             write_config.num_downscaled_copies);
+  writeProcs->putIntegerProc(token, keyWriteConfig_thumbnail_size,
+                             write_config.thumbnail_size);
+  const std::string quality_ladder = QualityLadderToString(write_config);
+  Handle handle = sPSHandle->New((int32)quality_ladder.size());
+  if (handle != nullptr) {
+    Boolean oldLock = FALSE;
+    Ptr ptr = nullptr;
+    sPSHandle->SetLock(handle, true, &ptr, &oldLock);
+    if (ptr != nullptr) {
+      std::copy(quality_ladder.begin(), quality_ladder.end(), ptr);
+      sPSHandle->SetLock(handle, false, &ptr, &oldLock);
+      writeProcs->putTextProc(token, keyWriteConfig_quality_ladder, handle);
+    }
+    sPSHandle->Dispose(handle);
+  }
+  writeProcs->putBooleanProc(token, keyWriteConfig_layers_to_files,
+                             write_config.layers_to_files);
+  writeProcs->putBooleanProc(token, keyWriteConfig_auto_preset,
+                             write_config.auto_preset);
 
   sPSHandle->Dispose(descParams->descriptor);
   PIDescriptorHandle h;
@@ -68,18 +68,37 @@ void DoOptionsStart(FormatRecordPtr format_record, Data* const data,
       desc_params == nullptr || desc_params->playInfo == plugInDialogDisplay;
 
   if (display_encoding_parameters) {
-    std::vector<FrameMemoryDesc> frames;
-    if (*result == noErr) {
+    // Reads the frames displayed by the settings window into 'frames'.
+    const auto load_frames = [format_record, data](
+                                 Progress* const progress,
+                                 std::vector<FrameMemoryDesc>* const frames) {
+      int16 load_result = noErr;
       if (data->write_config.animation) {
-        CopyAllLayers(format_record, data, result, &frames);
+        CopyAllLayers(format_record, data, progress, &load_result, frames);
       } else {
-        ResizeFrameVector(&frames, 1);
-        CopyWholeCanvas(format_record, data, result, &frames[0].image);
+        ResizeFrameVector(frames, 1);
+        // The settings window displays BGRA.
+        CopyWholeCanvas(format_record, data, /*keep_rgb=*/false, &load_result,
+                        &(*frames)[0].image);
       }
+      if (load_result != noErr) ClearFrameVector(frames);
+      return load_result;
+    };
+
+    // Without preview, the frames are only read once the preview is enabled,
+    // if ever. Otherwise DoWriteStart() can stream the layers instead.
+    std::vector<FrameMemoryDesc> frames;
+    if (*result == noErr && data->write_config.display_proxy) {
+      Progress progress;
+      ProgressInit(format_record, &progress);
+      *result = load_frames(&progress, &frames);
     }
 
     if (*result == noErr) {
-      if (!DoUI(&data->write_config, data->metadata, plugin_ref, frames,
+      if (!DoUI(&data->write_config, data->metadata, plugin_ref, &frames,
+                [&load_frames](std::vector<FrameMemoryDesc>* const lazy) {
+                  return load_frames(/*progress=*/nullptr, lazy) == noErr;
+                },
                 /*original_frames_were_converted_to_8b=*/
                 (format_record->depth != 8), &data->encoded_data,
                 format_record->displayPixels)) {
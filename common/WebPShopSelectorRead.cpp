@@ -43,15 +43,18 @@ void DoReadStart(FormatRecordPtr format_record, Data* const data,
   ReadAndCheckHeader(format_record, result, &data->file_size);
   if (*result != noErr) return;
 
-  LOG("Allocate and read " << data->file_size << " bytes.");
-  AllocateAndRead(data->file_size, &data->file_data, format_record, result);
-  if (*result != noErr) return;
-
-  if (*result == noErr && !WebPInitDecoderConfig(&data->read_config)) {
+  // Before ReadFileData(), which may set the output of an incremental decoder.
+  if (!WebPInitDecoderConfig(&data->read_config)) {
     LOG("/!\\ WebPInitDecoderConfig() failed.");
     *result = readErr;
+    return;
   }
 
+  if (!MapFileData(format_record, data)) {
+    ReadFileData(format_record, data, result);
+  }
+  if (*result != noErr) return;
+
   if (*result == noErr &&
       WebPGetFeatures((uint8_t*)data->file_data, data->file_size,
                       &data->read_config.input) != VP8_STATUS_OK) {
@@ -60,14 +63,18 @@ void DoReadStart(FormatRecordPtr format_record, Data* const data,
   }
 
   if (*result == noErr) {
+    // The chunks are only views on the file data, copied once to the host.
     const WebPData encoded_data = {(uint8_t*)data->file_data, data->file_size};
-    if (!DecodeMetadata(encoded_data, data->metadata)) *result = readErr;
-  }
-
-  if (*result == noErr) {
-    *result = SetHostMetadata(format_record, data->metadata);
+    Metadata metadata[Metadata::kNum];
+    for (int i = 0; i < Metadata::kNum; ++i) {
+      metadata[i].four_cc = data->metadata[i].four_cc;
+    }
+    if (!FindMetadataChunks(encoded_data, metadata)) {
+      *result = readErr;
+    } else {
+      *result = SetHostMetadata(format_record, metadata);
+    }
   }
-  DeallocateMetadata(data->metadata);
 
   if (*result == noErr) {
     format_record->PluginUsing32BitCoordinates =
@@ -124,11 +131,19 @@ void DoReadStart(FormatRecordPtr format_record, Data* const data,
 
   // Going through formatSelectorReadContinue discards the alpha samples for
   // some reason. Treat all images, including still ones, as animations to use
-  // formatSelectorReadLayerContinue which supports transparency.
-  if (*result == noErr) InitAnimDecoder(format_record, data, result);
+  // formatSelectorReadLayerContinue which supports transparency. Still images
+  // are a single layer sent by bands, without WebPAnimDecoder.
+  if (*result == noErr && !data->read_config.input.has_animation) {
+    format_record->layerData = 1;
+  } else if (*result == noErr) {
+    InitAnimDecoder(format_record, data, result);
+  }
   // format_record->layerData = 0;  // Uncomment for formatSelectorReadContinue
 
-  if (*result != noErr) Deallocate(&data->file_data);
+  if (*result != noErr) {
+    DeallocateImage(&data->decoded_image);
+    ReleaseFileData(data);
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -138,9 +153,8 @@ void DoReadStart(FormatRecordPtr format_record, Data* const data,
 void DoReadContinue(FormatRecordPtr format_record, Data* const data,
                     int16* const result) {
   ReadOneFrame(format_record, data, result, /*frame_counter=*/0);
-  if (*result != noErr) ReleaseAnimDecoder(format_record, data);
-
-  Deallocate(&data->file_data);
+  // Also stops the frame lookahead before releasing the file data it reads.
+  ReleaseAnimDecoder(format_record, data);
 }
 
 //------------------------------------------------------------------------------
@@ -150,7 +164,7 @@ void DoReadFinish(FormatRecordPtr format_record, Data* const data,
   ReleaseAnimDecoder(format_record, data);
 
   Deallocate(&format_record->data);
-  Deallocate(&data->file_data);
+  ReleaseFileData(data);
 
   AddComment(format_record, data, result);  // Write a history comment.
 }
@@ -12,11 +12,184 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <thread>
+
 #include "PIFormat.h"
 #include "WebPShop.h"
 #include "WebPShopSelector.h"
+#include "webp/decode.h"
 #include "webp/demux.h"
 
+// Frames are decoded by another thread while the host copies the previous
+// ones. The output of WebPAnimDecoderGetNext() is valid only until the next
+// call, so each frame is copied to one of kNumLookaheadFrames owned buffers.
+static const size_t kNumLookaheadFrames = 2;
+
+struct FrameLookahead {
+  // The only user of data->anim_decoder once started, see data->anim_info.
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable frame_decoded, frame_released;
+  ImageMemoryDesc frames[kNumLookaheadFrames];
+  int timestamps[kNumLookaheadFrames] = {};
+  size_t num_frames = 0;
+  size_t num_decoded_frames = 0;
+  size_t num_released_frames = 0;  // Copied by the host.
+  bool failed = false;
+  bool stop = false;
+  // Busy time of the decoding thread and waiting time of the host thread.
+  double decode_ms = 0, wait_ms = 0;
+};
+
+static double MillisecondsSince(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - begin)
+      .count();
+}
+
+static void DeleteFrameLookahead(FrameLookahead* const lookahead) {
+  for (ImageMemoryDesc& frame : lookahead->frames) DeallocateImage(&frame);
+  delete lookahead;
+}
+
+// Does nothing if the buffers or the thread cannot be allocated: the frames
+// are then decoded when the host asks for them.
+static void StartFrameLookahead(const WebPAnimInfo& info, Data* const data) {
+  FrameLookahead* const lookahead = new (std::nothrow) FrameLookahead;
+  if (lookahead == nullptr) return;
+  lookahead->num_frames = info.frame_count;
+  for (ImageMemoryDesc& frame : lookahead->frames) {
+    if (!AllocateImage(&frame, (int32)info.canvas_width,
+                       (int32)info.canvas_height, /*num_channels=*/4,
+                       /*bit_depth=*/8)) {
+      LOG("/!\\ AllocateImage failed.");
+      DeleteFrameLookahead(lookahead);
+      return;
+    }
+  }
+
+  WebPAnimDecoder* const anim_decoder = data->anim_decoder;
+  const size_t frame_size = (size_t)info.canvas_width * info.canvas_height * 4;
+  const auto decode = [lookahead, anim_decoder, frame_size]() {
+    for (size_t i = 0; i < lookahead->num_frames; ++i) {
+      const size_t slot = i % kNumLookaheadFrames;
+      {
+        std::unique_lock<std::mutex> lock(lookahead->mutex);
+        lookahead->frame_released.wait(lock, [&]() {
+          return i < lookahead->num_released_frames + kNumLookaheadFrames ||
+                 lookahead->stop;
+        });
+        if (lookahead->stop) return;
+      }
+      // The slot is not read by the host thread until num_decoded_frames > i.
+      const std::chrono::steady_clock::time_point begin =
+          std::chrono::steady_clock::now();
+      uint8_t* buf;
+      int timestamp;
+      const bool decoded =
+          WebPAnimDecoderGetNext(anim_decoder, &buf, &timestamp);
+      if (decoded) {
+        memcpy(lookahead->frames[slot].pixels.data, buf, frame_size);
+        lookahead->timestamps[slot] = timestamp;
+      }
+      const double elapsed_ms = MillisecondsSince(begin);
+      {
+        std::lock_guard<std::mutex> lock(lookahead->mutex);
+        lookahead->decode_ms += elapsed_ms;
+        if (decoded) {
+          ++lookahead->num_decoded_frames;
+        } else {
+          LOG("/!\\ WebPAnimDecoderGetNext() failed");
+          lookahead->failed = true;
+        }
+      }
+      lookahead->frame_decoded.notify_one();
+      if (!decoded) return;
+    }
+  };
+  try {
+    lookahead->thread = std::thread(decode);
+  } catch (const std::exception& e) {
+    (void)e;
+    LOG("/!\\ Unable to start the decoding thread: " << e.what());
+    DeleteFrameLookahead(lookahead);
+    return;
+  }
+  data->frame_lookahead = lookahead;
+}
+
+// Returns false if there is no more frame, or on failure with *result set.
+static bool WaitForLookaheadFrame(FrameLookahead* const lookahead,
+                                  uint8_t** const buf, int* const timestamp,
+                                  int16* const result) {
+  std::unique_lock<std::mutex> lock(lookahead->mutex);
+  if (lookahead->num_released_frames >= lookahead->num_frames) return false;
+  const std::chrono::steady_clock::time_point begin =
+      std::chrono::steady_clock::now();
+  lookahead->frame_decoded.wait(lock, [&]() {
+    return lookahead->num_decoded_frames > lookahead->num_released_frames ||
+           lookahead->failed;
+  });
+  lookahead->wait_ms += MillisecondsSince(begin);
+  if (lookahead->num_decoded_frames <= lookahead->num_released_frames) {
+    *result = readErr;
+    return false;
+  }
+  const size_t slot = lookahead->num_released_frames % kNumLookaheadFrames;
+  *buf = (uint8_t*)lookahead->frames[slot].pixels.data;
+  *timestamp = lookahead->timestamps[slot];
+  return true;
+}
+
+// The frame returned by WaitForLookaheadFrame() was copied by the host.
+static void ReleaseLookaheadFrame(FrameLookahead* const lookahead) {
+  {
+    std::lock_guard<std::mutex> lock(lookahead->mutex);
+    ++lookahead->num_released_frames;
+  }
+  lookahead->frame_released.notify_one();
+}
+
+static void StopFrameLookahead(Data* const data) {
+  FrameLookahead* const lookahead = data->frame_lookahead;
+  if (lookahead == nullptr) return;
+  {
+    std::lock_guard<std::mutex> lock(lookahead->mutex);
+    lookahead->stop = true;
+  }
+  lookahead->frame_released.notify_one();
+  lookahead->thread.join();
+  LOG("Decoded " << lookahead->num_decoded_frames << " frames ahead in "
+                 << lookahead->decode_ms << " ms, the host waited "
+                 << lookahead->wait_ms << " ms for them.");
+  DeleteFrameLookahead(lookahead);
+  data->frame_lookahead = nullptr;
+}
+
+// Returns false if there is no more frame, or on failure with *result set.
+static bool GetNextFrame(Data* const data, uint8_t** const buf,
+                         int* const timestamp, int16* const result) {
+  if (data->frame_lookahead != nullptr) {
+    return WaitForLookaheadFrame(data->frame_lookahead, buf, timestamp,
+                                 result);
+  }
+  if (!WebPAnimDecoderHasMoreFrames(data->anim_decoder)) return false;
+  if (!WebPAnimDecoderGetNext(data->anim_decoder, buf, timestamp)) {
+    LOG("/!\\ WebPAnimDecoderGetNext() failed");
+    *result = readErr;
+    return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
 void InitAnimDecoder(FormatRecordPtr format_record, Data* const data,
                      int16* const result) {
   WebPData webp_data;
@@ -30,7 +203,8 @@ void InitAnimDecoder(FormatRecordPtr format_record, Data* const data,
     return;
   }
 
-  WebPAnimInfo info;
+  // Read here only: the lookahead thread may be using anim_decoder later.
+  WebPAnimInfo& info = data->anim_info;
   if (!WebPAnimDecoderGetInfo(data->anim_decoder, &info)) {
     LOG("/!\\ WebPAnimDecoderGetInfo() failed.");
     *result = readErr;
@@ -41,39 +215,138 @@ void InitAnimDecoder(FormatRecordPtr format_record, Data* const data,
     format_record->layerData = info.frame_count;
     data->last_frame_timestamp = 0;
     LOG("Will decode " << format_record->layerData << " frames.");
+    if (info.frame_count > 1) StartFrameLookahead(info, data);
   }
 
   if (*result != noErr) ReleaseAnimDecoder(format_record, data);
 }
 
+static void SetRect(FormatRecordPtr format_record, int32 top, int32 bottom) {
+  format_record->theRect.top = (int16)top;
+  format_record->theRect.bottom = (int16)bottom;
+  format_record->theRect.left = 0;
+  format_record->theRect.right = format_record->imageSize.h;
+  format_record->theRect32.top = top;
+  format_record->theRect32.bottom = bottom;
+  format_record->theRect32.left = 0;
+  format_record->theRect32.right = format_record->imageSize32.h;
+  // Leave blendMode and opacity as is, it works.
+}
+
+//------------------------------------------------------------------------------
+
+// Still images are sent to host by bands of rows, as soon as they are decoded.
+static const int32 kReadBandHeight = 256;
+static const size_t kDecodeChunkSize = (size_t)1 << 18;
+
+// Sends the rows of 'image' from *num_sent_rows to 'last_row' (excluded).
+static void SendRows(FormatRecordPtr format_record, const ImageMemoryDesc& image,
+                     int32 last_row, int32* const num_sent_rows,
+                     int16* const result) {
+  const size_t stride = image.pixels.rowBits / 8;
+  while (*result == noErr && *num_sent_rows < last_row) {
+    const int32 top = *num_sent_rows;
+    const int32 bottom = std::min(top + kReadBandHeight, last_row);
+    SetRect(format_record, top, bottom);
+    SetPlaneColRowBytes(format_record);
+    format_record->data = (uint8_t*)image.pixels.data + stride * top;
+    *result = format_record->advanceState();
+    format_record->data = nullptr;
+    *num_sent_rows = bottom;
+
+    if (format_record->progressProc != nullptr) {
+      format_record->progressProc(bottom, image.height);
+    }
+    if (*result == noErr && format_record->abortProc != nullptr &&
+        format_record->abortProc()) {
+      LOG("Cancelled at row " << bottom << ".");
+      *result = userCanceledErr;
+    }
+  }
+}
+
+// WebPAnimDecoder would keep two canvases. Here the only one is filled by a
+// WebPIDecoder given data->file_data by chunks, and the rows are sent to host
+// in between, while they are still in the cache.
+static void ReadStillImage(FormatRecordPtr format_record, Data* const data,
+                           int16* const result) {
+  const ImageMemoryDesc& image = data->decoded_image;
+  int32 num_sent_rows = 0;
+  if (image.pixels.data != nullptr) {  // Decoded by ReadFileData().
+    SendRows(format_record, image, image.height, &num_sent_rows, result);
+    DeallocateImage(&data->decoded_image);
+    return;
+  }
+
+  WebPIDecoder* const idec = NewIncrementalDecoder(data);
+  if (idec == nullptr) {
+    *result = memFullErr;
+    return;
+  }
+  const uint8_t* const file_data = (const uint8_t*)data->file_data;
+  size_t num_given_bytes = 0;
+  VP8StatusCode status = VP8_STATUS_SUSPENDED;
+  while (*result == noErr && status == VP8_STATUS_SUSPENDED &&
+         num_given_bytes < data->file_size) {
+    num_given_bytes =
+        std::min(num_given_bytes + kDecodeChunkSize, data->file_size);
+    status = WebPIUpdate(idec, file_data, num_given_bytes);
+
+    int last_row = 0;
+    if (status == VP8_STATUS_OK) {
+      last_row = image.height;
+    } else if (status == VP8_STATUS_SUSPENDED &&
+               WebPIDecodedArea(idec, nullptr, nullptr, nullptr, &last_row) !=
+                   nullptr) {
+      last_row -= last_row % kReadBandHeight;  // Only whole bands.
+    }
+    SendRows(format_record, image, last_row, &num_sent_rows, result);
+  }
+  WebPIDelete(idec);
+  DeallocateImage(&data->decoded_image);
+
+  if (*result == noErr && status != VP8_STATUS_OK) {
+    LOG("/!\\ WebPIUpdate() failed (" << status << ")");
+    *result = readErr;
+  }
+}
+
+//------------------------------------------------------------------------------
+
 void ReadOneFrame(FormatRecordPtr format_record, Data* const data,
                   int16* const result, int frame_counter) {
   START_TIMER(ReadOneFrame);
-  if (WebPAnimDecoderHasMoreFrames(data->anim_decoder)) {
+  if (data->anim_decoder == nullptr) {
+    ReadStillImage(format_record, data, result);
+  } else {
     uint8_t* buf;
     int timestamp;
-    if (!WebPAnimDecoderGetNext(data->anim_decoder, &buf, &timestamp)) {
-      LOG("/!\\ WebPAnimDecoderGetNext() failed");
-      *result = readErr;
+    if (!GetNextFrame(data, &buf, &timestamp, result)) {
+      format_record->data = nullptr;
       return;
     }
-    format_record->theRect.top = 0;
-    format_record->theRect.bottom = format_record->imageSize.v;
-    format_record->theRect.left = 0;
-    format_record->theRect.right = format_record->imageSize.h;
-    format_record->theRect32.top = 0;
-    format_record->theRect32.bottom = format_record->imageSize32.v;
-    format_record->theRect32.left = 0;
-    format_record->theRect32.right = format_record->imageSize32.h;
-    // Leave blendMode and opacity as is, it works.
-
+    SetRect(format_record, 0, format_record->imageSize32.v);
     SetPlaneColRowBytes(format_record);
 
     format_record->data = buf;
 
     *result = format_record->advanceState();
-    format_record->progressProc(1, 1);
     format_record->data = nullptr;
+    if (data->frame_lookahead != nullptr) {
+      ReleaseLookaheadFrame(data->frame_lookahead);
+    }
+
+    if (format_record->progressProc != nullptr &&
+        data->anim_info.frame_count > 0) {
+      format_record->progressProc(frame_counter + 1,
+                                  (int32)data->anim_info.frame_count);
+    }
+    if (*result == noErr && format_record->abortProc != nullptr &&
+        format_record->abortProc()) {
+      LOG("Cancelled at frame " << frame_counter << ".");
+      *result = userCanceledErr;
+      return;
+    }
 
     // Only rename the layer if it is an animated WebP.
     if (data->read_config.input.has_animation) {
@@ -85,17 +358,17 @@ void ReadOneFrame(FormatRecordPtr format_record, Data* const data,
       format_record->layerName = data->layer_name_buffer;
       data->last_frame_timestamp = timestamp;
     }
-  } else {
-    format_record->data = nullptr;
   }
   STOP_TIMER(ReadOneFrame);
 }
 
 void ReleaseAnimDecoder(FormatRecordPtr format_record, Data* const data) {
+  StopFrameLookahead(data);
   WebPAnimDecoderDelete(data->anim_decoder);
   data->anim_decoder = nullptr;
+  DeallocateImage(&data->decoded_image);
   format_record->data = nullptr;
-  Deallocate(&data->file_data);
+  ReleaseFileData(data);
 }
 
 //------------------------------------------------------------------------------
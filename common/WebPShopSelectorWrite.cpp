@@ -12,6 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <string>
+
 #include "PIFormat.h"
 #include "WebPShop.h"
 #include "WebPShopSelector.h"
@@ -41,38 +43,103 @@ void DoWriteStart(FormatRecordPtr format_record, Data* const data,
   LOG("colBytes: " << format_record->colBytes);
   LOG("rowBytes: " << format_record->rowBytes);
 
+  // The user can cancel the copy and the encoding from the progress bar.
+  Progress progress;
+  ProgressInit(format_record, &progress);
+  // Copy of the canvas, also used for the optional extra files.
+  ImageMemoryDesc image;
+
   if (data->encoded_data.bytes == nullptr) {
     // We could use format_record->data and DoWrite*() but we'd have to
     // handle RGB. Copy*() always return RGBA, which is needed for WebPEncode().
-    if (data->write_config.animation) {
+    // With the encode cache, the bitstream comes from a previous export or is
+    // kept in memory to be stored. DoWriteContinue() writes it to the file.
+    const bool use_cache = (data->write_config.encode_cache_size_mb > 0);
+    std::string cache_key;
+    // The target size is for the whole file, metadata included.
+    const WriteConfig encode_config =
+        FitTargetSizeToFile(data->write_config, data->metadata);
+
+    if (CanStreamAllLayers(data->write_config)) {
+      // Layers are read one at a time while the animation is encoded.
+      EncodeAllLayers(format_record, data, &progress, result,
+                      &data->encoded_data);
+    } else if (data->write_config.animation) {
       std::vector<FrameMemoryDesc> original_frames;
-      CopyAllLayers(format_record, data, result, &original_frames);
+      CopyAllLayers(format_record, data, &progress, result, &original_frames);
 
+      if (*result == noErr && use_cache) {
+        cache_key = GetEncodeCacheKey(original_frames, encode_config);
+      }
       if (*result == noErr &&
-          (!EncodeAllFrames(original_frames, data->write_config,
-                            &data->encoded_data) ||
-           data->encoded_data.bytes == nullptr ||
-           data->encoded_data.size == 0)) {
-        *result = writErr;
+          !(use_cache && LoadFromEncodeCache(cache_key, &data->encoded_data))) {
+        if (!EncodeAllFrames(original_frames, encode_config, &progress,
+                             &data->encoded_data) ||
+            data->encoded_data.bytes == nullptr ||
+            data->encoded_data.size == 0) {
+          *result = ProgressIsCanceled(&progress) ? userCanceledErr : writErr;
+        } else if (use_cache) {
+          StoreInEncodeCache(cache_key, data->encoded_data,
+                             data->write_config);
+        }
       }
       ClearFrameVector(&original_frames);
+    } else if (data->write_config.profile == EncoderProfile::LOW_MEMORY &&
+               CanStreamWholeCanvas(data->write_config)) {
+      // The canvas goes to the encoder by bands, without a whole copy.
+      EncodeWholeCanvasToFile(format_record, data, &progress, result);
     } else {  // !data->write_config.animation
-      ImageMemoryDesc image;
-      CopyWholeCanvas(format_record, data, result, &image);
-
-      if (*result == noErr &&
-          (!EncodeOneImage(image, data->write_config, &data->encoded_data) ||
-           data->encoded_data.bytes == nullptr ||
-           data->encoded_data.size == 0)) {
-        *result = writErr;
+      if (data->write_config.profile == EncoderProfile::LOW_MEMORY) {
+        LOG("The settings need a whole copy of the canvas.");
+      }
+      CopyWholeCanvas(format_record, data, /*keep_rgb=*/true, result, &image);
+
+      if (*result == noErr && use_cache) {
+        cache_key = GetEncodeCacheKey(image, encode_config);
+        if (!LoadFromEncodeCache(cache_key, &data->encoded_data)) {
+          if (!EncodeOneImage(image, encode_config, &progress,
+                              &data->encoded_data) ||
+              data->encoded_data.bytes == nullptr ||
+              data->encoded_data.size == 0) {
+            *result =
+                ProgressIsCanceled(&progress) ? userCanceledErr : writErr;
+          } else {
+            StoreInEncodeCache(cache_key, data->encoded_data,
+                               data->write_config);
+          }
+        }
+      } else {
+        // Nothing is kept in memory: the bitstream goes straight to the file.
+        EncodeOneImageToFile(image, encode_config, data->metadata,
+                             format_record, &progress, result);
       }
-      DeallocateImage(&image);
-    }
-    if (*result == noErr && !EncodeMetadata(data->write_config, data->metadata,
-                                            &data->encoded_data)) {
-      *result = writErr;
     }
   }
+
+  // The bitstream may come from the preview, without any canvas copy.
+  const bool needs_canvas = !data->write_config.animation &&
+                            (data->write_config.num_downscaled_copies > 0 ||
+                             data->write_config.thumbnail_size > 0 ||
+                             data->write_config.num_quality_rungs > 0);
+  if (*result == noErr && needs_canvas && image.pixels.data == nullptr) {
+    CopyWholeCanvas(format_record, data, /*keep_rgb=*/true, result, &image);
+  }
+  // The same canvas copy is downscaled or encoded for the optional extra files.
+  if (*result == noErr && needs_canvas) {
+    ExportDownscaledCopies(image, data->write_config, data->metadata,
+                           format_record, &progress, result);
+  }
+  if (*result == noErr && needs_canvas) {
+    ExportQualityLadder(image, data->write_config, data->metadata,
+                        format_record, &progress, result);
+  }
+  DeallocateImage(&image);
+
+  // Layers are copied again, one by one, to bound the memory.
+  if (*result == noErr) {
+    ExportLayersToFiles(format_record, data, &progress, result);
+  }
+
   RequestWholeCanvas(format_record, result);  // Prevent inf loop.
 
   if (*result != noErr) Deallocate(&format_record->data);
@@ -82,8 +149,10 @@ void DoWriteStart(FormatRecordPtr format_record, Data* const data,
 
 void DoWriteContinue(FormatRecordPtr format_record, Data* const data,
                      int16* const result) {
-  if (*result == noErr) {
-    WriteToFile(data->encoded_data, format_record, result);
+  // The image may have already been written by DoWriteStart().
+  if (*result == noErr && data->encoded_data.bytes != nullptr) {
+    WriteToFile(data->encoded_data, data->write_config, data->metadata,
+                format_record, result);
   }
 
   WebPDataClear(&data->encoded_data);
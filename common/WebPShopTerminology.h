@@ -18,10 +18,23 @@
 // Used by LoadWriteConfig() and SaveWriteConfig().
 #define keyWriteConfig_quality 'wrtq'
 #define keyWriteConfig_compression 'wrtc'
+#define keyWriteConfig_profile 'wrtu'
 #define keyWriteConfig_keep_exif 'wrte'
 #define keyWriteConfig_keep_xmp 'wrtx'
 #define keyWriteConfig_keep_color_profile 'wrtp'
 #define keyWriteConfig_loop_forever 'wrtl'
+#define keyWriteConfig_parallel_animation 'wrtg'
+#define keyWriteConfig_target_size 'wrts'
+#define keyWriteConfig_target_metric 'wrtm'
+#define keyWriteConfig_target_distortion 'wrtd'
+#define keyWriteConfig_race_lossless 'wrtr'
+#define keyWriteConfig_time_budget 'wrtb'
+#define keyWriteConfig_encode_cache_size 'wrtk'
+#define keyWriteConfig_num_downscaled_copies 'wrtv'
+#define keyWriteConfig_thumbnail_size 'wrtn'
+#define keyWriteConfig_quality_ladder 'wrta'
+#define keyWriteConfig_layers_to_files 'wrtf'
+#define keyWriteConfig_auto_preset 'wrto'
 #define keyUsePOSIX 'useP'
 
 // Used by AddComment() and WebPShop.r
@@ -0,0 +1,228 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "WebPShop.h"
+
+//------------------------------------------------------------------------------
+
+int GetNumWorkerThreads() {
+  const unsigned int num_cores = std::thread::hardware_concurrency();
+  if (num_cores < 1) return 1;  // Unknown.
+  return (int)std::min(num_cores, (unsigned int)MAX_NUM_WORKER_THREADS);
+}
+
+//------------------------------------------------------------------------------
+
+// Delay between two polls of the progress while waiting for the threads.
+static const std::chrono::milliseconds kProgressPollInterval(10);
+
+bool RunInParallel(size_t num_tasks, int num_threads,
+                   const std::function<bool(size_t task_index)>& task,
+                   Progress* const progress) {
+  if (num_tasks == 0) return true;
+  if (num_threads < 1) num_threads = 1;
+  if ((size_t)num_threads > num_tasks) num_threads = (int)num_tasks;
+
+  std::atomic<size_t> next_task_index(0);
+  std::atomic<bool> success(true);
+
+  // Each thread picks the next available task until there is none left or
+  // one of them failed. Results must be stored by task index by the caller so
+  // that the output does not depend on the scheduling.
+  const auto run_tasks = [&]() {
+    while (success) {
+      const size_t task_index = next_task_index++;
+      if (task_index >= num_tasks) break;
+      try {
+        if (!task(task_index)) success = false;
+      } catch (const std::exception& e) {
+        (void)e;
+        LOG("/!\\ Exception in task " << task_index << ": " << e.what());
+        success = false;
+      } catch (...) {
+        LOG("/!\\ Caught an unknown exception in task " << task_index << ".");
+        success = false;
+      }
+    }
+  };
+
+  if (num_threads == 1) {
+    run_tasks();
+    return success;
+  }
+
+  std::mutex mutex;
+  std::condition_variable thread_finished;
+  size_t num_finished_threads = 0;
+  const auto run_tasks_and_notify = [&]() {
+    run_tasks();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++num_finished_threads;
+    }
+    thread_finished.notify_one();
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve((size_t)num_threads);
+  try {
+    for (int i = 0; i < num_threads; ++i) {
+      threads.emplace_back(run_tasks_and_notify);
+    }
+  } catch (const std::exception& e) {
+    (void)e;
+    LOG("/!\\ Unable to start thread " << threads.size() << ": " << e.what());
+    // Carry on with the threads that could be created, if any.
+    if (threads.empty()) run_tasks();
+  }
+
+  // The host can only be called from this thread. Keep it responsive.
+  if (progress != nullptr && !threads.empty()) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!thread_finished.wait_for(lock, kProgressPollInterval, [&]() {
+      return num_finished_threads == threads.size();
+    })) {
+      lock.unlock();
+      if (!ProgressPoll(progress)) success = false;  // No new task.
+      lock.lock();
+    }
+  }
+  for (std::thread& thread : threads) thread.join();
+  return success;
+}
+
+//------------------------------------------------------------------------------
+
+bool RunPipelined(size_t num_items, size_t max_num_in_flight, int num_threads,
+                  const std::function<bool(size_t item_index)>& produce,
+                  const std::function<bool(size_t item_index)>& consume,
+                  Progress* const progress) {
+  if (num_items == 0) return true;
+  if (max_num_in_flight < 1) max_num_in_flight = 1;
+  if (num_threads < 1) num_threads = 1;
+  if ((size_t)num_threads > num_items) num_threads = (int)num_items;
+
+  std::atomic<bool> success(true);
+  const auto call = [&](const std::function<bool(size_t)>& function,
+                        size_t item_index) {
+    try {
+      if (!function(item_index)) success = false;
+    } catch (const std::exception& e) {
+      (void)e;
+      LOG("/!\\ Exception for item " << item_index << ": " << e.what());
+      success = false;
+    } catch (...) {
+      LOG("/!\\ Caught an unknown exception for item " << item_index << ".");
+      success = false;
+    }
+  };
+
+  std::mutex mutex;
+  std::condition_variable item_produced, item_consumed;
+  std::deque<size_t> queue;  // Produced items waiting for a worker.
+  size_t num_in_flight = 0;  // Produced but not consumed yet.
+  bool all_produced = false;
+  size_t num_finished_threads = 0;
+
+  // Each worker consumes the oldest produced item until there is none left
+  // or one of the calls failed.
+  const auto consume_items = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      item_produced.wait(lock, [&]() {
+        return !queue.empty() || all_produced || !success;
+      });
+      if (queue.empty() || !success) break;
+      const size_t item_index = queue.front();
+      queue.pop_front();
+      lock.unlock();
+      call(consume, item_index);
+      lock.lock();
+      --num_in_flight;
+      item_consumed.notify_all();
+    }
+    ++num_finished_threads;
+    item_consumed.notify_all();
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve((size_t)num_threads);
+  try {
+    for (int i = 0; i < num_threads; ++i) threads.emplace_back(consume_items);
+  } catch (const std::exception& e) {
+    (void)e;
+    LOG("/!\\ Unable to start thread " << threads.size() << ": " << e.what());
+  }
+  if (threads.empty()) {
+    // Fall back to producing and consuming each item in turn.
+    for (size_t i = 0; i < num_items && success; ++i) {
+      call(produce, i);
+      if (success) call(consume, i);
+    }
+    return success;
+  }
+
+  // Items are produced by this thread, which is the one allowed to call the
+  // host. It waits for a worker when too many items are in flight.
+  for (size_t i = 0; i < num_items && success; ++i) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (num_in_flight >= max_num_in_flight && success) {
+        if (!item_consumed.wait_for(lock, kProgressPollInterval, [&]() {
+              return num_in_flight < max_num_in_flight;
+            })) {
+          lock.unlock();
+          if (!ProgressPoll(progress)) success = false;
+          lock.lock();
+        }
+      }
+    }
+    if (!success) break;
+    call(produce, i);
+    if (!success) break;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(i);
+      ++num_in_flight;
+    }
+    item_produced.notify_one();
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    all_produced = true;
+    item_produced.notify_all();
+    while (!item_consumed.wait_for(lock, kProgressPollInterval, [&]() {
+      return num_finished_threads == threads.size();
+    })) {
+      lock.unlock();
+      if (!ProgressPoll(progress)) {
+        success = false;
+        item_produced.notify_all();  // Pending items are skipped.
+      }
+      lock.lock();
+    }
+  }
+  for (std::thread& thread : threads) thread.join();
+  return success;
+}
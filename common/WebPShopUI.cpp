@@ -23,10 +23,12 @@
 
 bool DoUI(WriteConfig* const write_config,
           const Metadata metadata[Metadata::kNum], SPPluginRef plugin_ref,
-          const std::vector<FrameMemoryDesc>& original_frames,
+          std::vector<FrameMemoryDesc>* const original_frames,
+          const FramesLoader& load_original_frames,
           bool original_frames_were_converted_to_8b,
           WebPData* const encoded_data, DisplayPixelsProc display_pixels_proc) {
   WebPShopDialog dialog(*write_config, metadata, original_frames,
+                        load_original_frames,
                         original_frames_were_converted_to_8b, encoded_data,
                         display_pixels_proc);
   int result = dialog.Modal(plugin_ref, NULL, 16090);
@@ -49,6 +51,12 @@ void WebPShopDialog::DiscardEncodedData(void) {
   update_cropped_compressed_frame_ = true;
 }
 
+bool WebPShopDialog::LoadOriginalFrames(void) {
+  if (!original_frames_->empty()) return true;
+  LOG("Reading the original frames for the preview.");
+  return load_original_frames_(original_frames_) && !original_frames_->empty();
+}
+
 void WebPShopDialog::OnError(void) {
   DiscardEncodedData();
   selection_in_compressed_frame_ = NullRect();
@@ -60,6 +68,90 @@ void WebPShopDialog::OnError(void) {
 
 //------------------------------------------------------------------------------
 
+// Caps the memory used by the encoded data and frames kept for later.
+static const size_t kMaxCacheSize = (size_t)256 << 20;
+
+// Returns whether encoding with both settings outputs the same bitstream.
+// Metadata and preview settings are only applied later, but the target sizes
+// must have been fitted to the kept metadata by FitTargetSizeToFile(). Must
+// list the same fields as HashSettings() in WebPShopEncodeCacheUtils.cpp.
+static bool HaveSameBitstream(const WriteConfig& a, const WriteConfig& b) {
+  return a.quality == b.quality && a.compression == b.compression &&
+         a.profile == b.profile &&
+         a.loop_forever == b.loop_forever && a.animation == b.animation &&
+         a.parallel_animation == b.parallel_animation &&
+         a.target_size == b.target_size &&
+         a.target_metric == b.target_metric &&
+         a.target_distortion == b.target_distortion &&
+         a.race_lossless == b.race_lossless &&
+         a.time_budget_ms == b.time_budget_ms &&
+         a.auto_preset == b.auto_preset;
+}
+
+void WebPShopDialog::CacheEncodedData(void) {
+  if (encoded_data_->bytes != nullptr && !compressed_frames_.empty()) {
+    size_t num_bytes = encoded_data_->size;
+    for (const FrameMemoryDesc& frame : compressed_frames_) {
+      num_bytes += (size_t)(frame.image.pixels.rowBits / 8) *
+                   (size_t)frame.image.height;
+    }
+    if (num_bytes <= kMaxCacheSize) {
+      cache_.push_front(CachedResult());
+      CachedResult& entry = cache_.front();
+      entry.write_config = encoded_write_config_;
+      entry.encoded_data = *encoded_data_;
+      WebPDataInit(encoded_data_);  // Ownership was transferred.
+      entry.compressed_frames.swap(compressed_frames_);
+      entry.num_bytes = num_bytes;
+      cache_num_bytes_ += num_bytes;
+
+      while (cache_num_bytes_ > kMaxCacheSize) {
+        CachedResult& oldest = cache_.back();
+        cache_num_bytes_ -= oldest.num_bytes;
+        WebPDataClear(&oldest.encoded_data);
+        ClearFrameVector(&oldest.compressed_frames);
+        cache_.pop_back();
+      }
+      LOG("Cached quality " << encoded_write_config_.quality << " ("
+                            << cache_.size() << " entries, "
+                            << cache_num_bytes_ << " bytes).");
+    }
+  }
+  DiscardEncodedData();
+}
+
+bool WebPShopDialog::TakeFromCache(const WriteConfig& encode_config) {
+  for (std::list<CachedResult>::iterator entry = cache_.begin();
+       entry != cache_.end(); ++entry) {
+    if (HaveSameBitstream(entry->write_config, encode_config)) {
+      DiscardEncodedData();
+      *encoded_data_ = entry->encoded_data;
+      compressed_frames_.swap(entry->compressed_frames);
+      cache_num_bytes_ -= entry->num_bytes;
+      cache_.erase(entry);  // Cached again once replaced, as the most recent.
+      LOG("Cache hit for quality " << write_config_.quality << " ("
+                                   << cache_.size() << " entries, "
+                                   << cache_num_bytes_ << " bytes).");
+      return true;
+    }
+  }
+  LOG("Cache miss for quality " << write_config_.quality << " ("
+                                << cache_.size() << " entries, "
+                                << cache_num_bytes_ << " bytes).");
+  return false;
+}
+
+void WebPShopDialog::ClearCache(void) {
+  for (CachedResult& entry : cache_) {
+    WebPDataClear(&entry.encoded_data);
+    ClearFrameVector(&entry.compressed_frames);
+  }
+  cache_.clear();
+  cache_num_bytes_ = 0;
+}
+
+//------------------------------------------------------------------------------
+
 void WebPShopDialog::Init(void) {
   PIDialogPtr dialog = GetDialog();
 
@@ -73,6 +165,9 @@ void WebPShopDialog::Init(void) {
   compression_radio_group_.SetGroupRange(kDCompressionFastest,
                                          kDCompressionSlowest);
 
+  profile_radio_group_.SetDialog(dialog);
+  profile_radio_group_.SetGroupRange(kDProfileStandard, kDProfileSmallAlpha);
+
   keep_exif_checkbox_.SetItem(GetItem(kDKeepExif));
   keep_xmp_checkbox_.SetItem(GetItem(kDKeepXmp));
   keep_color_profile_checkbox_.SetItem(GetItem(kDKeepColorProfile));
@@ -119,6 +214,9 @@ void WebPShopDialog::Init(void) {
     compression_radio_group_.SetSelected(kDCompressionSlowest);
   }
 
+  profile_radio_group_.SetSelected(kDProfileStandard +
+                                   (int16)write_config_.profile);
+
   if (metadata_[Metadata::kEXIF].chunk.bytes != nullptr &&
       metadata_[Metadata::kEXIF].chunk.size > 0) {
     keep_exif_checkbox_.SetChecked(write_config_.keep_exif);
@@ -202,15 +300,19 @@ void WebPShopDialog::PaintProxy(void) {
   const VRect crop_area = GetCropAreaRectInWindow(proxy_area);
 
   if (encoded_data_->bytes == nullptr) {
-    if (write_config_.animation) {
-      if (original_frames_.empty()) {
-        LOG("/!\\ No frame to encode.");
-        OnError();
-        ClearProxyArea();
-        return;
-      }
-
-      if (!EncodeAllFrames(original_frames_, write_config_, encoded_data_) ||
+    // The target size is for the whole file, metadata included.
+    const WriteConfig encode_config =
+        FitTargetSizeToFile(write_config_, metadata_);
+    if (TakeFromCache(encode_config)) {
+      // Already encoded and decoded with these settings.
+    } else if (!LoadOriginalFrames()) {
+      LOG("/!\\ No frame to encode.");
+      OnError();
+      ClearProxyArea();
+      return;
+    } else if (write_config_.animation) {
+      if (!EncodeAllFrames(*original_frames_, encode_config,
+                           /*progress=*/nullptr, encoded_data_) ||
           encoded_data_->size == 0) {
         LOG("/!\\ Encoding failed.");
         OnError();
@@ -218,45 +320,27 @@ void WebPShopDialog::PaintProxy(void) {
         return;
       }
 
-      if (!EncodeMetadata(write_config_, metadata_, encoded_data_)) {
-        LOG("/!\\ Metadata muxing failed.");
-        OnError();
-        ClearProxyArea();
-        return;
-      }
-
       // The number of original and compressed frames might differ
       // if there are identical ones; don't check equality.
-      if (!DecodeAllFrames(*encoded_data_, &compressed_frames_) ||
+      if (!DecodeAllFrames(*encoded_data_, /*progress=*/nullptr,
+                           &compressed_frames_) ||
           compressed_frames_.empty()) {
         LOG("/!\\ Decoding failed.");
         OnError();
         ClearProxyArea();
         return;
       }
-
-      // Number of frames might also change between qualities.
-      frame_slider_.SetItem(dialog, kDFrameSlider, 0,
-                            (int)compressed_frames_.size() - 1);
-      frame_field_.SetItem(dialog, kDFrameField, 1,
-                           (int)compressed_frames_.size());
-
-      if (frame_index_ >= compressed_frames_.size()) {
-        frame_index_ = compressed_frames_.size() - 1;
-      }
-
-      frame_slider_.SetValue((int)frame_index_);
-      frame_field_.SetValue((int)frame_index_ + 1);
     } else {  // !write_config_.animation
-      if (original_frames_.size() != 1) {
+      if (original_frames_->size() != 1) {
         LOG("/!\\ Need exactly one image to encode.");
         OnError();
         ClearProxyArea();
         return;
       }
 
-      const ImageMemoryDesc& original_image = original_frames_.front().image;
-      if (!EncodeOneImage(original_image, write_config_, encoded_data_) ||
+      const ImageMemoryDesc& original_image = original_frames_->front().image;
+      if (!EncodeOneImage(original_image, encode_config, /*progress=*/nullptr,
+                          encoded_data_) ||
           encoded_data_->size == 0) {
         LOG("/!\\ Encoding failed.");
         OnError();
@@ -264,16 +348,11 @@ void WebPShopDialog::PaintProxy(void) {
         return;
       }
 
-      if (!EncodeMetadata(write_config_, metadata_, encoded_data_)) {
-        LOG("/!\\ Metadata muxing failed.");
-        OnError();
-        ClearProxyArea();
-        return;
-      }
-
       ResizeFrameVector(&compressed_frames_, 1);
 
       ImageMemoryDesc& compressed_frame = compressed_frames_.front().image;
+      // Decoded rather than taken from the encoder (show_compressed): that
+      // reconstruction skips the in-loop filter, so it differs from the file.
       if (!DecodeOneImage(*encoded_data_, &compressed_frame) ||
           (compressed_frame.width != original_image.width) ||
           (compressed_frame.height != original_image.height)) {
@@ -282,7 +361,23 @@ void WebPShopDialog::PaintProxy(void) {
         ClearProxyArea();
         return;
       }
+    }
+    encoded_write_config_ = encode_config;
 
+    if (write_config_.animation) {
+      // Number of frames might also change between qualities.
+      frame_slider_.SetItem(dialog, kDFrameSlider, 0,
+                            (int)compressed_frames_.size() - 1);
+      frame_field_.SetItem(dialog, kDFrameField, 1,
+                           (int)compressed_frames_.size());
+
+      if (frame_index_ >= compressed_frames_.size()) {
+        frame_index_ = compressed_frames_.size() - 1;
+      }
+
+      frame_slider_.SetValue((int)frame_index_);
+      frame_field_.SetValue((int)frame_index_ + 1);
+    } else {
       frame_index_ = 0;
     }
 
@@ -308,7 +403,8 @@ void WebPShopDialog::PaintProxy(void) {
     }
   }
 
-  proxy_checkbox_.SetText("Preview: " + DataSizeToString(encoded_data_->size));
+  proxy_checkbox_.SetText("Preview: " + DataSizeToString(
+      GetFileSize(*encoded_data_, write_config_, metadata_)));
 
   if (update_cropped_compressed_frame_) {
     ImageMemoryDesc& compressed_frame = compressed_frames_[frame_index_].image;
@@ -419,7 +515,7 @@ void WebPShopDialog::Notify(int32 item) {
     if (write_config_.quality != quality) {
       write_config_.quality = quality;
       quality_field_.SetValueIfDifferent(quality);
-      DiscardEncodedData();
+      CacheEncodedData();
       ForceRepaint();
     }
   } else if (item == kDQualityField) {
@@ -427,7 +523,7 @@ void WebPShopDialog::Notify(int32 item) {
     if (quality >= 0 && quality <= 100 && write_config_.quality != quality) {
       write_config_.quality = quality;
       quality_slider_.SetValueIfDifferent(quality);
-      DiscardEncodedData();
+      CacheEncodedData();
       ForceRepaint();
     }
   } else if (item >= kDCompressionFastest && item <= kDCompressionSlowest) {
@@ -442,35 +538,46 @@ void WebPShopDialog::Notify(int32 item) {
     }
     if (write_config_.compression != compression) {
       write_config_.compression = compression;
-      DiscardEncodedData();
+      CacheEncodedData();
+      ForceRepaint();
+    }
+  } else if (item >= kDProfileStandard && item <= kDProfileSmallAlpha) {
+    profile_radio_group_.SetSelected(item);
+    const EncoderProfile profile = (EncoderProfile)(item - kDProfileStandard);
+    if (write_config_.profile != profile) {
+      write_config_.profile = profile;
+      CacheEncodedData();
       ForceRepaint();
     }
   } else if (item == kDKeepExif) {
     bool keep_exif = keep_exif_checkbox_.GetChecked();
     if (write_config_.keep_exif != keep_exif) {
       write_config_.keep_exif = keep_exif;
-      DiscardEncodedData();
+      // The bitstream only changes if it is fitted to a target size.
+      if (write_config_.target_size > 0) CacheEncodedData();
       ForceRepaint();
     }
   } else if (item == kDKeepXmp) {
     bool keep_xmp = keep_xmp_checkbox_.GetChecked();
     if (write_config_.keep_xmp != keep_xmp) {
       write_config_.keep_xmp = keep_xmp;
-      DiscardEncodedData();
+      // The bitstream only changes if it is fitted to a target size.
+      if (write_config_.target_size > 0) CacheEncodedData();
       ForceRepaint();
     }
   } else if (item == kDKeepColorProfile) {
     bool keep_color_profile = keep_color_profile_checkbox_.GetChecked();
     if (write_config_.keep_color_profile != keep_color_profile) {
       write_config_.keep_color_profile = keep_color_profile;
-      DiscardEncodedData();
+      // The bitstream only changes if it is fitted to a target size.
+      if (write_config_.target_size > 0) CacheEncodedData();
       ForceRepaint();
     }
   } else if (item == kDLoopForever) {
     bool loop_forever = loop_forever_checkbox_.GetChecked();
     if (write_config_.loop_forever != loop_forever) {
       write_config_.loop_forever = loop_forever;
-      DiscardEncodedData();
+      CacheEncodedData();
       ForceRepaint();
     }
   } else if (item == kDProxyCheckbox) {
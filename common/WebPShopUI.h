@@ -15,6 +15,8 @@
 #ifndef __WebPShopUI_H__
 #define __WebPShopUI_H__
 
+#include <list>
+
 #include "PIUI.h"
 #include "WebPShop.h"
 
@@ -31,6 +33,10 @@ const int16 kDQualityField = 12;
 const int16 kDCompressionFastest = 21;
 const int16 kDCompressionDefault = 22;
 const int16 kDCompressionSlowest = 23;
+const int16 kDProfileStandard = 51;
+const int16 kDProfileMultithreaded = 52;
+const int16 kDProfileLowMemory = 53;
+const int16 kDProfileSmallAlpha = 54;
 const int16 kDKeepExif = 33;
 const int16 kDKeepXmp = 34;
 const int16 kDKeepColorProfile = 35;
@@ -112,6 +118,7 @@ class WebPShopDialog : public PIDialog {
   PISlider quality_slider_;
   PIIntegerField quality_field_;
   PIRadioGroup compression_radio_group_;
+  PIRadioGroup profile_radio_group_;
   PICheckBox keep_exif_checkbox_;
   PICheckBox keep_xmp_checkbox_;
   PICheckBox keep_color_profile_checkbox_;
@@ -129,8 +136,9 @@ class WebPShopDialog : public PIDialog {
   size_t frame_index_;
   VRect selection_in_compressed_frame_;
 
-  // Before encoding
-  const std::vector<FrameMemoryDesc>& original_frames_;
+  // Before encoding, read on demand if empty.
+  std::vector<FrameMemoryDesc>* const original_frames_;
+  const FramesLoader load_original_frames_;
   const bool original_frames_were_converted_to_8b_;
   // After encoding
   WebPData* const encoded_data_;
@@ -139,6 +147,20 @@ class WebPShopDialog : public PIDialog {
   std::vector<FrameMemoryDesc> scaled_compressed_frames_;
   ImageMemoryDesc cropped_compressed_frame_;
   bool update_cropped_compressed_frame_;  // If frame or selection changed.
+  // Settings used for *encoded_data_ and compressed_frames_, with the target
+  // size fitted to the kept metadata.
+  WriteConfig encoded_write_config_;
+
+  // Previous results, the most recently used first, to revisit settings
+  // without encoding again.
+  struct CachedResult {
+    WriteConfig write_config;
+    WebPData encoded_data;
+    std::vector<FrameMemoryDesc> compressed_frames;
+    size_t num_bytes;
+  };
+  std::list<CachedResult> cache_;
+  size_t cache_num_bytes_;
 
   // Adobe SDK portable display function
   DisplayPixelsProc display_pixels_proc_;
@@ -147,6 +169,14 @@ class WebPShopDialog : public PIDialog {
   void DiscardEncodedData(void);
   void OnError(void);
 
+  bool LoadOriginalFrames(void);  // Returns false if none could be read.
+
+  // Cache
+  void CacheEncodedData(void);  // Then discards it.
+  // Replaces the current data if found.
+  bool TakeFromCache(const WriteConfig& encode_config);
+  void ClearCache(void);
+
   // Platform-dependent
   PIItem GetItem(short item);
   void ShowItem(short item);
@@ -168,7 +198,8 @@ class WebPShopDialog : public PIDialog {
  public:
   WebPShopDialog(const WriteConfig& write_config,
                  const Metadata metadata[Metadata::kNum],
-                 const std::vector<FrameMemoryDesc>& original_frames,
+                 std::vector<FrameMemoryDesc>* const original_frames,
+                 const FramesLoader& load_original_frames,
                  bool original_frames_were_converted_to_8b,
                  WebPData* const encoded_data,
                  DisplayPixelsProc display_pixels_proc)
@@ -177,6 +208,7 @@ class WebPShopDialog : public PIDialog {
         quality_slider_(),
         quality_field_(),
         compression_radio_group_(),
+        profile_radio_group_(),
         keep_exif_checkbox_(),
         keep_xmp_checkbox_(),
         keep_color_profile_checkbox_(),
@@ -190,6 +222,7 @@ class WebPShopDialog : public PIDialog {
         frame_index_(0),
         selection_in_compressed_frame_(),
         original_frames_(original_frames),
+        load_original_frames_(load_original_frames),
         original_frames_were_converted_to_8b_(
             original_frames_were_converted_to_8b),
         encoded_data_(encoded_data),
@@ -197,8 +230,14 @@ class WebPShopDialog : public PIDialog {
         scaled_compressed_frames_(),
         cropped_compressed_frame_(),
         update_cropped_compressed_frame_(true),
+        encoded_write_config_(write_config),
+        cache_(),
+        cache_num_bytes_(0),
         display_pixels_proc_(display_pixels_proc) {}
-  ~WebPShopDialog() { DeallocateCompressedFrames(); }
+  ~WebPShopDialog() {
+    DeallocateCompressedFrames();
+    ClearCache();
+  }
 
   void DeallocateCompressedFrames(void);
   const WriteConfig& GetWriteConfig(void) const { return write_config_; }
@@ -70,6 +70,12 @@ struct Dialog {
   NSButton* compression_radio_button_default = nullptr;
   NSButton* compression_radio_button_smallest = nullptr;
 
+  NSBox* profile_box = nullptr;
+  NSButton* profile_radio_button_standard = nullptr;
+  NSButton* profile_radio_button_multithreaded = nullptr;
+  NSButton* profile_radio_button_low_memory = nullptr;
+  NSButton* profile_radio_button_small_alpha = nullptr;
+
   NSBox* metadata_box = nullptr;
   NSButton* metadata_exif_checkbox = nullptr;
   NSButton* metadata_xmp_checkbox = nullptr;
@@ -195,6 +195,47 @@ NSWindow* Dialog::CreateWindow(WebPShopDelegate* const delegate) {
   [[window contentView] addSubview:compression_radio_button_smallest];
   [compression_radio_button_smallest setFrame:NSMakeRect(220, 453, 66, 20)];
   [compression_radio_button_smallest setFont:[NSFont systemFontOfSize:11]];
+
+  LOG("  Profile elements");
+  Set(kDNone, profile_box =
+                  [[NSBox alloc] initWithFrame:NSMakeRect(502, 440, 95, 92)]);
+  [[window contentView] addSubview:profile_box];
+  [profile_box setTitle:@"Profile"];
+
+  // Radio buttons sharing a superview and an action are exclusive, so these
+  // are kept apart from the compression ones.
+  Set(kDProfileStandard, profile_radio_button_standard = [NSButton
+                             radioButtonWithTitle:@"Standard"
+                                           target:delegate
+                                           action:@selector(notified:)]);
+  [[profile_box contentView] addSubview:profile_radio_button_standard];
+  [profile_radio_button_standard setFrame:NSMakeRect(4, 49, 86, 16)];
+  [profile_radio_button_standard setFont:[NSFont systemFontOfSize:11]];
+
+  Set(kDProfileMultithreaded, profile_radio_button_multithreaded = [NSButton
+                                  radioButtonWithTitle:@"Multithreaded"
+                                                target:delegate
+                                                action:@selector(notified:)]);
+  [[profile_box contentView] addSubview:profile_radio_button_multithreaded];
+  [profile_radio_button_multithreaded setFrame:NSMakeRect(4, 34, 86, 16)];
+  [profile_radio_button_multithreaded setFont:[NSFont systemFontOfSize:11]];
+
+  Set(kDProfileLowMemory, profile_radio_button_low_memory = [NSButton
+                              radioButtonWithTitle:@"Low memory"
+                                            target:delegate
+                                            action:@selector(notified:)]);
+  [[profile_box contentView] addSubview:profile_radio_button_low_memory];
+  [profile_radio_button_low_memory setFrame:NSMakeRect(4, 19, 86, 16)];
+  [profile_radio_button_low_memory setFont:[NSFont systemFontOfSize:11]];
+
+  Set(kDProfileSmallAlpha, profile_radio_button_small_alpha = [NSButton
+                               radioButtonWithTitle:@"Small alpha"
+                                             target:delegate
+                                             action:@selector(notified:)]);
+  [[profile_box contentView] addSubview:profile_radio_button_small_alpha];
+  [profile_radio_button_small_alpha setFrame:NSMakeRect(4, 4, 86, 16)];
+  [profile_radio_button_small_alpha setFont:[NSFont systemFontOfSize:11]];
+
   
   LOG("  Metadata elements");
   Set(kDNone, metadata_box =